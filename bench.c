@@ -0,0 +1,386 @@
+
+/*
+Benchmark driver for the simplefs core.
+
+Formats a scratch image and runs a fixed set of workloads through the fs.h
+handle API.  Each workload prints one line of JSON on stdout with its wall
+time, throughput, block I/O counts and per-call latency percentiles, so runs
+can be compared by a script.  Everything is seeded, so two runs on the same
+build do the same work.
+*/
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define BENCH_BLOCKS     20000 //size of the scratch image used by the file workloads
+#define BENCH_CHUNK      16384 //bytes per fs_read/fs_write call in the streaming workloads
+#define BENCH_FILE_SIZE  (16 * 1024 * 1024) //runs through the direct, indirect and double-indirect pointers
+#define BENCH_RANDOM_OPS 4000
+#define BENCH_SMALL_FILES 1000
+#define BENCH_SMALL_SIZE 1024
+#define BENCH_BATCH      100 //inodes per fs_create_batch call
+#define BENCH_CHURN_OPS  2000
+#define BENCH_TRUNCATE_STEP (1024 * 1024) //bytes cut off the big file per fs_truncate call
+#define BENCH_SPARSE_WRITES 400 //single blocks written into a file of BENCH_FILE_SIZE that starts as one hole
+
+struct workload {
+    const char *name;
+    struct disk *disk;
+    struct disk_stats before;
+    double start;
+    double *latency; //seconds per call
+    int ops;
+    int maxops;
+    long long bytes;
+};
+
+static FILE *out;
+static int backend = DISK_BACKEND_FILE;
+static int cachesize = -1;
+static int formatmode = FS_FORMAT_FAST;
+static const char *image = "bench.img";
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles( const void *a, const void *b )
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void workload_begin( struct workload *w, const char *name, struct disk *disk, int maxops )
+{
+    w->name = name;
+    w->disk = disk;
+    w->latency = malloc(sizeof(double) * (maxops ? maxops : 1));
+    w->ops = 0;
+    w->maxops = maxops;
+    w->bytes = 0;
+    disk_stats_r(disk,&w->before);
+    w->start = now();
+}
+
+//record one call that started at 'start' and moved 'bytes' bytes
+static void workload_op( struct workload *w, double start, int bytes )
+{
+    if(w->ops < w->maxops) w->latency[w->ops++] = now() - start;
+    w->bytes += bytes;
+}
+
+static double percentile( const double *sorted, int n, double p )
+{
+    int i;
+    if(n == 0) return 0;
+    i = (int)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+static void workload_end( struct workload *w, const char *extra )
+{
+    struct disk_stats after;
+    double elapsed = now() - w->start;
+
+    disk_stats_r(w->disk,&after);
+    qsort(w->latency,w->ops,sizeof(double),compare_doubles);
+
+    fprintf(out,"{\"workload\":\"%s\",\"ops\":%d,\"bytes\":%lld,\"seconds\":%.6f,",w->name,w->ops,w->bytes,elapsed);
+    fprintf(out,"\"mb_per_sec\":%.2f,\"ops_per_sec\":%.1f,",elapsed > 0 ? w->bytes / elapsed / 1e6 : 0,elapsed > 0 ? w->ops / elapsed : 0);
+    fprintf(out,"\"block_reads\":%d,\"block_writes\":%d,\"cache_hits\":%d,\"cache_misses\":%d,\"coalesced\":%d,",
+        after.reads - w->before.reads,after.writes - w->before.writes,
+        after.hits - w->before.hits,after.misses - w->before.misses,
+        after.coalesced - w->before.coalesced);
+    fprintf(out,"\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f%s%s}\n",
+        percentile(w->latency,w->ops,0.50) * 1e6,percentile(w->latency,w->ops,0.90) * 1e6,
+        percentile(w->latency,w->ops,0.99) * 1e6,w->ops ? w->latency[w->ops-1] * 1e6 : 0,
+        extra ? "," : "",extra ? extra : "");
+    fflush(out);
+
+    free(w->latency);
+}
+
+static struct disk *open_scratch( int nblocks )
+{
+    struct disk *disk;
+
+    unlink(image);
+    disk = disk_open(image,nblocks,backend);
+    if(!disk) {
+        fprintf(stderr,"couldn't open %s: %s\n",image,strerror(errno));
+        exit(1);
+    }
+    if(cachesize >= 0) disk_cache_resize_r(disk,cachesize);
+    return disk;
+}
+
+static void fill( char *data, int length, unsigned *seed )
+{
+    int i;
+    for(i = 0; i < length; i += 1) data[i] = rand_r(seed);
+}
+
+//stream one large file in and out, crossing from the direct pointers into the indirect and double-indirect blocks
+static void bench_sequential( struct fs *fs, struct disk *disk, char *buffer )
+{
+    struct workload w;
+    unsigned seed = 1;
+    int inumber, offset, length;
+    double t;
+
+    inumber = fs_create_r(fs);
+    fill(buffer,BENCH_CHUNK,&seed);
+
+    workload_begin(&w,"seq_write",disk,BENCH_FILE_SIZE / BENCH_CHUNK + 1);
+    for(offset = 0; offset < BENCH_FILE_SIZE; offset += length) {
+        length = BENCH_FILE_SIZE - offset < BENCH_CHUNK ? BENCH_FILE_SIZE - offset : BENCH_CHUNK;
+        t = now();
+        workload_op(&w,t,fs_write_r(fs,inumber,buffer,length,offset));
+    }
+    disk_sync_r(disk);
+    workload_end(&w,0);
+
+    workload_begin(&w,"seq_read",disk,BENCH_FILE_SIZE / BENCH_CHUNK + 1);
+    for(offset = 0; offset < BENCH_FILE_SIZE; offset += length) {
+        length = BENCH_FILE_SIZE - offset < BENCH_CHUNK ? BENCH_FILE_SIZE - offset : BENCH_CHUNK;
+        t = now();
+        workload_op(&w,t,fs_read_r(fs,inumber,buffer,length,offset));
+    }
+    workload_end(&w,0);
+
+    //single-block reads at random offsets in the same file
+    workload_begin(&w,"random_read",disk,BENCH_RANDOM_OPS);
+    for(length = 0; length < BENCH_RANDOM_OPS; length += 1) {
+        offset = rand_r(&seed) % (BENCH_FILE_SIZE - DISK_BLOCK_SIZE);
+        t = now();
+        workload_op(&w,t,fs_read_r(fs,inumber,buffer,DISK_BLOCK_SIZE,offset));
+    }
+    workload_end(&w,0);
+
+    //cut the file down to nothing a piece at a time
+    workload_begin(&w,"truncate",disk,BENCH_FILE_SIZE / BENCH_TRUNCATE_STEP + 1);
+    for(offset = BENCH_FILE_SIZE - BENCH_TRUNCATE_STEP; offset >= 0; offset -= BENCH_TRUNCATE_STEP) {
+        t = now();
+        fs_truncate_r(fs,inumber,offset);
+        workload_op(&w,t,0);
+    }
+    fs_sync_r(fs);
+    workload_end(&w,0);
+
+    fs_delete_r(fs,inumber);
+}
+
+//a big file that is mostly hole: scattered single-block writes into it, then a read of the whole thing
+static void bench_sparse( struct fs *fs, struct disk *disk, char *buffer )
+{
+    struct workload w;
+    unsigned seed = 3;
+    int inumber, offset, length, i;
+    double t;
+
+    inumber = fs_create_r(fs);
+    fs_truncate_r(fs,inumber,BENCH_FILE_SIZE);
+    fill(buffer,BENCH_CHUNK,&seed);
+
+    workload_begin(&w,"sparse_write",disk,BENCH_SPARSE_WRITES);
+    for(i = 0; i < BENCH_SPARSE_WRITES; i += 1) {
+        offset = rand_r(&seed) % (BENCH_FILE_SIZE / DISK_BLOCK_SIZE) * DISK_BLOCK_SIZE;
+        t = now();
+        workload_op(&w,t,fs_write_r(fs,inumber,buffer,DISK_BLOCK_SIZE,offset));
+    }
+    disk_sync_r(disk);
+    workload_end(&w,0);
+
+    workload_begin(&w,"sparse_read",disk,BENCH_FILE_SIZE / BENCH_CHUNK + 1);
+    for(offset = 0; offset < BENCH_FILE_SIZE; offset += length) {
+        length = BENCH_FILE_SIZE - offset < BENCH_CHUNK ? BENCH_FILE_SIZE - offset : BENCH_CHUNK;
+        t = now();
+        workload_op(&w,t,fs_read_r(fs,inumber,buffer,length,offset));
+    }
+    workload_end(&w,0);
+
+    fs_delete_r(fs,inumber);
+}
+
+//many small files: one create and one write each, then read them all back
+static void bench_small_files( struct fs *fs, struct disk *disk, char *buffer )
+{
+    struct workload w;
+    unsigned seed = 2;
+    int inumbers[BENCH_SMALL_FILES];
+    int i;
+    double t;
+
+    fill(buffer,BENCH_SMALL_SIZE,&seed);
+
+    workload_begin(&w,"small_create_write",disk,BENCH_SMALL_FILES);
+    for(i = 0; i < BENCH_SMALL_FILES; i += 1) {
+        t = now();
+        inumbers[i] = fs_create_r(fs);
+        workload_op(&w,t,fs_write_r(fs,inumbers[i],buffer,BENCH_SMALL_SIZE,0));
+    }
+    disk_sync_r(disk);
+    workload_end(&w,0);
+
+    workload_begin(&w,"small_read",disk,BENCH_SMALL_FILES);
+    for(i = 0; i < BENCH_SMALL_FILES; i += 1) {
+        t = now();
+        workload_op(&w,t,fs_read_r(fs,inumbers[i],buffer,BENCH_SMALL_SIZE,0));
+    }
+    workload_end(&w,0);
+
+    workload_begin(&w,"small_delete",disk,BENCH_SMALL_FILES);
+    for(i = 0; i < BENCH_SMALL_FILES; i += 1) {
+        t = now();
+        fs_delete_r(fs,inumbers[i]);
+        workload_op(&w,t,0);
+    }
+    disk_sync_r(disk);
+    workload_end(&w,0);
+
+    workload_begin(&w,"batch_create",disk,BENCH_SMALL_FILES / BENCH_BATCH);
+    for(i = 0; i < BENCH_SMALL_FILES; i += BENCH_BATCH) {
+        t = now();
+        fs_create_batch_r(fs,&inumbers[i],BENCH_BATCH);
+        workload_op(&w,t,0);
+    }
+    disk_sync_r(disk);
+    workload_end(&w,0);
+
+    workload_begin(&w,"batch_delete",disk,BENCH_SMALL_FILES / BENCH_BATCH);
+    for(i = 0; i < BENCH_SMALL_FILES; i += BENCH_BATCH) {
+        t = now();
+        fs_delete_batch_r(fs,&inumbers[i],BENCH_BATCH);
+        workload_op(&w,t,0);
+    }
+    disk_sync_r(disk);
+    workload_end(&w,0);
+}
+
+//create, write a few blocks and delete, over and over, with a handful of files alive at once
+static void bench_churn( struct fs *fs, struct disk *disk, char *buffer )
+{
+    struct workload w;
+    unsigned seed = 3;
+    int live[16] = {0};
+    int i, slot, length;
+    double t;
+
+    fill(buffer,BENCH_CHUNK,&seed);
+
+    workload_begin(&w,"churn",disk,BENCH_CHURN_OPS);
+    for(i = 0; i < BENCH_CHURN_OPS; i += 1) {
+        slot = rand_r(&seed) % 16;
+        length = 1 + rand_r(&seed) % BENCH_CHUNK;
+        t = now();
+        if(live[slot]) fs_delete_r(fs,live[slot]);
+        live[slot] = fs_create_r(fs);
+        workload_op(&w,t,fs_write_r(fs,live[slot],buffer,length,0));
+    }
+    for(slot = 0; slot < 16; slot += 1) {
+        if(live[slot]) fs_delete_r(fs,live[slot]);
+    }
+    disk_sync_r(disk);
+    workload_end(&w,0);
+}
+
+//mount time against disk size, from the stored bitmap and from a full rescan
+static void bench_mount( int nblocks )
+{
+    struct workload w;
+    struct disk *disk = open_scratch(nblocks);
+    struct fs *fs = fs_open(disk), *other;
+    char name[64], extra[64];
+    double t;
+
+    fs_format_mode_r(fs,formatmode);
+    sprintf(extra,"\"disk_blocks\":%d",nblocks);
+
+    sprintf(name,"mount_clean");
+    workload_begin(&w,name,disk,1);
+    t = now();
+    fs_mount_r(fs);
+    workload_op(&w,t,0);
+    workload_end(&w,extra);
+
+    //the first handle left the image marked in use, so a second handle has to rebuild the bitmap
+    other = fs_open(disk);
+    sprintf(name,"mount_rescan");
+    workload_begin(&w,name,disk,1);
+    t = now();
+    fs_mount_r(other);
+    workload_op(&w,t,0);
+    workload_end(&w,extra);
+
+    fs_close(other);
+    fs_close(fs);
+    disk_close_r(disk);
+}
+
+int main( int argc, char *argv[] )
+{
+    struct disk *disk;
+    struct fs *fs;
+    char *buffer;
+    int opt, verbose = 0, stdoutfd;
+
+    while((opt = getopt(argc,argv,"mdc:ev"))!=-1) {
+        if(opt=='m') {
+            backend = DISK_BACKEND_MMAP;
+        } else if(opt=='d') {
+            backend = DISK_BACKEND_DIRECT;
+        } else if(opt=='e') {
+            formatmode = FS_FORMAT_FAST | FS_FORMAT_EXTENTS;
+        } else if(opt=='c') {
+            cachesize = atoi(optarg);
+        } else if(opt=='v') {
+            verbose = 1;
+        } else {
+            fprintf(stderr,"use: %s [-m|-d] [-c cacheblocks] [-e] [-v] [scratchimage]\n",argv[0]);
+            return 1;
+        }
+    }
+    if(optind < argc) image = argv[optind];
+
+    //results go to the real stdout; the messages the library prints are dropped unless -v is given
+    stdoutfd = dup(1);
+    out = fdopen(stdoutfd,"w");
+    if(!verbose) freopen("/dev/null","w",stdout);
+
+    buffer = malloc(BENCH_FILE_SIZE);
+
+    disk = open_scratch(BENCH_BLOCKS);
+    fs = fs_open(disk);
+    if(!fs_format_mode_r(fs,formatmode) || !fs_mount_r(fs)) {
+        fprintf(stderr,"couldn't set up a filesystem on %s\n",image);
+        return 1;
+    }
+
+    bench_sequential(fs,disk,buffer);
+    bench_sparse(fs,disk,buffer);
+    bench_small_files(fs,disk,buffer);
+    bench_churn(fs,disk,buffer);
+
+    fs_close(fs);
+    disk_close_r(disk);
+
+    bench_mount(1000);
+    bench_mount(10000);
+    bench_mount(100000);
+
+    unlink(image);
+    free(buffer);
+    fclose(out);
+    return 0;
+}
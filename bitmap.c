@@ -0,0 +1,269 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+#define WORD_BITS 64
+
+#define LOAD(x) __atomic_load_n(&(x),__ATOMIC_RELAXED)
+#define STORE(x,v) __atomic_store_n(&(x),(v),__ATOMIC_RELAXED)
+
+struct bitmap *bitmap_create( int nbits )
+{
+    struct bitmap *b = malloc(sizeof(*b));
+    if(!b) return 0;
+
+    b->nbits = nbits;
+    b->nwords = (nbits + WORD_BITS - 1) / WORD_BITS;
+    b->words = calloc(b->nwords ? b->nwords : 1,sizeof(uint64_t));
+    if(!b->words) {
+        free(b);
+        return 0;
+    }
+
+    //bits past the end of the disk are permanently in use
+    if(nbits % WORD_BITS) {
+        b->words[b->nwords-1] = ~0ULL << (nbits % WORD_BITS);
+    }
+
+    b->nfree = nbits;
+    b->cursor = 0;
+    return b;
+}
+
+void bitmap_delete( struct bitmap *b )
+{
+    if(!b) return;
+    free(b->words);
+    free(b);
+}
+
+//recompute the free count after the words were filled in directly, e.g. loaded from disk
+void bitmap_recount( struct bitmap *b )
+{
+    int i, used = 0;
+
+    if(b->nbits % WORD_BITS) {
+        b->words[b->nwords-1] |= ~0ULL << (b->nbits % WORD_BITS);
+    }
+    for(i = 0; i < b->nwords; i += 1) {
+        used += __builtin_popcountll(b->words[i]);
+    }
+    b->nfree = b->nwords * WORD_BITS - used;
+    b->cursor = 0;
+}
+
+int bitmap_test( const struct bitmap *b, int bit )
+{
+    return (LOAD(b->words[bit / WORD_BITS]) >> (bit % WORD_BITS)) & 1;
+}
+
+//set a bit, returning one if this call is the one that changed it
+static int claim( struct bitmap *b, int bit )
+{
+    uint64_t mask = 1ULL << (bit % WORD_BITS);
+
+    if(__atomic_fetch_or(&b->words[bit / WORD_BITS],mask,__ATOMIC_ACQ_REL) & mask) return 0;
+    __atomic_fetch_sub(&b->nfree,1,__ATOMIC_RELAXED);
+    return 1;
+}
+
+//clear a bit, returning one if this call is the one that changed it
+static int release( struct bitmap *b, int bit )
+{
+    uint64_t mask = 1ULL << (bit % WORD_BITS);
+
+    if(!(__atomic_fetch_and(&b->words[bit / WORD_BITS],~mask,__ATOMIC_ACQ_REL) & mask)) return 0;
+    __atomic_fetch_add(&b->nfree,1,__ATOMIC_RELAXED);
+    return 1;
+}
+
+void bitmap_set( struct bitmap *b, int bit )
+{
+    claim(b,bit);
+}
+
+void bitmap_clear( struct bitmap *b, int bit )
+{
+    release(b,bit);
+}
+
+int bitmap_claim( struct bitmap *b, int bit )
+{
+    return claim(b,bit);
+}
+
+//first clear bit at or after 'from', or nbits if there is none
+static int next_zero( const struct bitmap *b, int from )
+{
+    int w = from / WORD_BITS;
+    uint64_t word;
+
+    if(from >= b->nbits) return b->nbits;
+
+    word = ~LOAD(b->words[w]) & (~0ULL << (from % WORD_BITS));
+    while(!word) {
+        if(++w >= b->nwords) return b->nbits;
+        word = ~LOAD(b->words[w]);
+    }
+    return w * WORD_BITS + __builtin_ctzll(word);
+}
+
+//first set bit at or after 'from', or nbits if there is none
+static int next_one( const struct bitmap *b, int from )
+{
+    int w = from / WORD_BITS;
+    uint64_t word;
+
+    if(from >= b->nbits) return b->nbits;
+
+    word = LOAD(b->words[w]) & (~0ULL << (from % WORD_BITS));
+    while(!word) {
+        if(++w >= b->nwords) return b->nbits;
+        word = LOAD(b->words[w]);
+    }
+    w = w * WORD_BITS + __builtin_ctzll(word);
+    return w < b->nbits ? w : b->nbits;
+}
+
+int bitmap_alloc( struct bitmap *b )
+{
+    int pass, bit, limit, cursor;
+
+    if(LOAD(b->nfree) <= 0) return -1;
+
+    //search from the cursor to the end, then wrap around to the beginning
+    cursor = LOAD(b->cursor);
+    for(pass = 0; pass < 2; pass += 1) {
+        bit = next_zero(b,pass ? 0 : cursor);
+        limit = pass ? cursor : b->nbits;
+        while(bit < limit) {
+            if(claim(b,bit)) {
+                STORE(b->cursor,bit + 1);
+                return bit;
+            }
+            //another thread took it first
+            bit = next_zero(b,bit + 1);
+        }
+    }
+
+    return -1;
+}
+
+//allocate the lowest clear bit, ignoring the cursor
+int bitmap_alloc_first( struct bitmap *b )
+{
+    int bit;
+
+    if(LOAD(b->nfree) <= 0) return -1;
+    for(bit = next_zero(b,0); bit < b->nbits; bit = next_zero(b,bit + 1)) {
+        if(claim(b,bit)) return bit;
+    }
+    return -1;
+}
+
+//allocate n consecutive blocks, returning the first or -1 if no run is long enough
+int bitmap_alloc_run( struct bitmap *b, int n )
+{
+    int pass, start, end, limit, cursor, i;
+
+    if(n <= 0 || n > LOAD(b->nfree)) return -1;
+    if(n == 1) return bitmap_alloc(b);
+
+    //search from the cursor to the end, then wrap around to the beginning
+    cursor = LOAD(b->cursor);
+    for(pass = 0; pass < 2; pass += 1) {
+        start = pass ? 0 : cursor;
+        limit = pass ? cursor : b->nbits;
+        start = next_zero(b,start);
+        while(start < limit) {
+            end = next_one(b,start);
+            if(end - start >= n) {
+                for(i = start; i < start + n; i += 1) {
+                    if(!claim(b,i)) break;
+                }
+                if(i == start + n) {
+                    STORE(b->cursor,start + n);
+                    return start;
+                }
+                //lost bit i to another thread: give back what we took and keep looking past it
+                end = i + 1;
+                while(--i >= start) release(b,i);
+            }
+            start = next_zero(b,end);
+        }
+    }
+
+    return -1;
+}
+
+//allocate the first run of n free blocks, or the longest run there is when none is that long
+//sets *count to the length of the run and returns its first block, or -1 if nothing is free
+int bitmap_alloc_extent( struct bitmap *b, int n, int *count )
+{
+    int pass, start, end, limit, cursor, i, best, bestlen;
+
+    if(n <= 0) return -1;
+
+    while(LOAD(b->nfree) > 0) {
+        //one sweep from the cursor, wrapping around, remembering the longest run seen
+        best = -1;
+        bestlen = 0;
+        cursor = LOAD(b->cursor);
+        for(pass = 0; pass < 2 && bestlen < n; pass += 1) {
+            limit = pass ? cursor : b->nbits;
+            start = next_zero(b,pass ? 0 : cursor);
+            while(start < limit && bestlen < n) {
+                end = next_one(b,start);
+                if(end - start > bestlen) {
+                    best = start;
+                    bestlen = end - start < n ? end - start : n;
+                }
+                start = next_zero(b,end);
+            }
+        }
+        if(best < 0) return -1;
+
+        for(i = best; i < best + bestlen; i += 1) {
+            if(!claim(b,i)) break;
+        }
+        if(i == best + bestlen) {
+            STORE(b->cursor,best + bestlen);
+            *count = bestlen;
+            return best;
+        }
+        //lost bit i to another thread: give back what we took and sweep again
+        while(--i >= best) release(b,i);
+    }
+
+    return -1;
+}
+
+void bitmap_free_run( struct bitmap *b, int start, int n )
+{
+    int i;
+    for(i = start; i < start + n; i += 1) bitmap_clear(b,i);
+}
+
+//clear every bit of b that is set in bits, a word at a time, and empty bits; bits must be the same size as b
+//only b may be in use by other threads
+void bitmap_clear_map( struct bitmap *b, struct bitmap *bits )
+{
+    uint64_t mask, was;
+    int i;
+
+    for(i = 0; i < bits->nwords; i += 1) {
+        mask = bits->words[i];
+        //the bits past the end of both maps stay in use
+        if(i == bits->nwords-1 && bits->nbits % WORD_BITS) mask &= ~(~0ULL << (bits->nbits % WORD_BITS));
+        if(!mask) continue;
+        bits->words[i] = 0;
+        was = __atomic_fetch_and(&b->words[i],~mask,__ATOMIC_ACQ_REL);
+        __atomic_fetch_add(&b->nfree,__builtin_popcountll(was & mask),__ATOMIC_RELAXED);
+    }
+    if(bits->nbits % WORD_BITS) {
+        bits->words[bits->nwords-1] = ~0ULL << (bits->nbits % WORD_BITS);
+    }
+    bits->nfree = bits->nbits;
+}
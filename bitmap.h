@@ -0,0 +1,44 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+/*
+A packed free-block map: one bit per block, set when the block is in use.
+Allocation is next-fit from a cursor that follows the last allocation, so
+consecutive allocations land on consecutive blocks when space allows;
+bitmap_alloc_first takes the lowest clear bit instead.  The filesystem
+also keeps one of these with a bit per inode.
+
+Bits are claimed and released with atomic operations on the words, so any
+number of threads may allocate and free at once without a lock.  A thread
+that loses the race for a bit simply moves on to the next clear one.
+bitmap_create, bitmap_recount and bitmap_delete are not safe to call while
+other threads are using the map.
+*/
+
+struct bitmap {
+    uint64_t *words;
+    int nbits;
+    int nwords;
+    int nfree;
+    int cursor;
+};
+
+struct bitmap *bitmap_create( int nbits );
+void bitmap_delete( struct bitmap *b );
+void bitmap_recount( struct bitmap *b );
+
+int  bitmap_test( const struct bitmap *b, int bit );
+void bitmap_set( struct bitmap *b, int bit );
+void bitmap_clear( struct bitmap *b, int bit );
+int  bitmap_claim( struct bitmap *b, int bit );
+
+int  bitmap_alloc( struct bitmap *b );
+int  bitmap_alloc_first( struct bitmap *b );
+int  bitmap_alloc_run( struct bitmap *b, int n );
+int  bitmap_alloc_extent( struct bitmap *b, int n, int *count );
+void bitmap_free_run( struct bitmap *b, int start, int n );
+void bitmap_clear_map( struct bitmap *b, struct bitmap *bits );
+
+#endif
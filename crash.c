@@ -0,0 +1,264 @@
+
+/*
+Crash test driver for the journal.
+
+Runs a seeded workload of creates, appends, deletes and syncs on a scratch
+image, having told the disk layer to stop taking writes after a given number
+of blocks, as if the power had gone out there.  The image is then opened
+again and mounted, which replays the journal, and checked: every file has to
+be exactly as it was after some operation no earlier than the last fs_sync
+that finished before the crash, fs_check has to find nothing wrong with the
+metadata, and a burst of new writes filling the disk must leave all of the
+files alone.  This is done for crash points spread over the whole workload,
+and one line is printed for each.
+*/
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CRASH_BLOCKS    4000 //size of the scratch image; a sixteenth of it is journal
+#define CRASH_FILES     8    //files alive at once
+#define CRASH_OPS       300
+#define CRASH_MAX_FILE  (512 * 1024)
+#define CRASH_MAX_WRITE 40000
+#define CRASH_SYNC_EVERY 25
+
+//one file of the workload from its creation to its deletion
+struct generation {
+    int inumber;
+    char *data; //everything appended so far
+};
+
+//what the workload's files looked like after one operation
+struct snapshot {
+    struct generation *file[CRASH_FILES];
+    int size[CRASH_FILES];
+};
+
+static int backend = DISK_BACKEND_FILE;
+static int formatmode = FS_FORMAT_FAST;
+static const char *image = "crash.img";
+
+static struct snapshot snapshots[CRASH_OPS + 1];
+static struct generation *generations[CRASH_OPS];
+static int ngenerations;
+static int inumbers[CRASH_OPS]; //every inode the workload has used
+static int ninumbers;
+
+static struct disk *open_image( int fresh )
+{
+    struct disk *disk;
+
+    if(fresh) unlink(image);
+    disk = disk_open(image,CRASH_BLOCKS,backend);
+    if(!disk) {
+        fprintf(stderr,"couldn't open %s: %s\n",image,strerror(errno));
+        exit(1);
+    }
+    return disk;
+}
+
+//a fresh filesystem, formatted, mounted and safely on the image
+static struct fs *setup( struct disk *disk )
+{
+    struct fs *fs = fs_open(disk);
+
+    if(!fs_format_mode_r(fs,formatmode) || !fs_mount_r(fs)) {
+        fprintf(stderr,"couldn't set up a filesystem on %s\n",image);
+        exit(1);
+    }
+    fs_sync_r(fs);
+    return fs;
+}
+
+static void forget_generations()
+{
+    int i;
+    for(i = 0; i < ngenerations; i += 1) {
+        free(generations[i]->data);
+        free(generations[i]);
+    }
+    ngenerations = 0;
+    ninumbers = 0;
+}
+
+//run the workload, stopping after the operation during which the disk crashed
+//returns the number of operations done; *synced is the last operation covered by a finished fs_sync
+static int run_workload( struct fs *fs, struct disk *disk, unsigned seed, int *synced )
+{
+    struct snapshot now;
+    char buffer[CRASH_MAX_WRITE];
+    int op, slot, length, i;
+
+    memset(&now,0,sizeof(now));
+    snapshots[0] = now;
+    *synced = 0;
+
+    for(op = 1; op <= CRASH_OPS; op += 1) {
+        slot = rand_r(&seed) % CRASH_FILES;
+        if(op % CRASH_SYNC_EVERY == 0) {
+            fs_sync_r(fs);
+            if(!disk_crashed_r(disk)) *synced = op;
+        } else if(!now.file[slot]) {
+            now.file[slot] = calloc(1,sizeof(struct generation));
+            now.file[slot]->data = malloc(CRASH_MAX_FILE);
+            now.file[slot]->inumber = fs_create_r(fs);
+            now.size[slot] = 0;
+            generations[ngenerations++] = now.file[slot];
+            for(i = 0; i < ninumbers && inumbers[i] != now.file[slot]->inumber; i += 1);
+            if(i == ninumbers) inumbers[ninumbers++] = now.file[slot]->inumber;
+        } else if(rand_r(&seed) % 6 == 0) {
+            fs_delete_r(fs,now.file[slot]->inumber);
+            now.file[slot] = 0;
+            now.size[slot] = 0;
+        } else {
+            length = 1 + rand_r(&seed) % CRASH_MAX_WRITE;
+            if(now.size[slot] + length > CRASH_MAX_FILE) length = CRASH_MAX_FILE - now.size[slot];
+            for(i = 0; i < length; i += 1) buffer[i] = rand_r(&seed);
+            if(length > 0 && fs_write_r(fs,now.file[slot]->inumber,buffer,length,now.size[slot]) == length) {
+                memcpy(now.file[slot]->data + now.size[slot],buffer,length);
+                now.size[slot] += length;
+            }
+        }
+        snapshots[op] = now;
+        if(disk_crashed_r(disk)) break;
+    }
+    return op > CRASH_OPS ? CRASH_OPS : op;
+}
+
+//check the mounted filesystem against the state after operation k
+static int matches( struct fs *fs, int k, char *buffer )
+{
+    struct snapshot *s = &snapshots[k];
+    int i, slot, size, live;
+
+    for(slot = 0; slot < CRASH_FILES; slot += 1) {
+        if(!s->file[slot]) continue;
+        if(fs_getsize_r(fs,s->file[slot]->inumber) != s->size[slot]) return 0;
+        if(s->size[slot] && (fs_read_r(fs,s->file[slot]->inumber,buffer,s->size[slot],0) != s->size[slot]
+            || memcmp(buffer,s->file[slot]->data,s->size[slot]))) return 0;
+    }
+    //every other inode the workload touched has to be gone or empty
+    for(i = 0; i < ninumbers; i += 1) {
+        for(live = 0, slot = 0; slot < CRASH_FILES; slot += 1) {
+            if(s->file[slot] && s->file[slot]->inumber == inumbers[i]) live = 1;
+        }
+        size = fs_getsize_r(fs,inumbers[i]);
+        if(!live && size != 0) return 0;
+    }
+    return 1;
+}
+
+//write a new file until the disk is full, which lands on any block the recovered bitmap wrongly calls free, then delete it
+static void fill_disk( struct fs *fs, char *buffer )
+{
+    int inumber = fs_create_r(fs), offset = 0;
+
+    if(!inumber) return;
+    memset(buffer,0xa5,CRASH_MAX_WRITE);
+    while(fs_write_r(fs,inumber,buffer,CRASH_MAX_WRITE,offset) == CRASH_MAX_WRITE) offset += CRASH_MAX_WRITE;
+    fs_delete_r(fs,inumber);
+}
+
+//crash after 'point' block writes, recover, and check; returns one if the recovered filesystem is consistent
+static int crash_at( int point, unsigned seed, int *ops, int *state )
+{
+    struct disk *disk = open_image(1);
+    struct fs *fs = setup(disk);
+    struct fs_check_report report;
+    char *buffer = malloc(CRASH_MAX_FILE);
+    int done, synced, k, ok = 0;
+
+    disk_crash_after_r(disk,point);
+    done = run_workload(fs,disk,seed,&synced);
+    fs_close(fs);
+    disk_close_r(disk);
+
+    //power back on
+    disk = open_image(0);
+    fs = fs_open(disk);
+    *ops = done;
+    *state = -1;
+    if(fs_mount_r(fs)) {
+        for(k = done; k >= synced && !matches(fs,k,buffer); k -= 1);
+        //the recovered metadata has to hold together as well
+        if(k >= synced && fs_check_r(fs,0,0,&report)) {
+            *state = k;
+            fill_disk(fs,buffer);
+            ok = matches(fs,k,buffer);
+        }
+    }
+    fs_close(fs);
+    disk_close_r(disk);
+
+    forget_generations();
+    free(buffer);
+    return ok;
+}
+
+int main( int argc, char *argv[] )
+{
+    struct disk_stats before, after;
+    struct disk *disk;
+    struct fs *fs;
+    unsigned seed = 1;
+    int opt, verbose = 0, npoints = 40, total, synced, i, point, ops, state, ok, failed = 0, stdoutfd;
+    FILE *out;
+
+    while((opt = getopt(argc,argv,"mdes:n:v"))!=-1) {
+        if(opt=='m') {
+            backend = DISK_BACKEND_MMAP;
+        } else if(opt=='d') {
+            backend = DISK_BACKEND_DIRECT;
+        } else if(opt=='e') {
+            formatmode = FS_FORMAT_FAST | FS_FORMAT_EXTENTS;
+        } else if(opt=='s') {
+            seed = atoi(optarg);
+        } else if(opt=='n') {
+            npoints = atoi(optarg);
+        } else if(opt=='v') {
+            verbose = 1;
+        } else {
+            fprintf(stderr,"use: %s [-m|-d] [-e] [-s seed] [-n crashpoints] [-v] [scratchimage]\n",argv[0]);
+            return 1;
+        }
+    }
+    if(optind < argc) image = argv[optind];
+    if(npoints < 1) npoints = 1;
+
+    //results go to the real stdout; the messages the library prints are dropped unless -v is given
+    stdoutfd = dup(1);
+    out = fdopen(stdoutfd,"w");
+    if(!verbose) freopen("/dev/null","w",stdout);
+
+    //a run without a crash, to see how many block writes the workload makes
+    disk = open_image(1);
+    fs = setup(disk);
+    disk_stats_r(disk,&before);
+    run_workload(fs,disk,seed,&synced);
+    fs_close(fs);
+    disk_stats_r(disk,&after);
+    disk_close_r(disk);
+    forget_generations();
+    total = after.writes - before.writes;
+
+    for(i = 0; i < npoints; i += 1) {
+        point = (long long)total * i / npoints;
+        ok = crash_at(point,seed,&ops,&state);
+        if(!ok) failed += 1;
+        fprintf(out,"crash after %d of %d block writes: %d operations run, recovered the state after operation %d: %s\n",
+            point,total,ops,state,ok ? "ok" : "FAILED");
+        fflush(out);
+    }
+
+    unlink(image);
+    fprintf(out,"%d of %d crash points recovered consistently\n",npoints - failed,npoints);
+    fclose(out);
+    return failed ? 1 : 0;
+}
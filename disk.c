@@ -1,47 +1,170 @@
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
 
 #include "disk.h"
 
 #define DISK_MAGIC 0xdeadbeef
+#define DISK_FLUSH_DEPTH 16 //write-back requests cache_flush keeps in flight
+#define DISK_PREFETCH_DEPTH 8 //prefetch reads cache_prefetch keeps in flight (DISK_BACKEND_DIRECT)
+#define DISK_QUEUE_WORKERS 4 //most threads behind one queue when io_uring is not available
+#define DISK_ALIGN 4096 //what O_DIRECT transfers are aligned to, in memory as well as on the image
+#define DISK_POOL_GROW 64 //aligned buffers the pool adds when it runs out
 
-static FILE *diskfile;
-static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
+//statistics are bumped from many threads at once; each thread also keeps its own
+//running total, so callers can tell which of their operations caused the I/O
+#define STAT_ADD(d,name,count) do { \
+        __atomic_fetch_add(&(d)->n##name,(count),__ATOMIC_RELAXED); \
+        thread_stats.name += (count); \
+    } while(0)
 
-int disk_init( const char *filename, int n )
+/*
+A write-back block cache sits between disk_read/disk_write and the image file.
+It is split into shards by block number so that threads working on different
+blocks rarely wait for each other; each shard has its own lock, its own
+doubly linked LRU list (head is most recently used) and its own chained hash
+table keyed by block number.  Dirty entries are only written to the image
+when they are evicted, on disk_sync, or on disk_close.
+*/
+
+struct cache_entry {
+    int blocknum;
+    int dirty;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+    struct cache_entry *hnext;
+    char *data; //in the shard's blocks, so it is aligned for O_DIRECT
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry *entries;
+    char *blocks; //the entries' data, DISK_ALIGN-aligned
+    struct cache_entry **hash;
+    struct cache_entry *lru_head;
+    struct cache_entry *lru_tail;
+    int size;
+    int hash_mask;
+};
+
+/*
+The O_DIRECT backend can only move data between the image and memory aligned
+to DISK_ALIGN.  Block cache entries are aligned already; any other buffer a
+caller passes in is swapped for one from the disk's pool for the length of
+the transfer and copied to or from.  The pool hands out single blocks from
+slabs it allocates as it runs short and keeps every buffer it is given back
+on a free list, so once it has grown to the largest number of transfers in
+flight at once no transfer allocates memory.
+*/
+
+struct pool_slab {
+    struct pool_slab *next;
+    char *blocks;
+};
+
+struct buffer_pool {
+    pthread_mutex_t lock;
+    char **free; //buffers not in use
+    int nfree;
+    int size; //buffers allocated in all
+    struct pool_slab *slabs;
+};
+
+//everything about one open image; each handle has its own cache and statistics
+struct disk {
+    int diskfd;
+    char *diskmap;
+    int backend;
+    int nblocks;
+    int nreads;
+    int nwrites;
+    int ncoalesced;
+    struct cache_shard shards[DISK_CACHE_SHARDS];
+    int nshards; //zero when there is no cache
+    int cache_size;
+    int nhits;
+    int nmisses;
+    int nbehind; //blocks written behind since the cache was last flushed
+    struct disk_queue *flushq; //used by cache_flush, opened the first time it has more than one run to write
+    struct disk_queue *prefetchq; //used by cache_prefetch, opened the first time it is called
+    pthread_mutex_t prefetch_lock; //held by the one thread using prefetchq
+    int crashafter; //blocks that may still reach the image before a simulated crash, negative when none is arranged
+    int crashed; //set once a write has been dropped
+    struct buffer_pool pool; //aligned buffers for transfers to or from unaligned memory (DISK_BACKEND_DIRECT)
+};
+
+static __thread struct disk_stats thread_stats; //I/O done by the calling thread, on any disk
+
+//the image behind disk_init and the other calls that take no handle
+static struct disk *default_disk;
+static int default_cache_size=DISK_CACHE_DEFAULT; //kept across disk_close for the next disk_init
+
+struct disk *disk_open( const char *filename, int n, int type )
 {
-    diskfile = fopen(filename,"r+");
-    if(!diskfile) diskfile = fopen(filename,"w+");
-    if(!diskfile) return 0;
+    struct disk *d = calloc(1,sizeof(*d));
+    if(!d) return 0;
 
-    ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+    d->diskfd = open(filename,O_RDWR|O_CREAT|(type==DISK_BACKEND_DIRECT ? O_DIRECT : 0),0666);
+    if(d->diskfd<0) {
+        free(d);
+        return 0;
+    }
+    pthread_mutex_init(&d->pool.lock,0);
+    pthread_mutex_init(&d->prefetch_lock,0);
 
-    nblocks = n;
-    nreads = 0;
-    nwrites = 0;
+    ftruncate(d->diskfd,(off_t)n*DISK_BLOCK_SIZE);
 
-    return 1;
+    d->nblocks = n;
+    d->backend = type;
+    d->crashafter = -1;
+
+    if(d->backend==DISK_BACKEND_MMAP) {
+        //the page cache already holds the mapped image, so the block cache is bypassed
+        d->diskmap = mmap(0,(size_t)n*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,d->diskfd,0);
+        if(d->diskmap==MAP_FAILED) {
+            close(d->diskfd);
+            pthread_mutex_destroy(&d->pool.lock);
+            pthread_mutex_destroy(&d->prefetch_lock);
+            free(d);
+            return 0;
+        }
+        return d;
+    }
+
+    if(!disk_cache_resize_r(d,DISK_CACHE_DEFAULT)) {
+        close(d->diskfd);
+        pthread_mutex_destroy(&d->pool.lock);
+        pthread_mutex_destroy(&d->prefetch_lock);
+        free(d);
+        return 0;
+    }
+    return d;
 }
 
-int disk_size()
+int disk_size_r( struct disk *d )
 {
-    return nblocks;
+    return d->nblocks;
 }
 
-static void sanity_check( int blocknum, const void *data )
+static void sanity_check( struct disk *d, int blocknum, const void *data )
 {
     if(blocknum<0) {
         printf("ERROR: blocknum (%d) is negative!\n",blocknum);
         abort();
     }
 
-    if(blocknum>=nblocks) {
+    if(blocknum>=d->nblocks) {
         printf("ERROR: blocknum (%d) is too big!\n",blocknum);
         abort();
     }
@@ -52,41 +175,1463 @@ static void sanity_check( int blocknum, const void *data )
     }
 }
 
-void disk_read( int blocknum, char *data )
+static void disk_error()
+{
+    printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+    abort();
+}
+
+static int crash_armed( struct disk *d )
+{
+    return __atomic_load_n(&d->crashafter,__ATOMIC_RELAXED)>=0;
+}
+
+//how many of the next n block writes may reach the image, when disk_crash_after has arranged a crash
+static int crash_allow( struct disk *d, int n )
+{
+    int left = __atomic_load_n(&d->crashafter,__ATOMIC_RELAXED), allowed;
+
+    do {
+        if(left<0) return n;
+        allowed = left < n ? left : n;
+    } while(!__atomic_compare_exchange_n(&d->crashafter,&left,left-allowed,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+
+    if(allowed<n) __atomic_store_n(&d->crashed,1,__ATOMIC_RELAXED);
+    return allowed;
+}
+
+//take n buffers from the pool into bufs, growing it if it has too few
+static void pool_get( struct disk *d, char **bufs, int n )
+{
+    struct buffer_pool *p = &d->pool;
+    struct pool_slab *slab;
+    char **list;
+    int i, grow;
+
+    pthread_mutex_lock(&p->lock);
+    if(p->nfree<n) {
+        grow = n-p->nfree > DISK_POOL_GROW ? n-p->nfree : DISK_POOL_GROW;
+        slab = malloc(sizeof(*slab));
+        list = realloc(p->free,sizeof(*list) * (p->size+grow));
+        if(list) p->free = list;
+        if(!slab || !list || posix_memalign((void **)&slab->blocks,DISK_ALIGN,(size_t)grow*DISK_BLOCK_SIZE)) {
+            pthread_mutex_unlock(&p->lock);
+            errno = ENOMEM;
+            disk_error();
+        }
+        slab->next = p->slabs;
+        p->slabs = slab;
+        for(i = 0; i < grow; i += 1) p->free[p->nfree++] = slab->blocks+(size_t)i*DISK_BLOCK_SIZE;
+        p->size += grow;
+    }
+    for(i = 0; i < n; i += 1) bufs[i] = p->free[--p->nfree];
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pool_put( struct disk *d, char * const *bufs, int n )
+{
+    struct buffer_pool *p = &d->pool;
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    for(i = 0; i < n; i += 1) p->free[p->nfree++] = bufs[i];
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pool_free( struct disk *d )
+{
+    struct pool_slab *slab;
+
+    while((slab = d->pool.slabs)) {
+        d->pool.slabs = slab->next;
+        free(slab->blocks);
+        free(slab);
+    }
+    free(d->pool.free);
+    pthread_mutex_destroy(&d->pool.lock);
+}
+
+//on the direct backend, point every iovec whose buffer is not aligned at a pool buffer instead, filled from
+//the original for a write; saved[i] keeps the original, or is null where the iovec was left alone
+//a write of one buffer to many blocks in a row, as when zeroing, takes one pool buffer for all of them
+static void bounce_in( struct disk *d, int write, struct iovec *iov, int count, char **saved )
+{
+    char *bufs[DISK_MAX_RUN], *last = 0;
+    int i, n = 0;
+
+    for(i = 0; i < count; i += 1) {
+        saved[i] = ((uintptr_t)iov[i].iov_base & (DISK_ALIGN-1)) ? iov[i].iov_base : 0;
+        if(saved[i] && (!write || saved[i]!=last)) n += 1;
+        if(saved[i]) last = saved[i];
+    }
+    if(!n) return;
+    pool_get(d,bufs,n);
+    for(i = 0, n = 0, last = 0; i < count; i += 1) {
+        if(!saved[i]) continue;
+        if(write && saved[i]==last) {
+            iov[i].iov_base = bufs[n-1];
+            continue;
+        }
+        iov[i].iov_base = bufs[n++];
+        if(write) memcpy(iov[i].iov_base,saved[i],DISK_BLOCK_SIZE);
+        last = saved[i];
+    }
+}
+
+//undo bounce_in once the transfer is done, copying what a read brought in to the original buffers
+static void bounce_out( struct disk *d, int write, struct iovec *iov, int count, char * const *saved )
 {
-    sanity_check(blocknum,data);
+    char *bufs[DISK_MAX_RUN];
+    int i, n = 0;
 
-    fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+    for(i = 0; i < count; i += 1) {
+        if(!saved[i]) continue;
+        if(!write) memcpy(saved[i],iov[i].iov_base,DISK_BLOCK_SIZE);
+        if(!n || bufs[n-1]!=iov[i].iov_base) bufs[n++] = iov[i].iov_base;
+        iov[i].iov_base = saved[i];
+    }
+    if(n) pool_put(d,bufs,n);
+}
+
+static void raw_read( struct disk *d, int blocknum, char *data )
+{
+    struct iovec iov;
+    char *saved;
 
-    if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-        nreads++;
+    if(d->diskmap) {
+        memcpy(data,d->diskmap+(size_t)blocknum*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+        STAT_ADD(d,reads,1);
+        return;
+    }
+
+    iov.iov_base = data;
+    iov.iov_len = DISK_BLOCK_SIZE;
+    if(d->backend==DISK_BACKEND_DIRECT) bounce_in(d,0,&iov,1,&saved);
+    if(pread(d->diskfd,iov.iov_base,DISK_BLOCK_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE)==DISK_BLOCK_SIZE) {
+        STAT_ADD(d,reads,1);
     } else {
-        printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-        abort();
+        disk_error();
     }
+    if(d->backend==DISK_BACKEND_DIRECT) bounce_out(d,0,&iov,1,&saved);
 }
 
-void disk_write( int blocknum, const char *data )
+static void raw_write( struct disk *d, int blocknum, const char *data )
+{
+    struct iovec iov;
+    char *saved;
+
+    if(!crash_allow(d,1)) return;
+
+    if(d->diskmap) {
+        memcpy(d->diskmap+(size_t)blocknum*DISK_BLOCK_SIZE,data,DISK_BLOCK_SIZE);
+        STAT_ADD(d,writes,1);
+        return;
+    }
+
+    iov.iov_base = (char *)data;
+    iov.iov_len = DISK_BLOCK_SIZE;
+    if(d->backend==DISK_BACKEND_DIRECT) bounce_in(d,1,&iov,1,&saved);
+    if(pwrite(d->diskfd,iov.iov_base,DISK_BLOCK_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE)==DISK_BLOCK_SIZE) {
+        STAT_ADD(d,writes,1);
+    } else {
+        disk_error();
+    }
+    if(d->backend==DISK_BACKEND_DIRECT) bounce_out(d,1,&iov,1,&saved);
+}
+
+//transfer a run of consecutive blocks starting at 'start' with one preadv/pwritev
+static void raw_run( struct disk *d, int write, int start, struct iovec *iov, int count )
+{
+    ssize_t expected = (ssize_t)count*DISK_BLOCK_SIZE, result;
+    char *saved[DISK_MAX_RUN];
+    int i;
+
+    //with a crash arranged the blocks go one at a time, so it can land in the middle of the run
+    if(count==1 || d->diskmap || (write && crash_armed(d))) {
+        for(i = 0; i < count; i += 1) {
+            if(write) raw_write(d,start+i,iov[i].iov_base); else raw_read(d,start+i,iov[i].iov_base);
+        }
+        return;
+    }
+
+    if(d->backend==DISK_BACKEND_DIRECT) bounce_in(d,write,iov,count,saved);
+    if(write) {
+        result = pwritev(d->diskfd,iov,count,(off_t)start*DISK_BLOCK_SIZE);
+    } else {
+        result = preadv(d->diskfd,iov,count,(off_t)start*DISK_BLOCK_SIZE);
+    }
+    if(d->backend==DISK_BACKEND_DIRECT) bounce_out(d,write,iov,count,saved);
+
+    if(result==expected) {
+        if(write) { STAT_ADD(d,writes,count); } else { STAT_ADD(d,reads,count); }
+        STAT_ADD(d,coalesced,1);
+    } else if(result>=0) {
+        //a short transfer: finish the run a block at a time
+        for(i = 0; i < count; i += 1) {
+            if(write) raw_write(d,start+i,iov[i].iov_base); else raw_read(d,start+i,iov[i].iov_base);
+        }
+    } else {
+        disk_error();
+    }
+}
+
+static struct cache_shard *shard_of( struct disk *d, int blocknum )
+{
+    return &d->shards[blocknum % d->nshards];
+}
+
+static void lru_unlink( struct cache_shard *s, struct cache_entry *e )
+{
+    if(e->prev) e->prev->next = e->next; else s->lru_head = e->next;
+    if(e->next) e->next->prev = e->prev; else s->lru_tail = e->prev;
+    e->prev = e->next = 0;
+}
+
+static void lru_push_front( struct cache_shard *s, struct cache_entry *e )
+{
+    e->prev = 0;
+    e->next = s->lru_head;
+    if(s->lru_head) s->lru_head->prev = e;
+    s->lru_head = e;
+    if(!s->lru_tail) s->lru_tail = e;
+}
+
+static void lru_push_back( struct cache_shard *s, struct cache_entry *e )
+{
+    e->next = 0;
+    e->prev = s->lru_tail;
+    if(s->lru_tail) s->lru_tail->next = e;
+    s->lru_tail = e;
+    if(!s->lru_head) s->lru_head = e;
+}
+
+//blocks in one shard are all congruent mod nshards, so divide that out before masking or only every
+//nshards-th bucket would ever be used
+static struct cache_entry **hash_bucket( struct disk *d, struct cache_shard *s, int blocknum )
+{
+    return &s->hash[(blocknum / d->nshards) & s->hash_mask];
+}
+
+static struct cache_entry *cache_lookup( struct disk *d, struct cache_shard *s, int blocknum )
+{
+    struct cache_entry *e;
+    for(e = *hash_bucket(d,s,blocknum); e; e = e->hnext) {
+        if(e->blocknum==blocknum) return e;
+    }
+    return 0;
+}
+
+static void hash_remove( struct disk *d, struct cache_shard *s, struct cache_entry *e )
+{
+    struct cache_entry **p = hash_bucket(d,s,e->blocknum);
+    while(*p && *p!=e) p = &(*p)->hnext;
+    if(*p) *p = e->hnext;
+    e->hnext = 0;
+}
+
+//take the least recently used entry, writing it back first if it is dirty
+static struct cache_entry *cache_evict( struct disk *d, struct cache_shard *s, int blocknum )
+{
+    struct cache_entry *e = s->lru_tail;
+
+    if(e->blocknum>=0) {
+        if(e->dirty) raw_write(d,e->blocknum,e->data);
+        hash_remove(d,s,e);
+    }
+    e->blocknum = blocknum;
+    e->dirty = 0;
+    e->hnext = *hash_bucket(d,s,blocknum);
+    *hash_bucket(d,s,blocknum) = e;
+
+    lru_unlink(s,e);
+    lru_push_front(s,e);
+    return e;
+}
+
+//drop a block from the cache without writing it back
+static void cache_forget( struct disk *d, struct cache_shard *s, struct cache_entry *e )
+{
+    hash_remove(d,s,e);
+    e->blocknum = -1;
+    e->dirty = 0;
+    lru_unlink(s,e);
+    lru_push_back(s,e);
+}
+
+static int compare_entries( const void *a, const void *b )
+{
+    const struct cache_entry *x = *(struct cache_entry * const *)a;
+    const struct cache_entry *y = *(struct cache_entry * const *)b;
+    return (x->blocknum > y->blocknum) - (x->blocknum < y->blocknum);
+}
+
+//issue the given blocks (sorted by block number) as runs of adjacent blocks
+static void raw_batch( struct disk *d, int write, const int *blocknums, char * const *data, int n )
 {
-    sanity_check(blocknum,data);
+    struct iovec iov[DISK_MAX_RUN];
+    int i, count = 0;
 
-    fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+    for(i = 0; i < n; i += 1) {
+        if(count>0 && (blocknums[i]!=blocknums[i-1]+1 || count==DISK_MAX_RUN)) {
+            raw_run(d,write,blocknums[i-count],iov,count);
+            count = 0;
+        }
+        iov[count].iov_base = data[i];
+        iov[count].iov_len = DISK_BLOCK_SIZE;
+        count++;
+    }
+    if(count>0) raw_run(d,write,blocknums[n-count],iov,count);
+}
+
+/*
+Asynchronous requests go through a struct disk_queue, which holds up to
+'depth' of them in flight.  It submits through io_uring when the kernel
+has it, using the raw system calls, and otherwise hands requests to a few
+worker threads that make the same preadv/pwritev calls disk_readv would.
+The mmap backend has nothing to wait for and completes requests as they
+are submitted.  In every case a request's completion, including its
+statistics and its done callback, is handled by the thread that calls
+disk_submit, disk_poll, disk_wait or disk_drain, so a queue is meant to be
+used by one thread at a time.
+*/
+
+struct disk_slot {
+    struct disk_request *request;
+    struct iovec iov[DISK_MAX_RUN];
+    char *saved[DISK_MAX_RUN]; //the request's own buffers where iov holds pool ones (DISK_BACKEND_DIRECT)
+    ssize_t result; //bytes transferred, or minus errno
+    struct disk_slot *next; //free list, or the workers' pending and completed lists
+};
+
+struct disk_queue {
+    struct disk *disk;
+    int engine;
+    int depth;
+    int inflight;
+    struct disk_slot *slots;
+    struct disk_slot *free;
+    struct disk_slot *completed; //finished and waiting for queue_reap (threads and mmap)
+
+    //DISK_ENGINE_URING
+    int ringfd;
+    char *sqring;
+    char *cqring;
+    size_t sqsize;
+    size_t cqsize;
+    struct io_uring_sqe *sqes;
+    size_t sqesize;
+    unsigned *sqtail;
+    unsigned *sqmask;
+    unsigned *sqarray;
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned *cqmask;
+    struct io_uring_cqe *cqes;
+
+    //DISK_ENGINE_THREADS
+    pthread_t workers[DISK_QUEUE_WORKERS];
+    int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+    struct disk_slot *pending;
+    struct disk_slot *pending_tail;
+    int stop;
+};
+
+//set up an io_uring of at least q->depth entries; returns zero if the kernel will not give us one
+static int uring_open( struct disk_queue *q )
+{
+#ifdef __NR_io_uring_setup
+    struct io_uring_params p;
+
+    memset(&p,0,sizeof(p));
+    q->ringfd = syscall(__NR_io_uring_setup,q->depth,&p);
+    if(q->ringfd<0) return 0;
+
+    q->sqsize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    q->cqsize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(q->cqsize > q->sqsize) q->sqsize = q->cqsize;
+        q->cqsize = 0;
+    }
+    q->sqesize = p.sq_entries*sizeof(struct io_uring_sqe);
+
+    q->sqring = mmap(0,q->sqsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,q->ringfd,IORING_OFF_SQ_RING);
+    q->cqring = q->cqsize ? mmap(0,q->cqsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,q->ringfd,IORING_OFF_CQ_RING) : q->sqring;
+    q->sqes = mmap(0,q->sqesize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,q->ringfd,IORING_OFF_SQES);
+    if(q->sqring==MAP_FAILED || q->cqring==MAP_FAILED || (void *)q->sqes==MAP_FAILED) {
+        if(q->sqring!=MAP_FAILED) munmap(q->sqring,q->sqsize);
+        if(q->cqsize && q->cqring!=MAP_FAILED) munmap(q->cqring,q->cqsize);
+        if((void *)q->sqes!=MAP_FAILED) munmap(q->sqes,q->sqesize);
+        close(q->ringfd);
+        return 0;
+    }
+
+    q->sqtail = (unsigned *)(q->sqring + p.sq_off.tail);
+    q->sqmask = (unsigned *)(q->sqring + p.sq_off.ring_mask);
+    q->sqarray = (unsigned *)(q->sqring + p.sq_off.array);
+    q->cqhead = (unsigned *)(q->cqring + p.cq_off.head);
+    q->cqtail = (unsigned *)(q->cqring + p.cq_off.tail);
+    q->cqmask = (unsigned *)(q->cqring + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe *)(q->cqring + p.cq_off.cqes);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static void uring_close( struct disk_queue *q )
+{
+    munmap(q->sqes,q->sqesize);
+    if(q->cqsize) munmap(q->cqring,q->cqsize);
+    munmap(q->sqring,q->sqsize);
+    close(q->ringfd);
+}
+
+static void uring_submit( struct disk_queue *q, struct disk_slot *slot )
+{
+    struct disk_request *r = slot->request;
+    unsigned tail = *q->sqtail, index = tail & *q->sqmask;
+    struct io_uring_sqe *sqe = &q->sqes[index];
+
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = q->disk->diskfd;
+    sqe->addr = (unsigned long)slot->iov;
+    sqe->len = r->count;
+    sqe->off = (off_t)r->blocknum*DISK_BLOCK_SIZE;
+    sqe->user_data = (unsigned long)slot;
+    q->sqarray[index] = index;
+    __atomic_store_n(q->sqtail,tail+1,__ATOMIC_RELEASE);
+
+    while(syscall(__NR_io_uring_enter,q->ringfd,1,0,0,NULL,0)<0) {
+        if(errno!=EINTR) disk_error();
+    }
+}
+
+//move finished requests onto q->completed, waiting for one first if wait is set
+static void uring_collect( struct disk_queue *q, int wait )
+{
+    struct disk_slot *slot;
+    unsigned head = *q->cqhead, tail = __atomic_load_n(q->cqtail,__ATOMIC_ACQUIRE);
 
-    if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-        nwrites++;
+    while(head==tail && wait && !q->completed) {
+        if(syscall(__NR_io_uring_enter,q->ringfd,0,1,IORING_ENTER_GETEVENTS,NULL,0)<0 && errno!=EINTR) disk_error();
+        tail = __atomic_load_n(q->cqtail,__ATOMIC_ACQUIRE);
+    }
+    for(; head!=tail; head += 1) {
+        slot = (struct disk_slot *)(unsigned long)q->cqes[head & *q->cqmask].user_data;
+        slot->result = q->cqes[head & *q->cqmask].res;
+        slot->next = q->completed;
+        q->completed = slot;
+    }
+    __atomic_store_n(q->cqhead,head,__ATOMIC_RELEASE);
+}
+
+//move the data of one request without touching the cache or the statistics
+static ssize_t queue_transfer( struct disk *d, struct disk_request *r, struct iovec *iov )
+{
+    ssize_t result;
+    int i;
+
+    if(r->write && crash_armed(d)) {
+        for(i = 0; i < r->count; i += 1) {
+            if(!crash_allow(d,1)) continue;
+            if(d->diskmap) {
+                memcpy(d->diskmap+(size_t)(r->blocknum+i)*DISK_BLOCK_SIZE,iov[i].iov_base,DISK_BLOCK_SIZE);
+            } else if(pwrite(d->diskfd,iov[i].iov_base,DISK_BLOCK_SIZE,(off_t)(r->blocknum+i)*DISK_BLOCK_SIZE)!=DISK_BLOCK_SIZE) {
+                return -errno;
+            }
+        }
+        return (ssize_t)r->count*DISK_BLOCK_SIZE;
+    }
+
+    if(d->diskmap) {
+        for(i = 0; i < r->count; i += 1) {
+            if(r->write) {
+                memcpy(d->diskmap+(size_t)(r->blocknum+i)*DISK_BLOCK_SIZE,iov[i].iov_base,DISK_BLOCK_SIZE);
+            } else {
+                memcpy(iov[i].iov_base,d->diskmap+(size_t)(r->blocknum+i)*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+            }
+        }
+        return (ssize_t)r->count*DISK_BLOCK_SIZE;
+    }
+
+    if(r->write) {
+        result = pwritev(d->diskfd,iov,r->count,(off_t)r->blocknum*DISK_BLOCK_SIZE);
+    } else {
+        result = preadv(d->diskfd,iov,r->count,(off_t)r->blocknum*DISK_BLOCK_SIZE);
+    }
+    return result<0 ? -errno : result;
+}
+
+static void *queue_worker( void *arg )
+{
+    struct disk_queue *q = arg;
+    struct disk_slot *slot;
+
+    pthread_mutex_lock(&q->lock);
+    while(1) {
+        while(!q->pending && !q->stop) pthread_cond_wait(&q->work,&q->lock);
+        if(!q->pending) break;
+        slot = q->pending;
+        q->pending = slot->next;
+        pthread_mutex_unlock(&q->lock);
+
+        slot->result = queue_transfer(q->disk,slot->request,slot->iov);
+
+        pthread_mutex_lock(&q->lock);
+        slot->next = q->completed;
+        q->completed = slot;
+        pthread_cond_signal(&q->finished);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+//account for one finished request, bring its data up to date with the cache, and tell the caller
+static void queue_complete( struct disk_queue *q, struct disk_slot *slot )
+{
+    struct disk_request *r = slot->request;
+    struct disk *d = q->disk;
+    struct cache_shard *s;
+    struct cache_entry *e;
+    int i;
+
+    if(d->backend==DISK_BACKEND_DIRECT) bounce_out(d,r->write,slot->iov,r->count,slot->saved);
+    if(slot->result==(ssize_t)r->count*DISK_BLOCK_SIZE) {
+        if(r->write) { STAT_ADD(d,writes,r->count); } else { STAT_ADD(d,reads,r->count); }
+        if(r->count>1) STAT_ADD(d,coalesced,1);
+    } else if(slot->result>=0) {
+        //a short transfer: finish the request a block at a time
+        for(i = 0; i < r->count; i += 1) {
+            if(r->write) raw_write(d,r->blocknum+i,r->data[i]); else raw_read(d,r->blocknum+i,r->data[i]);
+        }
     } else {
-        printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+        errno = -slot->result;
+        disk_error();
+    }
+
+    //a cached copy of a block may be newer than what was just read from the image
+    if(!r->write && d->nshards) {
+        for(i = 0; i < r->count; i += 1) {
+            s = shard_of(d,r->blocknum+i);
+            pthread_mutex_lock(&s->lock);
+            e = cache_lookup(d,s,r->blocknum+i);
+            if(e) memcpy(r->data[i],e->data,DISK_BLOCK_SIZE);
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+
+    slot->next = q->free;
+    q->free = slot;
+    q->inflight -= 1;
+    if(r->done) r->done(r);
+}
+
+//finish whatever requests are done, waiting for at least one if wait is set and any are in flight
+//returns the number finished
+static int queue_reap( struct disk_queue *q, int wait )
+{
+    struct disk_slot *done, *next;
+    int n = 0;
+
+    if(!q->inflight) return 0;
+
+    if(q->engine==DISK_ENGINE_URING) {
+        uring_collect(q,wait);
+    } else if(q->engine==DISK_ENGINE_THREADS) {
+        pthread_mutex_lock(&q->lock);
+        while(wait && !q->completed) pthread_cond_wait(&q->finished,&q->lock);
+    }
+    done = q->completed;
+    q->completed = 0;
+    if(q->engine==DISK_ENGINE_THREADS) pthread_mutex_unlock(&q->lock);
+
+    for(; done; done = next, n += 1) {
+        next = done->next;
+        queue_complete(q,done);
+    }
+    return n;
+}
+
+struct disk_queue *disk_queue_open( struct disk *d, int depth, int engine )
+{
+    struct disk_queue *q;
+    int i;
+
+    if(depth<1) depth = 1;
+    q = calloc(1,sizeof(*q));
+    if(!q) return 0;
+    q->slots = calloc(depth,sizeof(*q->slots));
+    if(!q->slots) {
+        free(q);
+        return 0;
+    }
+    q->disk = d;
+    q->depth = depth;
+    for(i = 0; i < depth; i += 1) {
+        q->slots[i].next = q->free;
+        q->free = &q->slots[i];
+    }
+
+    if(d->diskmap) {
+        q->engine = DISK_ENGINE_SYNC;
+        return q;
+    }
+    if(engine!=DISK_ENGINE_THREADS && uring_open(q)) {
+        q->engine = DISK_ENGINE_URING;
+        return q;
+    }
+
+    //no io_uring: a few threads making ordinary blocking calls
+    q->engine = DISK_ENGINE_THREADS;
+    pthread_mutex_init(&q->lock,0);
+    pthread_cond_init(&q->work,0);
+    pthread_cond_init(&q->finished,0);
+    for(i = 0; i < DISK_QUEUE_WORKERS && i < depth; i += 1) {
+        if(pthread_create(&q->workers[i],0,queue_worker,q)) break;
+    }
+    q->nworkers = i;
+    if(!q->nworkers) {
+        disk_queue_close(q);
+        return 0;
+    }
+    return q;
+}
+
+int disk_queue_engine( struct disk_queue *q )
+{
+    return q->engine;
+}
+
+//queue a request; with cached set, cached copies of the blocks a write covers are updated to match it
+static void queue_submit( struct disk_queue *q, struct disk_request *r, int cached )
+{
+    struct disk *d = q->disk;
+    struct disk_slot *slot;
+    struct cache_shard *s;
+    struct cache_entry *e;
+    int i;
+
+    if(r->count<1 || r->count>DISK_MAX_RUN) {
+        printf("ERROR: request of %d blocks!\n",r->count);
         abort();
     }
+
+    while(q->inflight>=q->depth) queue_reap(q,1);
+
+    slot = q->free;
+    q->free = slot->next;
+    slot->request = r;
+    for(i = 0; i < r->count; i += 1) {
+        sanity_check(d,r->blocknum+i,r->data[i]);
+        slot->iov[i].iov_base = r->data[i];
+        slot->iov[i].iov_len = DISK_BLOCK_SIZE;
+    }
+    if(d->backend==DISK_BACKEND_DIRECT) bounce_in(d,r->write,slot->iov,r->count,slot->saved);
+    q->inflight += 1;
+
+    //the image is about to hold the new data, so any cached copy takes it too and is clean
+    if(r->write && cached && d->nshards) {
+        for(i = 0; i < r->count; i += 1) {
+            s = shard_of(d,r->blocknum+i);
+            pthread_mutex_lock(&s->lock);
+            e = cache_lookup(d,s,r->blocknum+i);
+            if(e) {
+                memcpy(e->data,r->data[i],DISK_BLOCK_SIZE);
+                e->dirty = 0;
+            }
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+
+    if(r->write && crash_armed(d)) {
+        //done here and now, so the writes are counted against the crash in the order they were submitted
+        slot->result = queue_transfer(d,r,slot->iov);
+        if(q->engine==DISK_ENGINE_THREADS) pthread_mutex_lock(&q->lock);
+        slot->next = q->completed;
+        q->completed = slot;
+        if(q->engine==DISK_ENGINE_THREADS) pthread_mutex_unlock(&q->lock);
+    } else if(q->engine==DISK_ENGINE_URING) {
+        uring_submit(q,slot);
+    } else if(q->engine==DISK_ENGINE_THREADS) {
+        slot->next = 0;
+        pthread_mutex_lock(&q->lock);
+        if(q->pending) q->pending_tail->next = slot; else q->pending = slot;
+        q->pending_tail = slot;
+        pthread_cond_signal(&q->work);
+        pthread_mutex_unlock(&q->lock);
+    } else {
+        slot->result = queue_transfer(d,r,slot->iov);
+        slot->next = q->completed;
+        q->completed = slot;
+    }
 }
 
-void disk_close()
+void disk_submit( struct disk_queue *q, struct disk_request *r )
+{
+    queue_submit(q,r,1);
+}
+
+int disk_poll( struct disk_queue *q )
+{
+    return queue_reap(q,0);
+}
+
+int disk_wait( struct disk_queue *q )
+{
+    return queue_reap(q,1);
+}
+
+void disk_drain( struct disk_queue *q )
+{
+    while(q->inflight) queue_reap(q,1);
+}
+
+void disk_queue_close( struct disk_queue *q )
+{
+    int i;
+
+    if(!q) return;
+    disk_drain(q);
+    if(q->engine==DISK_ENGINE_URING) {
+        uring_close(q);
+    } else if(q->engine==DISK_ENGINE_THREADS) {
+        pthread_mutex_lock(&q->lock);
+        q->stop = 1;
+        pthread_cond_broadcast(&q->work);
+        pthread_mutex_unlock(&q->lock);
+        for(i = 0; i < q->nworkers; i += 1) pthread_join(q->workers[i],0);
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->work);
+        pthread_cond_destroy(&q->finished);
+    }
+    free(q->slots);
+    free(q);
+}
+
+//write back sorted dirty blocks as runs of adjacent blocks, keeping up to DISK_FLUSH_DEPTH runs in flight
+//returns zero, leaving the work to raw_batch, when it all fits in one run or no queue can be had
+static int cache_flush_async( struct disk *d, const int *blocknums, char * const *data, int n )
+{
+    struct disk_request *requests;
+    int i, count, nruns = 0;
+
+    for(i = 1; i < n && blocknums[i]==blocknums[i-1]+1; i += 1);
+    if(i>=n && n<=DISK_MAX_RUN) return 0;
+    if(!d->flushq) d->flushq = disk_queue_open(d,DISK_FLUSH_DEPTH,DISK_ENGINE_AUTO);
+    if(!d->flushq) return 0;
+    requests = malloc(sizeof(*requests) * n);
+    if(!requests) return 0;
+
+    //the shard locks are held, so cached copies are left alone
+    for(i = 0; i < n; i += count) {
+        for(count = 1; i+count < n && blocknums[i+count]==blocknums[i]+count && count < DISK_MAX_RUN; count += 1);
+        memset(&requests[nruns],0,sizeof(requests[nruns]));
+        requests[nruns].write = 1;
+        requests[nruns].blocknum = blocknums[i];
+        requests[nruns].count = count;
+        requests[nruns].data = data+i;
+        queue_submit(d->flushq,&requests[nruns],0);
+        nruns += 1;
+    }
+    disk_drain(d->flushq);
+    free(requests);
+    return 1;
+}
+
+//gather the dirty blocks of every shard and write them back in block order,
+//so adjacent dirty blocks go out together even though they live in different d->shards
+static void cache_flush( struct disk *d )
+{
+    struct cache_entry **dirty;
+    int *blocknums;
+    char **data;
+    int i, k, ndirty = 0;
+
+    if(!d->nshards) return;
+
+    for(k = 0; k < d->nshards; k += 1) pthread_mutex_lock(&d->shards[k].lock);
+    dirty = malloc(sizeof(*dirty) * d->cache_size);
+    blocknums = malloc(sizeof(*blocknums) * d->cache_size);
+    data = malloc(sizeof(*data) * d->cache_size);
+    for(k = 0; k < d->nshards; k += 1) {
+        for(i = 0; i < d->shards[k].size; i += 1) {
+            if(d->shards[k].entries[i].blocknum>=0 && d->shards[k].entries[i].dirty) dirty[ndirty++] = &d->shards[k].entries[i];
+        }
+    }
+    qsort(dirty,ndirty,sizeof(*dirty),compare_entries);
+    for(i = 0; i < ndirty; i += 1) {
+        blocknums[i] = dirty[i]->blocknum;
+        data[i] = dirty[i]->data;
+        dirty[i]->dirty = 0;
+    }
+    if(!cache_flush_async(d,blocknums,data,ndirty)) raw_batch(d,1,blocknums,data,ndirty);
+    free(dirty);
+    free(blocknums);
+    free(data);
+    for(k = d->nshards - 1; k >= 0; k -= 1) pthread_mutex_unlock(&d->shards[k].lock);
+}
+
+void disk_sync_r( struct disk *d )
+{
+    if(d->diskfd<0) return;
+
+    cache_flush(d);
+    __atomic_store_n(&d->nbehind,0,__ATOMIC_RELAXED);
+
+    if(d->diskmap) {
+        msync(d->diskmap,(size_t)d->nblocks*DISK_BLOCK_SIZE,MS_SYNC);
+    }
+}
+
+//make every write that has reached the image so far durable before any later one
+//blocks still dirty in the block cache are not included; disk_sync_r first to write them back
+void disk_barrier_r( struct disk *d )
+{
+    if(d->diskfd<0) return;
+
+    if(d->diskmap) {
+        if(msync(d->diskmap,(size_t)d->nblocks*DISK_BLOCK_SIZE,MS_SYNC)<0) disk_error();
+    } else if(fdatasync(d->diskfd)<0) {
+        disk_error();
+    }
+}
+
+static void cache_free( struct disk *d )
+{
+    int k;
+
+    for(k = 0; k < d->nshards; k += 1) {
+        pthread_mutex_destroy(&d->shards[k].lock);
+        free(d->shards[k].entries);
+        free(d->shards[k].blocks);
+        free(d->shards[k].hash);
+    }
+    memset(d->shards,0,sizeof(d->shards));
+    d->nshards = 0;
+}
+
+int disk_cache_resize_r( struct disk *d, int n )
+{
+    struct cache_shard *s;
+    int i, k, nbuckets;
+
+    if(n<0) n = 0;
+    if(d->diskmap) return 0; //the mmap d->backend has no block cache of its own
+
+    //flush and drop the old cache before building the new one
+    disk_sync_r(d);
+    cache_free(d);
+    d->cache_size = n;
+
+    if(n==0) return 1;
+
+    //split the blocks between the d->shards, but never leave a shard empty
+    d->nshards = n < DISK_CACHE_SHARDS ? n : DISK_CACHE_SHARDS;
+    for(k = 0; k < d->nshards; k += 1) {
+        s = &d->shards[k];
+        s->size = n / d->nshards + (k < n % d->nshards);
+        nbuckets = 1;
+        while(nbuckets < 2*s->size) nbuckets <<= 1;
+        s->hash_mask = nbuckets - 1;
+        pthread_mutex_init(&s->lock,0);
+        s->entries = malloc(sizeof(*s->entries) * s->size);
+        s->hash = calloc(nbuckets,sizeof(*s->hash));
+        if(posix_memalign((void **)&s->blocks,DISK_ALIGN,(size_t)s->size*DISK_BLOCK_SIZE)) s->blocks = 0;
+        if(!s->entries || !s->hash || !s->blocks) {
+            d->nshards = k + 1;
+            cache_free(d);
+            d->cache_size = 0;
+            return 0;
+        }
+        for(i = 0; i < s->size; i += 1) {
+            s->entries[i].data = s->blocks+(size_t)i*DISK_BLOCK_SIZE;
+            s->entries[i].blocknum = -1;
+            s->entries[i].dirty = 0;
+            s->entries[i].hnext = 0;
+            s->entries[i].prev = s->entries[i].next = 0;
+            lru_push_front(s,&s->entries[i]);
+        }
+    }
+
+    return 1;
+}
+
+void disk_read_r( struct disk *d, int blocknum, char *data )
+{
+    struct cache_shard *s;
+    struct cache_entry *e;
+
+    sanity_check(d,blocknum,data);
+
+    if(!d->nshards || d->diskmap) {
+        raw_read(d,blocknum,data);
+        return;
+    }
+
+    s = shard_of(d,blocknum);
+    pthread_mutex_lock(&s->lock);
+    e = cache_lookup(d,s,blocknum);
+    if(e) {
+        STAT_ADD(d,hits,1);
+        lru_unlink(s,e);
+        lru_push_front(s,e);
+    } else {
+        STAT_ADD(d,misses,1);
+        e = cache_evict(d,s,blocknum);
+        raw_read(d,blocknum,e->data);
+    }
+    memcpy(data,e->data,DISK_BLOCK_SIZE);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void disk_write_r( struct disk *d, int blocknum, const char *data )
+{
+    struct cache_shard *s;
+    struct cache_entry *e;
+
+    sanity_check(d,blocknum,data);
+
+    if(!d->nshards || d->diskmap) {
+        raw_write(d,blocknum,data);
+        return;
+    }
+
+    s = shard_of(d,blocknum);
+    pthread_mutex_lock(&s->lock);
+    e = cache_lookup(d,s,blocknum);
+    if(e) {
+        STAT_ADD(d,hits,1);
+        lru_unlink(s,e);
+        lru_push_front(s,e);
+    } else {
+        //a full-block write never needs the old contents, so no read on a miss
+        STAT_ADD(d,misses,1);
+        e = cache_evict(d,s,blocknum);
+    }
+    memcpy(e->data,data,DISK_BLOCK_SIZE);
+    e->dirty = 1;
+    pthread_mutex_unlock(&s->lock);
+}
+
+//a block of a batch, sorted by block number so adjacent blocks can be merged into one request
+struct batch_item {
+    int blocknum;
+    char *data;
+};
+
+static int compare_items( const void *a, const void *b )
+{
+    int x = ((const struct batch_item *)a)->blocknum;
+    int y = ((const struct batch_item *)b)->blocknum;
+    return (x > y) - (x < y);
+}
+
+//read or write a batch: cached blocks are served from the cache, the rest go to the image in merged runs
+static void disk_batch( struct disk *d, int write, const int *blocknums, char * const *data, int n )
+{
+    struct batch_item stackitems[DISK_MAX_RUN], *items = stackitems;
+    int stackblocks[DISK_MAX_RUN], *runblocks = stackblocks;
+    char *stackdata[DISK_MAX_RUN], **rundata = stackdata;
+    struct cache_shard *s;
+    struct cache_entry *e;
+    int i, nmiss = 0, hit;
+
+    if(n<=0) return;
+
+    if(n>DISK_MAX_RUN) {
+        items = malloc(sizeof(*items) * n);
+        runblocks = malloc(sizeof(*runblocks) * n);
+        rundata = malloc(sizeof(*rundata) * n);
+    }
+
+    for(i = 0; i < n; i += 1) {
+        sanity_check(d,blocknums[i],data[i]);
+        items[i].blocknum = blocknums[i];
+        items[i].data = data[i];
+    }
+    qsort(items,n,sizeof(*items),compare_items);
+
+    for(i = 0; i < n; i += 1) {
+        hit = 0;
+        if(d->nshards && !d->diskmap) {
+            s = shard_of(d,items[i].blocknum);
+            pthread_mutex_lock(&s->lock);
+            e = cache_lookup(d,s,items[i].blocknum);
+            if(e && !write) {
+                //the cached copy may be newer than the image
+                memcpy(items[i].data,e->data,DISK_BLOCK_SIZE);
+                hit = 1;
+            } else if(e) {
+                //written through below, so the cached copy is clean afterwards
+                memcpy(e->data,items[i].data,DISK_BLOCK_SIZE);
+                e->dirty = 0;
+            }
+            pthread_mutex_unlock(&s->lock);
+            if(e) { STAT_ADD(d,hits,1); } else { STAT_ADD(d,misses,1); }
+        }
+        if(hit) continue;
+        runblocks[nmiss] = items[i].blocknum;
+        rundata[nmiss] = items[i].data;
+        nmiss++;
+    }
+
+    raw_batch(d,write,runblocks,rundata,nmiss);
+
+    if(items!=stackitems) {
+        free(items);
+        free(runblocks);
+        free(rundata);
+    }
+}
+
+void disk_readv_r( struct disk *d, const int *blocknums, char **data, int n )
+{
+    disk_batch(d,0,blocknums,data,n);
+}
+
+void disk_writev_r( struct disk *d, const int *blocknums, const char **data, int n )
+{
+    disk_batch(d,1,blocknums,(char * const *)data,n);
+}
+
+//read the given blocks, none of them cached, into the block cache as runs of adjacent blocks with up to
+//DISK_PREFETCH_DEPTH of them in flight; pool buffers are aligned, so the reads go straight into them
+static void prefetch_runs( struct disk *d, const int *missing, int nmiss, char **bufs, struct disk_request *requests )
+{
+    struct cache_shard *s;
+    struct cache_entry *e;
+    int i, count, nruns = 0;
+
+    pool_get(d,bufs,nmiss);
+    for(i = 0; i < nmiss; i += count) {
+        for(count = 1; i+count < nmiss && missing[i+count]==missing[i]+count && count < DISK_MAX_RUN; count += 1);
+        memset(&requests[nruns],0,sizeof(requests[nruns]));
+        requests[nruns].blocknum = missing[i];
+        requests[nruns].count = count;
+        requests[nruns].data = bufs+i;
+        queue_submit(d->prefetchq,&requests[nruns],0);
+        nruns += 1;
+    }
+    disk_drain(d->prefetchq);
+
+    //a block cached in the meantime may be newer than what was read, so it is left alone
+    for(i = 0; i < nmiss; i += 1) {
+        s = shard_of(d,missing[i]);
+        pthread_mutex_lock(&s->lock);
+        if(!cache_lookup(d,s,missing[i])) {
+            e = cache_evict(d,s,missing[i]);
+            memcpy(e->data,bufs[i],DISK_BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    pool_put(d,bufs,nmiss);
+}
+
+//bring the blocks that are not cached yet into the block cache, for O_DIRECT, whose reads never look in the page cache
+//at most half the cache is filled, so a prefetch does not push out the blocks it brought in itself
+//the blocks must not be written meanwhile by anyone else; fs_readahead holds the inode's lock
+//only one thread prefetches at a time, and a call that finds another one at it does nothing
+static void cache_prefetch( struct disk *d, const int *blocknums, int n )
+{
+    struct disk_request *requests;
+    struct cache_shard *s;
+    int *missing;
+    char **bufs;
+    int i, nmiss = 0;
+
+    if(!d->nshards || n <= 0) return;
+    if(n > d->cache_size / 2) n = d->cache_size / 2;
+    if(pthread_mutex_trylock(&d->prefetch_lock)) return;
+
+    if(!d->prefetchq) d->prefetchq = disk_queue_open(d,DISK_PREFETCH_DEPTH,DISK_ENGINE_AUTO);
+    missing = malloc(sizeof(*missing) * n);
+    bufs = malloc(sizeof(*bufs) * n);
+    requests = malloc(sizeof(*requests) * n);
+    if(d->prefetchq && missing && bufs && requests) {
+        for(i = 0; i < n; i += 1) {
+            s = shard_of(d,blocknums[i]);
+            pthread_mutex_lock(&s->lock);
+            if(!cache_lookup(d,s,blocknums[i])) missing[nmiss++] = blocknums[i];
+            pthread_mutex_unlock(&s->lock);
+        }
+        if(nmiss) prefetch_runs(d,missing,nmiss,bufs,requests);
+    }
+    free(missing);
+    free(bufs);
+    free(requests);
+    pthread_mutex_unlock(&d->prefetch_lock);
+}
+
+//tell the kernel which blocks will be read next, so it can start bringing them into the page cache while the
+//caller works; adjacent blocks are passed on as one range
+//nothing is copied, so the blocks end up in the block cache only once they are actually read
+//O_DIRECT bypasses the page cache, so there the blocks are read into the block cache before this returns
+void disk_prefetch_r( struct disk *d, const int *blocknums, int n )
+{
+    int i, k;
+
+    for(i = 0; i < n; i = k) {
+        sanity_check(d,blocknums[i],blocknums);
+        for(k = i + 1; k < n && blocknums[k]==blocknums[k-1]+1; k += 1);
+        if(d->diskmap) {
+            madvise(d->diskmap+(size_t)blocknums[i]*DISK_BLOCK_SIZE,(size_t)(k-i)*DISK_BLOCK_SIZE,MADV_WILLNEED);
+        } else if(d->backend!=DISK_BACKEND_DIRECT) {
+            posix_fadvise(d->diskfd,(off_t)blocknums[i]*DISK_BLOCK_SIZE,(off_t)(k-i)*DISK_BLOCK_SIZE,POSIX_FADV_WILLNEED);
+        }
+    }
+    if(d->backend==DISK_BACKEND_DIRECT) cache_prefetch(d,blocknums,n);
+}
+
+//the most blocks worth prefetching ahead of a reader: with O_DIRECT they have to fit in half the block cache,
+//or the later ones push out the earlier ones before they are read
+int disk_prefetch_max_r( struct disk *d )
+{
+    if(d->backend==DISK_BACKEND_DIRECT) return d->cache_size / 2;
+    return d->nblocks;
+}
+
+//write blocks into the cache and leave them dirty, instead of writing through to the image like disk_writev
+//once blocks written this way fill half the cache, every dirty block is written back in block order,
+//so a stream of small writes reaches the image as a few large requests
+void disk_write_behind_r( struct disk *d, const int *blocknums, const char **data, int n )
+{
+    int i;
+
+    if(!d->nshards || d->diskmap || n > d->cache_size / 2) {
+        disk_writev_r(d,blocknums,data,n);
+        return;
+    }
+
+    for(i = 0; i < n; i += 1) disk_write_r(d,blocknums[i],data[i]);
+    if(__atomic_add_fetch(&d->nbehind,n,__ATOMIC_RELAXED) >= d->cache_size / 2) {
+        __atomic_store_n(&d->nbehind,0,__ATOMIC_RELAXED);
+        cache_flush(d);
+    }
+}
+
+//bring the cache in line with a transfer of blocks [start, start+n) that goes around it:
+//with drop set the cached copies are forgotten, since the image is about to be overwritten;
+//otherwise dirty ones are written back, so the image is current
+static void cache_bypass( struct disk *d, int start, int n, int drop )
+{
+    struct cache_shard *s;
+    struct cache_entry *e;
+    int b;
+
+    if(!d->nshards || d->diskmap) return;
+
+    for(b = start; b < start+n; b += 1) {
+        s = shard_of(d,b);
+        pthread_mutex_lock(&s->lock);
+        e = cache_lookup(d,s,b);
+        if(e && drop) {
+            cache_forget(d,s,e);
+        } else if(e && e->dirty) {
+            raw_write(d,b,e->data);
+            e->dirty = 0;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+//move n blocks between the image at block start and the host file fd at byte offset, leaving fd's position alone
+//runs go through the kernel with copy_file_range where both files allow it, so the data is never copied
+//into user space; the mmap backend reads and writes fd straight from the mapping; anything else, the direct
+//backend (whose image copy_file_range would pull into the page cache), and every transfer while a crash is
+//arranged, goes through up to DISK_MAX_RUN pool buffers at a time
+//returns the number of blocks moved, which is short only when fd ends or fails first
+static int disk_copy( struct disk *d, int write, int start, int n, int fd, long long offset )
+{
+    struct iovec iov[DISK_MAX_RUN];
+    loff_t image = (loff_t)start*DISK_BLOCK_SIZE, host = offset;
+    ssize_t result = 0, want = (ssize_t)n*DISK_BLOCK_SIZE, done = 0;
+    char *buffers[DISK_MAX_RUN], *mapped;
+    int i, count, moved, nbuffers;
+
+    if(n<=0) return 0;
+    sanity_check(d,start,&fd);
+    sanity_check(d,start+n-1,&fd);
+    cache_bypass(d,start,n,write);
+
+    if(!crash_armed(d) && d->backend!=DISK_BACKEND_DIRECT) {
+        mapped = d->diskmap ? d->diskmap+image : 0;
+        while(done<want) {
+            if(mapped && write) {
+                result = pread(fd,mapped+done,want-done,host+done);
+            } else if(mapped) {
+                result = pwrite(fd,mapped+done,want-done,host+done);
+            } else if(write) {
+                result = copy_file_range(fd,&host,d->diskfd,&image,want-done,0);
+            } else {
+                result = copy_file_range(d->diskfd,&image,fd,&host,want-done,0);
+            }
+            if(result<=0) break;
+            done += result;
+        }
+        if(done>=want || result==0) {
+            moved = done / DISK_BLOCK_SIZE;
+            if(write) { STAT_ADD(d,writes,moved); } else { STAT_ADD(d,reads,moved); }
+            if(moved>1) STAT_ADD(d,coalesced,1);
+            return moved;
+        }
+        //copy_file_range does not work between these files: the rest goes through a buffer
+        done -= done % DISK_BLOCK_SIZE;
+    }
+
+    nbuffers = n-done/DISK_BLOCK_SIZE < DISK_MAX_RUN ? n-done/DISK_BLOCK_SIZE : DISK_MAX_RUN;
+    pool_get(d,buffers,nbuffers);
+    for(i = 0; i < nbuffers; i += 1) {
+        iov[i].iov_base = buffers[i];
+        iov[i].iov_len = DISK_BLOCK_SIZE;
+    }
+    for(moved = done / DISK_BLOCK_SIZE; moved < n; moved += count) {
+        count = n-moved < DISK_MAX_RUN ? n-moved : DISK_MAX_RUN;
+        if(write) {
+            result = preadv(fd,iov,count,offset+(long long)moved*DISK_BLOCK_SIZE);
+            if(result<(ssize_t)count*DISK_BLOCK_SIZE) {
+                count = result>0 ? result / DISK_BLOCK_SIZE : 0;
+                if(count>0) raw_run(d,1,start+moved,iov,count);
+                moved += count;
+                break;
+            }
+            raw_run(d,1,start+moved,iov,count);
+        } else {
+            raw_run(d,0,start+moved,iov,count);
+            result = pwritev(fd,iov,count,offset+(long long)moved*DISK_BLOCK_SIZE);
+            if(result<(ssize_t)count*DISK_BLOCK_SIZE) {
+                moved += result>0 ? result / DISK_BLOCK_SIZE : 0;
+                break;
+            }
+        }
+    }
+    pool_put(d,buffers,nbuffers);
+    return moved;
+}
+
+int disk_copy_in_r( struct disk *d, int start, int n, int fd, long long offset )
+{
+    return disk_copy(d,1,start,n,fd,offset);
+}
+
+int disk_copy_out_r( struct disk *d, int start, int n, int fd, long long offset )
+{
+    return disk_copy(d,0,start,n,fd,offset);
+}
+
+//deallocate n blocks starting at start so they read back as zeros without being written
+//returns one on success, zero if the image file cannot do it (the caller should write zeros instead)
+int disk_discard_r( struct disk *d, int start, int n )
+{
+    struct cache_entry *e;
+    int i, k, done = 0;
+
+    if(n<=0) return 1;
+    sanity_check(d,start,&n);
+    sanity_check(d,start+n-1,&n);
+    if(crash_armed(d)) return 0; //have the caller write the zeros, so they count toward the crash
+
+    if(fallocate(d->diskfd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,(off_t)start*DISK_BLOCK_SIZE,(off_t)n*DISK_BLOCK_SIZE)==0) {
+        done = 1;
+    } else if(!d->diskmap && start+n==d->nblocks) {
+        //a range running to the end of the image can be cut off and grown back as a sparse tail
+        if(ftruncate(d->diskfd,(off_t)start*DISK_BLOCK_SIZE)==0 && ftruncate(d->diskfd,(off_t)d->nblocks*DISK_BLOCK_SIZE)==0) done = 1;
+    }
+
+    if(done && !d->diskmap) {
+        for(k = 0; k < d->nshards; k += 1) {
+            pthread_mutex_lock(&d->shards[k].lock);
+            for(i = 0; i < d->shards[k].size; i += 1) {
+                e = &d->shards[k].entries[i];
+                if(e->blocknum>=start && e->blocknum<start+n) cache_forget(d,&d->shards[k],e);
+            }
+            pthread_mutex_unlock(&d->shards[k].lock);
+        }
+    }
+
+    return done;
+}
+
+const char *disk_block_ptr_r( struct disk *d, int blocknum )
+{
+    const char *data;
+
+    if(!d->diskmap) return 0;
+
+    data = d->diskmap+(size_t)blocknum*DISK_BLOCK_SIZE;
+    sanity_check(d,blocknum,data);
+    STAT_ADD(d,reads,1);
+
+    return data;
+}
+
+void disk_stats_r( struct disk *d, struct disk_stats *stats )
+{
+    stats->reads = __atomic_load_n(&d->nreads,__ATOMIC_RELAXED);
+    stats->writes = __atomic_load_n(&d->nwrites,__ATOMIC_RELAXED);
+    stats->hits = __atomic_load_n(&d->nhits,__ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&d->nmisses,__ATOMIC_RELAXED);
+    stats->coalesced = __atomic_load_n(&d->ncoalesced,__ATOMIC_RELAXED);
+}
+
+void disk_crash_after_r( struct disk *d, int nwrites )
+{
+    __atomic_store_n(&d->crashafter,nwrites < 0 ? -1 : nwrites,__ATOMIC_RELAXED);
+    __atomic_store_n(&d->crashed,0,__ATOMIC_RELAXED);
+}
+
+int disk_crashed_r( struct disk *d )
+{
+    return __atomic_load_n(&d->crashed,__ATOMIC_RELAXED);
+}
+
+void disk_thread_stats( struct disk_stats *stats )
+{
+    *stats = thread_stats;
+}
+
+void disk_close_r( struct disk *d )
 {
-    if(diskfile) {
-        printf("%d disk block reads\n",nreads);
-        printf("%d disk block writes\n",nwrites);
-        fclose(diskfile);
-        diskfile = 0;
+    if(!d) return;
+
+    disk_sync_r(d);
+    printf("%d disk block reads\n",d->nreads);
+    printf("%d disk block writes\n",d->nwrites);
+    printf("%d cache hits\n",d->nhits);
+    printf("%d cache misses\n",d->nmisses);
+    printf("%d coalesced multi-block requests\n",d->ncoalesced);
+    if(d->diskmap) {
+        munmap(d->diskmap,(size_t)d->nblocks*DISK_BLOCK_SIZE);
+        d->diskmap = 0;
     }
+    if(d->backend==DISK_BACKEND_DIRECT) printf("%d aligned transfer buffers\n",d->pool.size);
+    disk_queue_close(d->flushq);
+    d->flushq = 0;
+    disk_queue_close(d->prefetchq);
+    d->prefetchq = 0;
+    pthread_mutex_destroy(&d->prefetch_lock);
+    close(d->diskfd);
+    d->diskfd = -1;
+    disk_cache_resize_r(d,0);
+    pool_free(d);
+    free(d);
+}
+
+/*
+The calls below work on the default image opened by disk_init, for code that
+only ever deals with one image.
+*/
+
+struct disk *disk_default()
+{
+    return default_disk;
+}
+
+int disk_init( const char *filename, int n )
+{
+    return disk_init_backend(filename,n,DISK_BACKEND_FILE);
 }
 
+int disk_init_backend( const char *filename, int n, int type )
+{
+    struct disk *d = disk_open(filename,n,type);
+    if(!d) return 0;
+
+    if(default_cache_size!=DISK_CACHE_DEFAULT && !d->diskmap && !disk_cache_resize_r(d,default_cache_size)) {
+        disk_close_r(d);
+        return 0;
+    }
+    default_disk = d;
+    return 1;
+}
+
+int disk_size()
+{
+    return disk_size_r(default_disk);
+}
+
+void disk_read( int blocknum, char *data )
+{
+    disk_read_r(default_disk,blocknum,data);
+}
+
+void disk_write( int blocknum, const char *data )
+{
+    disk_write_r(default_disk,blocknum,data);
+}
+
+void disk_readv( const int *blocknums, char **data, int n )
+{
+    disk_readv_r(default_disk,blocknums,data,n);
+}
+
+void disk_writev( const int *blocknums, const char **data, int n )
+{
+    disk_writev_r(default_disk,blocknums,data,n);
+}
+
+int disk_discard( int start, int n )
+{
+    return disk_discard_r(default_disk,start,n);
+}
+
+void disk_prefetch( const int *blocknums, int n )
+{
+    disk_prefetch_r(default_disk,blocknums,n);
+}
+
+int disk_prefetch_max()
+{
+    return disk_prefetch_max_r(default_disk);
+}
+
+void disk_write_behind( const int *blocknums, const char **data, int n )
+{
+    disk_write_behind_r(default_disk,blocknums,data,n);
+}
+
+int disk_copy_in( int start, int n, int fd, long long offset )
+{
+    return disk_copy_in_r(default_disk,start,n,fd,offset);
+}
+
+int disk_copy_out( int start, int n, int fd, long long offset )
+{
+    return disk_copy_out_r(default_disk,start,n,fd,offset);
+}
+
+const char *disk_block_ptr( int blocknum )
+{
+    return disk_block_ptr_r(default_disk,blocknum);
+}
+
+void disk_sync()
+{
+    if(default_disk) disk_sync_r(default_disk);
+}
+
+void disk_barrier()
+{
+    if(default_disk) disk_barrier_r(default_disk);
+}
+
+int disk_cache_resize( int n )
+{
+    if(n<0) n = 0;
+    if(!default_disk) {
+        default_cache_size = n;
+        return 1;
+    }
+    if(!disk_cache_resize_r(default_disk,n)) return 0;
+    default_cache_size = n;
+    return 1;
+}
+
+void disk_close()
+{
+    disk_close_r(default_disk);
+    default_disk = 0;
+}
@@ -2,11 +2,108 @@
 #define DISK_H
 
 #define DISK_BLOCK_SIZE 4096
+#define DISK_CACHE_DEFAULT 64
+#define DISK_CACHE_SHARDS 8 //independently locked parts of the block cache
+#define DISK_MAX_RUN 256 //most blocks merged into one vectored request
 
+#define DISK_BACKEND_FILE 0
+#define DISK_BACKEND_MMAP 1
+#define DISK_BACKEND_DIRECT 2 //O_DIRECT: the image stays out of the page cache, leaving the block cache its only copy in memory
+
+/*
+Each open image is a struct disk with its own file, cache and statistics;
+a process may have any number of them open at once.  The calls without a
+handle work on the default image opened by disk_init.
+*/
+
+struct disk;
+
+//block I/O counters of one disk since it was opened
+struct disk_stats {
+    int reads;     //blocks read from the image
+    int writes;    //blocks written to the image
+    int hits;      //requests served by the block cache
+    int misses;    //requests that had to go to the image
+    int coalesced; //vectored requests covering more than one block
+};
+
+#define DISK_ENGINE_AUTO    0 //io_uring if the kernel has it, worker threads otherwise
+#define DISK_ENGINE_URING   1
+#define DISK_ENGINE_THREADS 2
+#define DISK_ENGINE_SYNC    3 //the mmap backend, where a request is done as soon as it is submitted
+
+/*
+A struct disk_queue keeps up to 'depth' requests in flight on one disk,
+through io_uring where the kernel has it and a few worker threads where it
+does not.  Completions, done callbacks included, are handled inside
+disk_submit (when the queue is full), disk_poll, disk_wait and disk_drain,
+on the calling thread; one thread at a time may use a queue.  A request's
+blocks should not be touched through the other calls until it completes.
+*/
+
+struct disk_queue;
+
+//an asynchronous transfer of 'count' consecutive blocks, owned by the caller until it completes
+struct disk_request {
+    int write;          //one to write the blocks, zero to read them
+    int blocknum;       //first block
+    int count;          //number of blocks, at most DISK_MAX_RUN
+    char * const *data; //one buffer per block
+    void (*done)( struct disk_request *r ); //called once the request is complete, may be null
+    void *arg;          //for the caller's use
+};
+
+struct disk *disk_open( const char *filename, int nblocks, int backend );
+int  disk_size_r( struct disk *d );
+void disk_read_r( struct disk *d, int blocknum, char *data );
+void disk_write_r( struct disk *d, int blocknum, const char *data );
+void disk_readv_r( struct disk *d, const int *blocknums, char **data, int n );
+void disk_writev_r( struct disk *d, const int *blocknums, const char **data, int n );
+void disk_prefetch_r( struct disk *d, const int *blocknums, int n );
+int  disk_prefetch_max_r( struct disk *d );
+void disk_write_behind_r( struct disk *d, const int *blocknums, const char **data, int n );
+int  disk_discard_r( struct disk *d, int start, int n );
+int  disk_copy_in_r( struct disk *d, int start, int n, int fd, long long offset );
+int  disk_copy_out_r( struct disk *d, int start, int n, int fd, long long offset );
+const char *disk_block_ptr_r( struct disk *d, int blocknum );
+void disk_sync_r( struct disk *d );
+void disk_barrier_r( struct disk *d );
+void disk_stats_r( struct disk *d, struct disk_stats *stats );
+void disk_thread_stats( struct disk_stats *stats );
+int  disk_cache_resize_r( struct disk *d, int nblocks );
+void disk_close_r( struct disk *d );
+
+//for crash testing: let nwrites more blocks reach the image, then drop every later write without a word, as if
+//the power had gone out; a negative count disarms it.  disk_crashed_r tells whether a write has been dropped
+void disk_crash_after_r( struct disk *d, int nwrites );
+int  disk_crashed_r( struct disk *d );
+
+struct disk_queue *disk_queue_open( struct disk *d, int depth, int engine );
+int  disk_queue_engine( struct disk_queue *q );
+void disk_submit( struct disk_queue *q, struct disk_request *r );
+int  disk_poll( struct disk_queue *q );
+int  disk_wait( struct disk_queue *q );
+void disk_drain( struct disk_queue *q );
+void disk_queue_close( struct disk_queue *q );
+
+struct disk *disk_default();
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_backend( const char *filename, int nblocks, int backend );
 int  disk_size();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_readv( const int *blocknums, char **data, int n );
+void disk_writev( const int *blocknums, const char **data, int n );
+void disk_prefetch( const int *blocknums, int n );
+int  disk_prefetch_max();
+void disk_write_behind( const int *blocknums, const char **data, int n );
+int  disk_discard( int start, int n );
+int  disk_copy_in( int start, int n, int fd, long long offset );
+int  disk_copy_out( int start, int n, int fd, long long offset );
+const char *disk_block_ptr( int blocknum );
+void disk_sync();
+void disk_barrier();
+int  disk_cache_resize( int nblocks );
 void disk_close();
 
 
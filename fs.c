@@ -1,31 +1,54 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "bitmap.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
-#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
 
 #define FS_MAGIC           0xf0f03410
 #define INODES_PER_BLOCK   128
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
+#define BITS_PER_BLOCK     (DISK_BLOCK_SIZE * 8)
+#define WORDS_PER_BLOCK    (DISK_BLOCK_SIZE / sizeof(uint64_t))
 
-int numBlocks = 0; //number of blocks on disk_read
-int iBlocks = 0; //number of blocks allocated for inodes
-int numNodes = 0; //number of inodes
-int *free_list;
-int free_size;
-int mountedOrNah = 0;
+#define FS_VERSION_LEGACY  0 //superblock has no version and no free block bitmap
+#define FS_VERSION_BITMAP  1 //free block bitmap stored after the inode table
+#define FS_VERSION_DINDIRECT 2 //last direct pointer of an inode holds a double-indirect block instead
+#define FS_VERSION_EXTENTS 3 //inodes may map their blocks with extents; superblock has flags
+#define FS_VERSION_JOURNAL 4 //metadata changes go through a journal stored after the bitmap
+#define FS_VERSION         FS_VERSION_JOURNAL
+
+#define FS_FLAG_EXTENTS    1 //superblock flag: fs_create makes extent-mapped inodes
+
+#define FS_INODE_POINTERS  1 //isvalid of an inode mapped by direct and indirect pointers
+#define FS_INODE_EXTENTS   2 //isvalid of an extent-mapped inode whose extent tree has depth zero; deeper trees add the depth
+#define FS_EXTENT_MAX_DEPTH 4
+#define FS_IS_EXTENTS(inode) ((inode)->isvalid >= FS_INODE_EXTENTS)
+#define FS_EXTENT_DEPTH(inode) ((inode)->isvalid - FS_INODE_EXTENTS)
+
+#define FS_DINDIRECT       (POINTERS_PER_INODE - 1) //slot of direct[] holding the double-indirect block
+#define FS_MAX_FILE_BLOCKS (INT_MAX / DISK_BLOCK_SIZE) //sizes are ints, so no file can map more blocks than this
 
 struct fs_superblock {
     int magic;
     int nblocks;
     int ninodeblocks;
     int ninodes;
+    int version;       //zero on images made before the superblock was versioned
+    int bitmapstart;   //first block of the free block bitmap
+    int nbitmapblocks;
+    int clean;         //set by fs_unmount, cleared while mounted
+    int flags;         //FS_FLAG_ bits, zero before FS_VERSION_EXTENTS
+    int journalstart;  //first block of the journal, zero before FS_VERSION_JOURNAL
+    int njournalblocks; //zero when the disk was too small to be given a journal
 };
 
 struct fs_inode {
@@ -35,626 +58,3337 @@ struct fs_inode {
     int indirect;
 };
 
+/*
+An extent-mapped inode keeps the same 32 bytes but reads everything after the
+size as three extents.  In a leaf an extent is a run of physical blocks; in an
+index it names a block of extents one level down and the number of file blocks
+that block covers.  While the file fits in three runs the extents sit in the
+inode itself (depth zero).  When it needs more, the inode's extents are moved
+into a new block and the inode points at it, one level deeper each time.
+New extents are added along the rightmost path of the tree, and every node is
+filled from the left with unused entries left zero.  A hole, a part of the file
+that was never written, is an extent with a start of zero.  Writing into one
+replaces its entry with the new run and what is left of the hole around it,
+splitting a node in two when that overfills it.
+*/
+struct fs_extent {
+    int start;  //first physical block of the run, zero for a hole, or the extent block one level down
+    int length; //file blocks covered, zero for an unused entry
+};
+
+#define EXTENTS_PER_INODE 3
+#define EXTENTS_PER_BLOCK ((int)(DISK_BLOCK_SIZE / sizeof(struct fs_extent)))
+
+struct fs_extent_inode {
+    int isvalid;
+    int size;
+    struct fs_extent extent[EXTENTS_PER_INODE];
+};
+
+/*
+The journal is a header block followed by a log of committed transactions,
+written one after another from the block after the header.  A transaction is
+a descriptor, taking as many blocks as it needs, followed by a copy of every
+metadata block it changed.  The descriptor lists where those blocks belong,
+then the blocks that held metadata and were freed by the transaction; copies
+of those in earlier transactions must not be replayed, since the block may
+since have been given to a file's data.  When the log is full every block in
+it is made durable in place and the log starts over from the header, which
+records the sequence number the first transaction of the new log must have.
+*/
+#define FS_JOURNAL_MAGIC 0x4a524e4c
+#define FS_JOURNAL_MIN   8    //smallest journal worth having; smaller disks are formatted without one
+#define FS_JOURNAL_MAX   4096 //a sixteenth of the disk, up to this many blocks
+#define FS_JOURNAL_BUCKETS 1024
+#define FS_JOURNAL_INTERVAL 50 //milliseconds the running transaction may stay open once something has changed
+
+struct fs_journal_header {
+    int magic;
+    int sequence; //of the first transaction in the log
+    int scan;     //set while a transaction too big for the log is written in place; mount then rebuilds the bitmap
+};
+
+//start of the descriptor of a transaction, followed by the ints of the logged and then the revoked block numbers
+struct fs_journal_descriptor {
+    int magic;
+    int sequence;
+    int ndescriptor; //blocks taken by the descriptor
+    int nlogged;     //blocks copied into the log after the descriptor
+    int nrevoked;    //metadata blocks freed by the transaction
+    unsigned checksum; //of the descriptor blocks (with this field zero) and the logged blocks
+};
+
+#define FS_JOURNAL_HEADER_INTS ((int)(sizeof(struct fs_journal_descriptor) / sizeof(int)))
+
 union fs_block {
     struct fs_superblock super;
+    struct fs_journal_header journal;
+    struct fs_journal_descriptor descriptor;
+    uint64_t words[WORDS_PER_BLOCK];
     struct fs_inode inode[INODES_PER_BLOCK];
     int pointers[POINTERS_PER_BLOCK];
+    struct fs_extent extents[EXTENTS_PER_BLOCK];
     char data[DISK_BLOCK_SIZE];
 };
 
-int fs_format() {
-    //create a new filesystem, destroying any data already present
-    //set aside ten percent of the blocks for inodes, clears the inode table, and writes the super block
-    //returns one on success, zero otherwise
-    if(mountedOrNah == 1){
-        printf("File system cannot format an already-mounted disk. Format failed!\n");
-        return 0;
-    }
+//one piece of a byte range, resolved by fs_map to the block that holds it
+struct fs_mapping {
+    int blocknum; //physical block, zero if nothing is allocated there
+    int offset;   //offset of the piece within the block
+    int length;   //length of the piece
+    int fresh;    //block was allocated by this fs_map call and holds no file data yet
+};
+
+#define FS_MAP_BATCH 64 //mappings resolved per fs_map call
+#define FS_INODE_BATCH 1024 //inodes fs_create_batch or fs_delete_batch handles per journal transaction
+#define FS_ZERO_DEPTH 16 //zeroing writes fs_format keeps in flight
+#define FS_INODE_LOCKS 1024 //inode locks of a mounted filesystem, however many inodes it has
+
+#define FS_READAHEAD_MIN 8   //blocks prefetched once reads of an inode turn out to be sequential
+#define FS_READAHEAD_MAX 256 //the window doubles with each further sequential read up to this many blocks
+#define FS_STREAMS       64  //inodes whose access pattern is followed at once; one hashing to an entry in use takes it over
+
+//what fs_read and fs_write have seen of the way one inode is being accessed
+//readers share the inode lock, and inodes hashing to the same entry share it too, so the fields are read and
+//written atomically; they are only hints
+struct fs_stream {
+    int inumber; //inode the entry is following, zero when it follows none
+    int next;   //byte offset just past the last read or write
+    int window; //readahead window in blocks, zero until reads are sequential
+    int ahead;  //first block not prefetched yet
+};
+
+//a metadata block changed by the running transaction, which only reaches the disk once the transaction commits
+struct fs_journal_entry {
+    int blocknum;
+    int next; //next entry in the same hash bucket, -1 at the end
     union fs_block block;
-    disk_read(0, block.data);
-
-    int k, i, j;
-    numBlocks = block.super.nblocks;
-    iBlocks = block.super.ninodeblocks;
-    numNodes = block.super.ninodes;
-    //clear inode table
-    for(k = 1; k <= iBlocks; k += 1){
-        disk_read(k, block.data);
-        for(i = 0; i < INODES_PER_BLOCK; i += 1){ //go through each inode, clear map
-            if(block.inode[i].isvalid){ 
-                if(block.inode[i].indirect) {
-                    block.inode[i].indirect = 0;
-                }
-                for(j = 0; j < POINTERS_PER_INODE; j += 1){
-                    if(block.inode[i].direct[j]){
-                        block.inode[i].direct[j] = 0;
-                    }
-                }
-                block.inode[i].isvalid = 0;
+};
+
+//the journal of a mounted filesystem and the transaction being built in memory
+struct fs_journal {
+    int start;    //first block of the journal, the header
+    int nblocks;  //zero when the filesystem has no journal or is not mounted
+    int head;     //where the next transaction goes, counted from start
+    int sequence; //of the next transaction
+    int scan;     //as stored in the header
+
+    struct fs_journal_entry *entries; //blocks logged by the running transaction
+    int nentries;
+    int maxentries;
+    int buckets[FS_JOURNAL_BUCKETS]; //first entry for each hash of the block number, -1 if none
+    int *revoked; //metadata blocks freed by the running transaction
+    int nrevoked;
+    int maxrevoked;
+    struct bitmap *freeing; //blocks freed by the running transaction, still marked in use until it commits
+    int nfreeing;
+    long long opened; //milliseconds on the monotonic clock when the running transaction logged its first block
+
+    /*
+    Operations that change metadata (create, delete, write) join the running
+    transaction with fs_journal_begin before they take any inode lock and leave
+    it with fs_journal_end.  One of them commits it once it is old or large
+    enough: it sets committing, which keeps new operations out, waits for the
+    others in it to leave and writes it out.  The entries are read by fs_read
+    and fs_getsize as well and have a lock of their own.
+    */
+    int active; //operations in the running transaction
+    int committing;
+    pthread_mutex_t lock; //active and committing
+    pthread_cond_t changed;
+    pthread_rwlock_t entries_lock; //entries, buckets and revoked
+};
+
+//blocks set aside by fs_reserve for one write, handed out by fs_alloc_block
+struct fs_reservation {
+    int next;
+    int end;
+};
+
+//everything about one filesystem; each handle works on its own disk with its own allocator
+struct fs {
+    struct disk *disk;
+    int numBlocks; //number of blocks on disk_read
+    int iBlocks; //number of blocks allocated for inodes
+    int numNodes; //number of inodes
+    struct bitmap *free_map; //one bit per block, set when in use
+    int dirty_lo; //range of bitmap bits changed since the last fs_flush_bitmap
+    int dirty_hi;
+    int mountedOrNah;
+    struct fs_superblock super; //copy of the superblock of the mounted filesystem
+    struct fs_inode **inode_table; //write-through copy of each inode block, allocated and read in the first time it is needed
+    struct bitmap *inode_map; //one bit per inode, set when it is in use or its inode block has not been loaded yet
+    int inode_scan; //fs_create has seen every inode block below this one loaded
+    int ndirect; //direct pointers per inode in this format
+    int maxBlocks; //most data blocks one file can map in this format
+
+    /*
+    Locking: fs_create, fs_delete, fs_getsize, fs_read and fs_write may be called
+    from many threads at once.  Each inode has a reader/writer lock, held shared by
+    fs_read and fs_getsize and exclusive by fs_write and fs_delete; the locks come
+    from a fixed table, hashed by inumber, so inodes may share one and no call may
+    hold two at once.  The free map
+    needs no lock of its own (see bitmap.h); the mutexes below cover the shared
+    state around it.  fs_format, fs_mount, fs_unmount and fs_debug must not run
+    while any other call on the same filesystem is in progress.
+    */
+    pthread_rwlock_t *inode_locks; //FS_INODE_LOCKS of them, allocated at mount
+    int lockCount; //number of initialized entries in inode_locks
+    struct fs_stream streams[FS_STREAMS]; //access pattern of the inodes read or written lately, hashed by inumber
+    pthread_mutex_t inode_table_lock; //loading and writing back inode blocks
+    pthread_mutex_t bitmap_lock; //dirty_lo, dirty_hi and writing the on-disk bitmap
+    pthread_mutex_t create_lock; //one fs_create at a time, and inode_scan
+
+    struct fs_journal journal;
+
+    struct fs_stats stats; //per-operation counters, updated atomically
+};
+
+static const union fs_block fs_zero_block; //source for writing zeros
+
+//direct pointers in an inode of the given format version
+static int fs_direct_pointers( int version ) {
+    return version >= FS_VERSION_DINDIRECT ? FS_DINDIRECT : POINTERS_PER_INODE;
+}
+
+//most data blocks a file can map in the given format version
+static int fs_max_blocks( int version ) {
+    long long blocks = fs_direct_pointers(version) + POINTERS_PER_BLOCK;
+    if(version >= FS_VERSION_DINDIRECT) blocks += (long long)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+    return blocks < FS_MAX_FILE_BLOCKS ? blocks : FS_MAX_FILE_BLOCKS;
+}
+
+//pointer blocks (indirect, double-indirect and the blocks under it) needed to map the first n blocks of a file
+static int fs_pointer_blocks( struct fs *fs, int n ) {
+    int count = 0;
+    if(n > fs->ndirect) count += 1;
+    n -= fs->ndirect + POINTERS_PER_BLOCK;
+    if(n > 0) count += 1 + (n + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK;
+    return count;
+}
+
+//blocks a file has to allocate to write the bytes [offset, end) past its end: the data blocks plus the pointer blocks needed to map them
+//a write that starts past the end leaves a hole rather than allocating blocks for it, and holes inside the file are filled block by block
+//extent blocks are allocated on their own
+static int fs_blocks_needed( struct fs *fs, struct fs_inode *inode, int offset, int end ) {
+    int have = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int from = offset / DISK_BLOCK_SIZE > have ? offset / DISK_BLOCK_SIZE : have;
+    int want = (end + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    if(want > fs->maxBlocks) want = fs->maxBlocks;
+    if(want <= from) return 0;
+    return FS_IS_EXTENTS(inode) ? want - from : want - from + fs_pointer_blocks(fs, want) - fs_pointer_blocks(fs, from);
+}
+
+//copy out the running transaction's version of a block; returns zero if the transaction has not changed it
+static int fs_journal_copy( struct fs *fs, int blocknum, char *data ) {
+    struct fs_journal *j = &fs->journal;
+    int i;
+
+    if(!j->nblocks || !__atomic_load_n(&j->nentries, __ATOMIC_ACQUIRE)) return 0;
+    pthread_rwlock_rdlock(&j->entries_lock);
+    for(i = j->buckets[blocknum % FS_JOURNAL_BUCKETS]; i >= 0 && j->entries[i].blocknum != blocknum; i = j->entries[i].next);
+    if(i >= 0) memcpy(data, j->entries[i].block.data, DISK_BLOCK_SIZE);
+    pthread_rwlock_unlock(&j->entries_lock);
+    return i >= 0;
+}
+
+//get a metadata block for reading, in place if the disk backend can map it
+static const union fs_block *fs_get_block( struct fs *fs, int blocknum, union fs_block *buffer ) {
+    const char *data;
+    if(fs_journal_copy(fs, blocknum, buffer->data)) return buffer;
+    data = disk_block_ptr_r(fs->disk, blocknum);
+    if(data) return (const union fs_block *)data;
+    disk_read_r(fs->disk, blocknum, buffer->data);
+    return buffer;
+}
+
+//read a metadata block into a buffer of the caller's, to be changed and written back with fs_meta_write
+static void fs_meta_read( struct fs *fs, int blocknum, char *data ) {
+    if(!fs_journal_copy(fs, blocknum, data)) disk_read_r(fs->disk, blocknum, data);
+}
+
+static long long fs_milliseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+//write a metadata block: into the running transaction if the filesystem has a journal, straight to the disk if not
+static void fs_meta_write( struct fs *fs, int blocknum, const char *data ) {
+    struct fs_journal *j = &fs->journal;
+    struct fs_journal_entry *grown;
+    int i;
+
+    if(!j->nblocks) {
+        disk_write_r(fs->disk, blocknum, data);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&j->entries_lock);
+    for(i = j->buckets[blocknum % FS_JOURNAL_BUCKETS]; i >= 0 && j->entries[i].blocknum != blocknum; i = j->entries[i].next);
+    if(i < 0) {
+        if(j->nentries == j->maxentries) {
+            grown = realloc(j->entries, sizeof(*grown) * (j->maxentries ? j->maxentries * 2 : 64));
+            if(!grown) {
+                pthread_rwlock_unlock(&j->entries_lock);
+                printf("Unable to grow the running transaction, block %d is written in place\n", blocknum);
+                disk_write_r(fs->disk, blocknum, data);
+                return;
             }
+            j->entries = grown;
+            j->maxentries = j->maxentries ? j->maxentries * 2 : 64;
         }
-        disk_write(k, block.data);
+        if(!j->nentries) __atomic_store_n(&j->opened, fs_milliseconds(), __ATOMIC_RELAXED);
+        i = j->nentries;
+        j->entries[i].blocknum = blocknum;
+        j->entries[i].next = j->buckets[blocknum % FS_JOURNAL_BUCKETS];
+        j->buckets[blocknum % FS_JOURNAL_BUCKETS] = i;
+        __atomic_store_n(&j->nentries, i + 1, __ATOMIC_RELEASE);
     }
-    //free the rest of the data blocks
-    for(k = iBlocks + 1; k < numBlocks; k += 1){
-        disk_read(k, block.data);
-        memset(&block.data[0], 0, sizeof(block.data));
-        disk_write(k, block.data); 
+    memcpy(j->entries[i].block.data, data, DISK_BLOCK_SIZE);
+    pthread_rwlock_unlock(&j->entries_lock);
+}
+
+//check that inumber names a slot in the inode table of the mounted filesystem
+static int fs_check_inumber( struct fs *fs, int inumber ) {
+    if(!fs->mountedOrNah) {
+        printf("You must mount your file system first\n");
+        return 0;
     }
-    //creating a new superblock
-    struct fs_superblock newSuper;
-    newSuper.magic = FS_MAGIC;
-    newSuper.nblocks = disk_size();
-    int newInodeNum = newSuper.nblocks / 10 + 1;
-    if(newInodeNum < 1){
-        printf("ERROR: ninodeblocks cannot be less than 1!\n");
+    if(inumber < 1 || inumber >= INODES_PER_BLOCK * fs->iBlocks) {
+        printf("Your input number is invalid!\n");
         return 0;
     }
-    newSuper.ninodeblocks = newInodeNum;
-    newSuper.ninodes = INODES_PER_BLOCK;
-    block.super = newSuper;
-    //update block with new info
-    disk_write(0, block.data);
-    mountedOrNah = 0;
-
     return 1;
 }
 
-void fs_debug() {
-    union fs_block block;
-    disk_read(0,block.data);
+//the stream entry following an inode, or zero if its entry is following another one
+static struct fs_stream *fs_stream_find( struct fs *fs, int inumber ) {
+    struct fs_stream *stream = &fs->streams[inumber % FS_STREAMS];
+    return __atomic_load_n(&stream->inumber, __ATOMIC_RELAXED) == inumber ? stream : 0;
+}
 
-    if(block.super.magic != FS_MAGIC) {
-        printf("magic number is invalid\n");
-        exit(1);
-    }
-    
-    if(disk_size() != block.super.nblocks) {
-        printf("NOTE: your disk size is not the same as your input.  Your requested disk size will be updated if you run the 'format' command.\n");
+//the stream entry of an inode, taken over with an empty history if it was following another one
+static struct fs_stream *fs_stream_take( struct fs *fs, int inumber ) {
+    struct fs_stream *stream = &fs->streams[inumber % FS_STREAMS];
+    if(__atomic_exchange_n(&stream->inumber, inumber, __ATOMIC_RELAXED) != inumber) {
+        __atomic_store_n(&stream->next, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stream->window, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stream->ahead, 0, __ATOMIC_RELAXED);
     }
-    
-    //display super block info
-    printf("magic number is valid \n");
-    printf("superblock:\n");
-    printf("    %d blocks on disk\n",block.super.nblocks);
-    printf("    %d blocks for inodes\n",block.super.ninodeblocks);
-    printf("    %d inodes total\n",block.super.ninodes);
-    
-    numBlocks = block.super.nblocks;
-    iBlocks = block.super.ninodeblocks;
-    numNodes = block.super.ninodes;
-    
-    
-    int blockCount = 1;
-    double sizeRemaining;
-    int k,i,j;
-    for (k = 1; k <= iBlocks; k += 1) { //for each inode block
-        disk_read(k,block.data);
-        for (i = 0; i < INODES_PER_BLOCK; i += 1, blockCount += 1) { //for each inode in block
-            if(block.inode[i].isvalid) { //if it is valid print its contents
-                printf("inode %d:\n",blockCount - 1);
-                printf("    size: %d bytes\n", block.inode[i].size);
-                printf("    direct blocks: ");
-                for (j = 0; j < POINTERS_PER_INODE; j += 1) {
-                    if (block.inode[i].direct[j]) { //if there is a direct block, print it
-                        printf("%d ", block.inode[i].direct[j]);
-                    }
-                }
-                printf("\n");
-                //for indirect pointers
-                if(block.inode[i].size > POINTERS_PER_INODE*DISK_BLOCK_SIZE){
-                    sizeRemaining = block.inode[i].size - POINTERS_PER_INODE*DISK_BLOCK_SIZE;
-                    printf("    indirect block: %d\n",block.inode[i].indirect);
+    return stream;
+}
 
-                    disk_read(block.inode[i].indirect,block.data); //read in indirect data block
-                    printf("    indirect data blocks: ");
-                    //print all indirect blocks used
-                    for (j = 0; j < ceil(sizeRemaining/DISK_BLOCK_SIZE); j += 1){ 
-                        if(block.pointers[j]) printf("%d ", block.pointers[j]);
-                    }
-                    disk_read(k,block.data); //return to inode block to read from
-                    printf("\n");
-                }
-            }
-        }
+//forget what has been seen of an inode whose contents were replaced
+static void fs_stream_forget( struct fs *fs, int inumber ) {
+    struct fs_stream *stream = &fs->streams[inumber % FS_STREAMS];
+    __atomic_compare_exchange_n(&stream->inumber, &inumber, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
 
-    }
+//the lock of an inode, shared with the other inodes hashing to the same slot
+static pthread_rwlock_t *fs_inode_lock( struct fs *fs, int inumber ) {
+    return &fs->inode_locks[inumber % FS_INODE_LOCKS];
+}
 
+//whether inode block k has been read into the inode table yet
+static int fs_inode_loaded( struct fs *fs, int k ) {
+    return __atomic_load_n(&fs->inode_table[k], __ATOMIC_ACQUIRE) != 0;
 }
 
-int fs_mount() {
-    //Examine the disk for a filesystem. If one is present, read the superblock, build a free block bitmap, and prepare the filesystem for use
-    //return one on success, zero otherwise
+//return the cached copy of an inode, reading its inode block into the table the first time it is needed,
+//and making the free inodes in it available to fs_create
+static struct fs_inode *fs_inode_get( struct fs *fs, int inumber ) {
+    int k = inumber / INODES_PER_BLOCK, i;
     union fs_block block;
-    disk_read(0,block.data);
-    if(block.super.magic != FS_MAGIC){
-        printf("magic number is invalid\n");
-        exit(1);
-    }
-    free_list = malloc(sizeof(int) * block.super.nblocks); //create free list
-    
-    
-    numBlocks = block.super.nblocks;
-    free_size = block.super.nblocks;
-    int k, i, j;
-    double sizeRemaining;
-    for(i = 0; i < free_size; i += 1){ //initialize list to 0
-        free_list[i] = 0;
-    }
-    free_list[0] = 1; //save the super block
-    iBlocks = block.super.ninodeblocks;
-    numNodes = block.super.ninodes;
-    for(k = 1; k <= iBlocks; k += 1) {
-        free_list[k] = 1; //make sure to mark the inode blocks
-        disk_read(k, block.data);
-        for(i = 0; i < INODES_PER_BLOCK; i += 1){ 
-            if(block.inode[i].isvalid){
-                //use size to determine number of blocks to mark
-                for(j = 0; j < POINTERS_PER_INODE; j += 1){
-                    if(block.inode[i].direct[j]){ //mark all of the allocated blocks in map
-                        free_list[block.inode[i].direct[j]] = 1; 
-                    }
-                }
-                //if there are indirect blocks
-                if(block.inode[i].size > POINTERS_PER_INODE*DISK_BLOCK_SIZE){
-                    sizeRemaining = block.inode[i].size - POINTERS_PER_INODE*DISK_BLOCK_SIZE;
-                    printf("ran that piece of code\n");
-                    free_list[block.inode[i].direct[j]] = 1;
-                    disk_read(block.inode[i].indirect, block.data);
-                    //loop through number of used indirect blocks
-                    for(j = 0; j < ceil(sizeRemaining/DISK_BLOCK_SIZE); j += 1){
-                        free_list[block.pointers[j]] = 1;
-                    }
-                    disk_read(k, block.data);
-                }
+    struct fs_inode *inodes;
+
+    if(!fs_inode_loaded(fs, k)) {
+        pthread_mutex_lock(&fs->inode_table_lock);
+        if(!fs->inode_table[k]) {
+            inodes = malloc(sizeof(struct fs_inode) * INODES_PER_BLOCK);
+            if(!inodes) {
+                printf("Unable to allocate inode block %d of the inode table\n", k);
+                abort();
+            }
+            memcpy(inodes, fs_get_block(fs, k + 1, &block)->inode, sizeof(struct fs_inode) * INODES_PER_BLOCK);
+            for(i = k ? 0 : 1; i < INODES_PER_BLOCK; i += 1) { //inode 0 is never handed out
+                if(!inodes[i].isvalid) bitmap_clear(fs->inode_map, k * INODES_PER_BLOCK + i);
             }
+            __atomic_store_n(&fs->inode_table[k], inodes, __ATOMIC_RELEASE);
         }
+        pthread_mutex_unlock(&fs->inode_table_lock);
     }
-    mountedOrNah = 1; //we are now mounted! update that 
-    return 1;
+    return &fs->inode_table[k][inumber % INODES_PER_BLOCK];
 }
 
-int fs_create() {
-    //Create a new inode of zero length
-    //return the (positive) inumber on success, on failure return 0
-    
-    
-    union fs_block block;
-    disk_read(0,block.data);
-    if(block.super.magic != FS_MAGIC){
-        printf("magic number is invalid\n");
-        exit(1);
-    }
-    //get your super block variables
-    numBlocks = block.super.nblocks;
-    iBlocks = block.super.ninodeblocks;
-    numNodes = block.super.ninodes;
-    
-    //create a new Inode to be inputted
-    struct fs_inode newInode;
-    newInode.isvalid = 1;
-    newInode.size = 0;
-    
-    int i, k, blockCount = 0;
-    for(i = 0; i < POINTERS_PER_INODE; i += 1){ //initialize all new inode values to 0
-        newInode.direct[i] = 0;
+//release the inode table of the last mount
+static void fs_free_inode_table( struct fs *fs ) {
+    int k;
+    if(!fs->inode_table) return;
+    for(k = 0; k < fs->iBlocks; k += 1) free(fs->inode_table[k]);
+    free(fs->inode_table);
+    fs->inode_table = 0;
+}
+
+//write the inode block holding a changed inode straight from the cache
+//the block is shared with other inodes, so writes are serialized to keep an older copy from landing last
+static void fs_inode_put( struct fs *fs, int inumber ) {
+    int k = inumber / INODES_PER_BLOCK;
+    pthread_mutex_lock(&fs->inode_table_lock);
+    fs_meta_write(fs, k + 1, (const char *)fs->inode_table[k]);
+    pthread_mutex_unlock(&fs->inode_table_lock);
+}
+
+//note that bits [start, start+n) of the free map have to be written back
+static void fs_bitmap_dirty( struct fs *fs, int start, int n ) {
+    if(n <= 0) return;
+    pthread_mutex_lock(&fs->bitmap_lock);
+    if(fs->dirty_hi < fs->dirty_lo) {
+        fs->dirty_lo = start;
+        fs->dirty_hi = start + n - 1;
+    } else {
+        if(start < fs->dirty_lo) fs->dirty_lo = start;
+        if(start + n - 1 > fs->dirty_hi) fs->dirty_hi = start + n - 1;
     }
-    newInode.indirect = 0;
-    
-    for(k = 1; k <= iBlocks; k+=1){ //for each inode block
-        disk_read(k, block.data);        
-        if(k != 1){ //if it is not the first block, don't skip the zero index
-            for(i = 0; i < INODES_PER_BLOCK; i += 1){
-                if(!block.inode[i].isvalid) { //locate the first available inode             
-                    block.inode[i] = newInode;
-                    disk_write(k, block.data);
-                    return i + 0 + INODES_PER_BLOCK * blockCount;
-                }
-            }
-        } else { //this is the first inode block, so inode[0] is not used (inode cannot be 0)
-            for(i = 1; i < INODES_PER_BLOCK; i += 1){
-                if(!block.inode[i].isvalid) { //locate the first available inode      
-                    block.inode[i] = newInode;
-                    disk_write(k, block.data);
-                    return i + 0 + INODES_PER_BLOCK * blockCount;
-                }
+    pthread_mutex_unlock(&fs->bitmap_lock);
+}
+
+//write the bitmap blocks covering bits [lo, hi] to the on-disk bitmap
+//blocks the running transaction has freed are written as free, though no one can have them until it commits
+static void fs_write_bitmap( struct fs *fs, int lo, int hi ) {
+    union fs_block block;
+    int k, i, words;
+
+    for(k = lo / BITS_PER_BLOCK; k <= hi / BITS_PER_BLOCK && k < fs->super.nbitmapblocks; k += 1) {
+        memset(block.data, 0, sizeof(block.data));
+        words = fs->free_map->nwords - k * WORDS_PER_BLOCK;
+        if(words > WORDS_PER_BLOCK) words = WORDS_PER_BLOCK;
+        memcpy(block.data, &fs->free_map->words[k * WORDS_PER_BLOCK], words * sizeof(uint64_t));
+        if(fs->journal.nblocks && __atomic_load_n(&fs->journal.nfreeing, __ATOMIC_RELAXED)) {
+            for(i = 0; i < words; i += 1) {
+                block.words[i] &= ~__atomic_load_n(&fs->journal.freeing->words[k * WORDS_PER_BLOCK + i], __ATOMIC_RELAXED);
             }
         }
-        blockCount++; //blockount keeps a running number of what block you are in
-                      //it does not get reset when you enter a new inode block
+        fs_meta_write(fs, fs->super.bitmapstart + k, block.data);
     }
-    
-    //exiting loop means it couldn't find an open inode
-    printf("Unable to create new inode, there are no spaces available.\n");
-    return 0;
 }
 
-int fs_delete( int inumber ) {
-    //Delete the inode indicated by the inumber. Release all data and indirect blocks assigned to this inode, returning them to the free block map
-    //on success return 1, on failure return 0
-    
-    //check to see if mounted
-    if(!mountedOrNah) {
-        printf("You must mount your file system first\n");
-        return 0;
-    }
-    
-    
-    union fs_block block;
-    disk_read(0, block.data);
-    if(inumber < 1 || inumber > INODES_PER_BLOCK * block.super.ninodeblocks){ //ADD THE CASE THAT IT'S TOO HIGH
-        printf("Your input number is invalid!\n");
-        return 0;
+//bring the on-disk bitmap up to date with the changes made since the last flush
+//bits are always changed before they are marked dirty, so whatever a flush misses is left marked for the next one
+static void fs_flush_bitmap( struct fs *fs ) {
+    pthread_mutex_lock(&fs->bitmap_lock);
+    if(fs->super.version >= FS_VERSION_BITMAP && fs->dirty_hi >= fs->dirty_lo) {
+        fs_write_bitmap(fs, fs->dirty_lo, fs->dirty_hi);
     }
-    
-    //get your super block variables
-    numBlocks = block.super.nblocks;
-    iBlocks = block.super.ninodeblocks;
-    numNodes = block.super.ninodes;
-    disk_read((inumber / INODES_PER_BLOCK) + 1, block.data);
+    fs->dirty_lo = 0;
+    fs->dirty_hi = -1;
+    pthread_mutex_unlock(&fs->bitmap_lock);
+}
 
-    
-    //declare other variables
-    int inodeIndex = (inumber % INODES_PER_BLOCK);
-    int j;
-    double sizeRemaining;
+//reserve a contiguous run for the blocks a write is about to allocate, so its data lands sequentially
+//when no free run is long enough the longest one is taken, and the rest of the write allocates block by block
+static void fs_reserve( struct fs *fs, struct fs_reservation *reserve, int n ) {
+    int start, count;
+    if(n <= 1) return;
+    start = bitmap_alloc_extent(fs->free_map, n, &count);
+    if(start < 0) return;
+    reserve->next = start;
+    reserve->end = start + count;
+    fs_bitmap_dirty(fs, start, count);
+}
+
+//hand back whatever the current write did not use
+static void fs_unreserve( struct fs *fs, struct fs_reservation *reserve ) {
+    bitmap_free_run(fs->free_map, reserve->next, reserve->end - reserve->next);
+    fs_bitmap_dirty(fs, reserve->next, reserve->end - reserve->next);
+    reserve->next = reserve->end = 0;
+}
+
+//allocate one block, from the reservation if there is one; returns 0 when the disk is full
+static int fs_alloc_block( struct fs *fs, struct fs_reservation *reserve ) {
+    int blocknum;
+    if(reserve->next < reserve->end) return reserve->next++;
+    blocknum = bitmap_alloc(fs->free_map);
+    if(blocknum < 0) return 0;
+    fs_bitmap_dirty(fs, blocknum, 1);
+    return blocknum;
+}
+
+//return a block to the free map
+static void fs_free_block( struct fs *fs, int blocknum ) {
+    if(!blocknum) return; //zero means the pointer was never allocated
+    bitmap_clear(fs->free_map, blocknum);
+    fs_bitmap_dirty(fs, blocknum, 1);
+}
+
+//free n blocks from start that the committed state of a file may still point at
+//with a journal they stay in use until the transaction freeing them commits, so nothing is written over them
+//while a crash could still bring the file back; meta marks blocks that held metadata, which are revoked
+static void fs_release_run( struct fs *fs, int start, int n, int meta ) {
+    struct fs_journal *j = &fs->journal;
+    int *grown, k;
 
-    //free the direct blocks
-    for(j = 0; j < POINTERS_PER_INODE; j += 1){
-        free_list[block.inode[inodeIndex].direct[j]] = 0;
+    if(!start || n <= 0) return; //zero means the pointer was never allocated
+    if(!j->nblocks) {
+        bitmap_free_run(fs->free_map, start, n);
+        fs_bitmap_dirty(fs, start, n);
+        return;
     }
 
-    //check to see if indirect blocks were used
-    if(block.inode[inodeIndex].size > POINTERS_PER_INODE*DISK_BLOCK_SIZE){
-        //free the indirect block
-        free_list[block.inode[inodeIndex].indirect] = 0;
-        //free the blocks pointed to by indirect block
-        sizeRemaining = block.inode[inodeIndex].size - POINTERS_PER_INODE*DISK_BLOCK_SIZE;
-        disk_read(block.inode[inodeIndex].indirect, block.data);
-        for(j = 0; j < ceil(sizeRemaining/DISK_BLOCK_SIZE); j += 1){
-            free_list[block.pointers[j]] = 0;
+    for(k = start; k < start + n; k += 1) bitmap_set(j->freeing, k);
+    __atomic_fetch_add(&j->nfreeing, n, __ATOMIC_RELAXED);
+    if(meta) {
+        pthread_rwlock_wrlock(&j->entries_lock);
+        if(j->nrevoked + n > j->maxrevoked) {
+            grown = realloc(j->revoked, sizeof(int) * (j->nrevoked + n + 64));
+            if(grown) {
+                j->revoked = grown;
+                j->maxrevoked = j->nrevoked + n + 64;
+            }
         }
+        for(k = start; k < start + n && j->nrevoked < j->maxrevoked; k += 1) j->revoked[j->nrevoked++] = k;
+        pthread_rwlock_unlock(&j->entries_lock);
+        if(k < start + n) printf("Unable to record freed metadata blocks in the journal\n");
     }
-    
-    //make the inode invalid and set size to zero
-    disk_read((inumber / INODES_PER_BLOCK) + 1, block.data);
-    block.inode[inodeIndex].indirect = 0;
-    block.inode[inodeIndex].isvalid = 0;
-    disk_write((inumber / INODES_PER_BLOCK) + 1, block.data);
-
-    return 1;
+    fs_bitmap_dirty(fs, start, n);
 }
 
-int fs_getsize( int inumber ) {
-    //return the logical size of the given inode in bytes. Note that zero is a valid logical size for an inode
-    //on failure, return -1
-    union fs_block block;
-    disk_read(0, block.data);
-    if(inumber < 1 || inumber > INODES_PER_BLOCK * block.super.ninodeblocks){
-        printf("Your input number is invalid!\n");
-        return -1;
+//release the blocks of n block pointers, a run at a time where they are consecutive
+static void fs_release_pointers( struct fs *fs, const int *pointers, int n, int meta ) {
+    int i, run;
+    for(i = 0; i < n; i += run) {
+        for(run = 1; pointers[i] && i + run < n && pointers[i + run] == pointers[i] + run; run += 1);
+        if(pointers[i]) fs_release_run(fs, pointers[i], run, meta); //zero is a hole
     }
-    
-    //get your super block variables
-    numBlocks = block.super.nblocks;
-    iBlocks = block.super.ninodeblocks;
-    numNodes = block.super.ninodes;
-    
-    //read the correct inode block
-    disk_read((inumber / INODES_PER_BLOCK) + 1, block.data);
-    return block.inode[(inumber % INODES_PER_BLOCK)].size;
 }
 
-int fs_read( int inumber, char *data, int length, int offset ) {
-    //Read data from a valid inode. Copy "length" bytes from the inode into the "data" pointer starting at "offset" bytes
-    //Allocate any necessary direct and indirect blocks in the process. Return the number of bytes actually written
-    //The number of bytes actually written could be smaller than the number of bytes requested, perhaps if the disk becomes full
-    //If the given number is invalid, or any other error is encoutnered, return 0
-    //check to see if mounted
-    if(!mountedOrNah) {
-        printf("You must mount your file system first\n");
-        return 0;
-    }
-    
+//checksum of n bytes, a multiple of eight, continuing from sum
+static uint64_t fs_checksum( uint64_t sum, const void *data, size_t n ) {
+    const uint64_t *words = data;
+    size_t i;
+    for(i = 0; i < n / sizeof(uint64_t); i += 1) sum = (sum ^ words[i]) * 0x100000001b3ULL;
+    return sum;
+}
+
+static unsigned fs_checksum_fold( uint64_t sum ) {
+    return (unsigned)(sum ^ (sum >> 32));
+}
+
+//rewrite the journal header from the in-memory state, straight to the image
+static void fs_journal_write_header( struct fs *fs ) {
     union fs_block block;
-    disk_read(0, block.data);
-    if(inumber < 1 || inumber > INODES_PER_BLOCK * block.super.ninodeblocks){ //ADD THE CASE THAT IT'S TOO HIGH
-        printf("Your input number is invalid!\n");
-        return -1;
-    }
+    const char *data = block.data;
+    memset(block.data, 0, sizeof(block.data));
+    block.journal.magic = FS_JOURNAL_MAGIC;
+    block.journal.sequence = fs->journal.sequence;
+    block.journal.scan = fs->journal.scan;
+    disk_writev_r(fs->disk, &fs->journal.start, &data, 1);
+}
 
-    //declare variables
-    int j,i, amountRead = 0, position = offset;
-    int inodeSize;
-    int inodeBlockToReadFrom = (inumber / INODES_PER_BLOCK) + 1;
-    int numInodePointers;
-    int inodeIndex = (inumber % INODES_PER_BLOCK) - 0;
+//make everything committed so far durable in place and start the log over
+static void fs_journal_checkpoint( struct fs *fs ) {
+    disk_sync_r(fs->disk);
+    disk_barrier_r(fs->disk);
+    fs->journal.head = 1;
+    fs_journal_write_header(fs); //from here on the old transactions no longer replay
+}
 
-    //get your super block variables
-    numBlocks = block.super.nblocks;
-    iBlocks = block.super.ninodeblocks;
-    numNodes = block.super.ninodes;
+//write the running transaction to the log and then to the blocks it changed, and give back the blocks it freed
+//called by the thread that set committing, once no operation is left in the transaction
+static void fs_journal_write( struct fs *fs ) {
+    struct fs_journal *j = &fs->journal;
+    int n = j->nentries, ndesc, i, k;
+    int *desc, *blocknums;
+    const char **data;
+    uint64_t sum;
 
-    disk_read(inodeBlockToReadFrom, block.data);
+    if(!n && !j->nrevoked && !j->nfreeing) return;
 
-    if(!block.inode[inodeIndex].isvalid) {
-        printf("You messed up fam, that inode isn't valid\n");
-        return 0;
-    }
+    ndesc = (FS_JOURNAL_HEADER_INTS + n + j->nrevoked + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK;
+    desc = calloc(ndesc, DISK_BLOCK_SIZE);
+    blocknums = malloc(sizeof(int) * (ndesc + n));
+    data = malloc(sizeof(char *) * (ndesc + n));
 
-    inodeSize = block.inode[inodeIndex].size;
-    numInodePointers = ceil((double)inodeSize / (double)DISK_BLOCK_SIZE); //calculate how many direct blocks are used
-    if (numInodePointers > POINTERS_PER_INODE) numInodePointers = POINTERS_PER_INODE; //max of 5 direct pointers
+    //file data goes out first, so committed metadata never points at blocks still waiting in the cache
+    disk_sync_r(fs->disk);
 
-    if(offset >= inodeSize) {
-        printf("The offset is greater than the inode size, there is nothing to read\n");
-        return 0;
-    }
+    if(!desc || !blocknums || !data || 1 + ndesc + n > j->nblocks) {
+        //too big for the log: written in place, with the header marked so a crash part way through means a rescan
+        j->scan = 1;
+        fs_journal_write_header(fs);
+        disk_barrier_r(fs->disk);
+        for(i = 0; i < n; i += 1) disk_write_r(fs->disk, j->entries[i].blocknum, j->entries[i].block.data);
+        j->scan = 0;
+        fs_journal_checkpoint(fs);
+    } else {
+        if(j->head + ndesc + n > j->nblocks) fs_journal_checkpoint(fs);
 
-    //read data from direct pointers
-    for (j = 0; j < numInodePointers; j += 1) {
-        disk_read(block.inode[inodeIndex].direct[j],block.data);
-        if((length+offset) < DISK_BLOCK_SIZE) { //if the read is less than one block
-            for (i = offset; i < offset+length; i += 1) { //write the one block and return the amount read
-                data[i-offset] = block.data[i];
-            }
-            amountRead = i-offset;
-            return amountRead;
-        } else {
-            //if the current offset amount is greater than the block size, skip block 
-            //and decrement position offset (position represents how much offset has already been accounted for)
-            if (position >= DISK_BLOCK_SIZE) {
-                position -= DISK_BLOCK_SIZE;
-                disk_read(inodeBlockToReadFrom, block.data);
-                continue;
-            }
-            //if there is less than one block worth left available to be read
-            if(inodeSize - (offset + amountRead) < DISK_BLOCK_SIZE) {
-                for (i = 0; i < inodeSize - (offset + amountRead); i += 1) {
-                    data[amountRead + i] = block.data[position + i]; //continue to update data
-                }
-                amountRead += i;
-                return amountRead;
-            }
-            //if there is less than one block worth requested to be read
-            if(amountRead + DISK_BLOCK_SIZE + position >= length) {
-                for (i = 0; i < length-amountRead; i += 1) { //read from 0 to how much is left to be read
-                    data[amountRead + i] = block.data[position + i];
-                }
-                amountRead += length-amountRead;
-                return amountRead;
-            } else { //should be able to do a full read of this block (-minus the offset as represented by position)
-                for (i = 0; i < DISK_BLOCK_SIZE-position; i += 1) { 
-                    data[amountRead + i] = block.data[i + position];
-                }
-                position = 0; //offset has been taken care of
-                amountRead += DISK_BLOCK_SIZE;
-            }
+        desc[0] = FS_JOURNAL_MAGIC;
+        desc[1] = j->sequence;
+        desc[2] = ndesc;
+        desc[3] = n;
+        desc[4] = j->nrevoked;
+        for(i = 0; i < n; i += 1) desc[FS_JOURNAL_HEADER_INTS + i] = j->entries[i].blocknum;
+        if(j->nrevoked) memcpy(&desc[FS_JOURNAL_HEADER_INTS + n], j->revoked, sizeof(int) * j->nrevoked);
+        sum = fs_checksum(0xcbf29ce484222325ULL, desc, (size_t)ndesc * DISK_BLOCK_SIZE);
+        for(i = 0; i < n; i += 1) sum = fs_checksum(sum, j->entries[i].block.data, DISK_BLOCK_SIZE);
+        ((struct fs_journal_descriptor *)desc)->checksum = fs_checksum_fold(sum);
 
+        //the whole transaction is one run of blocks in the log, and one barrier commits it
+        for(k = 0; k < ndesc + n; k += 1) {
+            blocknums[k] = j->start + j->head + k;
+            data[k] = k < ndesc ? (const char *)desc + (size_t)k * DISK_BLOCK_SIZE : j->entries[k - ndesc].block.data;
         }
-        //finished looping through block, read into inode block again to read next
-        disk_read(inodeBlockToReadFrom, block.data);
+        disk_writev_r(fs->disk, blocknums, data, ndesc + n);
+        disk_barrier_r(fs->disk);
+        j->head += ndesc + n;
+        j->sequence += 1;
+
+        //committed: the blocks go home through the cache, to be written back with everything else
+        for(i = 0; i < n; i += 1) disk_write_r(fs->disk, j->entries[i].blocknum, j->entries[i].block.data);
     }
+    free(desc);
+    free(blocknums);
+    free(data);
 
+    //the freed blocks can be handed out again now that no crash can bring back the files that had them
+    bitmap_clear_map(fs->free_map, j->freeing);
+    j->nfreeing = 0;
 
-    //finished direct pointer data, moving on to indirect
-    //calculate the number of indirect pointers used, based on size of inode
-    int numIndirectPointers = ceil((double)inodeSize / (double)DISK_BLOCK_SIZE) - numInodePointers;
-    if(numIndirectPointers == 0) { //if there aren's any used, we are done so return
-        return amountRead;
-    }
-    
-    disk_read(inodeBlockToReadFrom, block.data);
-    int indirectBlockLocation = block.inode[inodeIndex].indirect;
-    disk_read(indirectBlockLocation, block.data);
-    
-    for (j = 0; j < numIndirectPointers; j += 1) { //looping through indirect pointers
-        disk_read(block.pointers[j],block.data);
-        if (position >= DISK_BLOCK_SIZE) { //if the offset is still larger than the block 
-            position -= DISK_BLOCK_SIZE;
-            disk_read(indirectBlockLocation, block.data);
-            continue;
-        }
-        //if there is less than one block worth left available to be read
-        if(inodeSize - (offset + amountRead) <= DISK_BLOCK_SIZE) {
-            for (i = 0; i < inodeSize - (offset + amountRead); i += 1) {
-                data[amountRead + i] = block.data[position + i];
-            }
-            amountRead += i;
-            return amountRead;
-        }
-        //if there is less than one block worth requested to be read
-        if(amountRead + DISK_BLOCK_SIZE + position >= length) {
-            for (i = 0; i < length-amountRead; i += 1) {
-                data[amountRead + i] = block.data[position + i];
-            }
-            amountRead += length-amountRead;
-            //inodeSize -= length-amountRead;
-            return amountRead;
-        } else { //should be able to do a full read of this block (-minus the offset as represented by position)
-            for (i = 0; i < DISK_BLOCK_SIZE-position; i += 1) {
-                data[amountRead + i] = block.data[i + position];
-            }
-            position = 0;
-            amountRead += DISK_BLOCK_SIZE;
-        }
-        disk_read(indirectBlockLocation, block.data);
-    }
+    pthread_rwlock_wrlock(&j->entries_lock);
+    __atomic_store_n(&j->nentries, 0, __ATOMIC_RELEASE);
+    j->nrevoked = 0;
+    for(i = 0; i < FS_JOURNAL_BUCKETS; i += 1) j->buckets[i] = -1;
+    pthread_rwlock_unlock(&j->entries_lock);
+}
 
-    //should never reach here, return fail if you do
-    return 0;
+//commit the running transaction; called with j->lock held and committing clear
+static void fs_journal_commit_locked( struct fs *fs ) {
+    struct fs_journal *j = &fs->journal;
+    j->committing = 1;
+    while(j->active) pthread_cond_wait(&j->changed, &j->lock);
+    pthread_mutex_unlock(&j->lock);
+    fs_journal_write(fs);
+    pthread_mutex_lock(&j->lock);
+    j->committing = 0;
+    pthread_cond_broadcast(&j->changed);
 }
 
-int fs_write( int inumber, const char *data, int length, int offset ) {
-    
-    //check to see if mounted
-    if(!mountedOrNah) {
-        printf("You must mount your file system first\n");
-        return 0;
-    }
-    
-    union fs_block block;
-    disk_read(0, block.data);
-    //check validity of inumber
-    if(inumber < 1 || inumber > INODES_PER_BLOCK * block.super.ninodeblocks){ 
-        printf("Your input number is invalid!\n");
-        return -1;
+//join the running transaction, before taking any inode lock
+static void fs_journal_begin( struct fs *fs ) {
+    struct fs_journal *j = &fs->journal;
+    if(!j->nblocks) return;
+    pthread_mutex_lock(&j->lock);
+    while(j->committing) pthread_cond_wait(&j->changed, &j->lock);
+    //leave room in the log for what this operation adds
+    if(__atomic_load_n(&j->nentries, __ATOMIC_RELAXED) >= j->nblocks / 2) fs_journal_commit_locked(fs);
+    j->active += 1;
+    pthread_mutex_unlock(&j->lock);
+}
+
+//leave the running transaction, committing it if it has grown large or old enough
+//operations finishing close together end up in the same commit
+static void fs_journal_end( struct fs *fs ) {
+    struct fs_journal *j = &fs->journal;
+    int n;
+    if(!j->nblocks) return;
+    pthread_mutex_lock(&j->lock);
+    j->active -= 1;
+    n = __atomic_load_n(&j->nentries, __ATOMIC_RELAXED);
+    if(j->committing) {
+        if(!j->active) pthread_cond_broadcast(&j->changed);
+    } else if(n >= j->nblocks / 4 || (n && fs_milliseconds() - __atomic_load_n(&j->opened, __ATOMIC_RELAXED) >= FS_JOURNAL_INTERVAL)) {
+        fs_journal_commit_locked(fs);
     }
+    pthread_mutex_unlock(&j->lock);
+}
+
+//commit the running transaction now; the caller must not be in it
+static void fs_journal_commit( struct fs *fs ) {
+    struct fs_journal *j = &fs->journal;
+    if(!j->nblocks) return;
+    pthread_mutex_lock(&j->lock);
+    while(j->committing) pthread_cond_wait(&j->changed, &j->lock);
+    fs_journal_commit_locked(fs);
+    pthread_mutex_unlock(&j->lock);
+}
 
-    //declare variables
-    int j,i,k, amountWritten = 0, position = offset;
-    int inodeSize, dindex;
-    int inodeBlockToReadFrom = (inumber / INODES_PER_BLOCK) + 1;
-    int numDirectPointers;
-    int inodeIndex = (inumber % INODES_PER_BLOCK) - 0;
+//read the descriptor of the transaction at pos in the log and check it against its sequence number and checksum
+//returns the descriptor, in ndesc blocks of the caller's to free, or zero where the log ends
+static int *fs_journal_read_transaction( struct fs *fs, int pos, int sequence ) {
+    struct fs_journal *j = &fs->journal;
+    union fs_block block;
+    struct fs_journal_descriptor d;
+    int *desc, i, k, blocknum;
+    uint64_t sum;
+    unsigned stored;
 
-    //get superblock information
-    numBlocks = block.super.nblocks;
-    iBlocks = block.super.ninodeblocks;
-    numNodes = block.super.ninodes;
+    if(pos >= fs->super.njournalblocks) return 0;
+    disk_read_r(fs->disk, j->start + pos, block.data);
+    d = block.descriptor;
+    if(d.magic != FS_JOURNAL_MAGIC || d.sequence != sequence || d.ndescriptor < 1 || d.nlogged < 0 || d.nrevoked < 0) return 0;
+    if(d.ndescriptor != (FS_JOURNAL_HEADER_INTS + d.nlogged + d.nrevoked + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK) return 0;
+    if(pos + d.ndescriptor + d.nlogged > fs->super.njournalblocks) return 0;
 
-    //read from desired inode
-    disk_read(inodeBlockToReadFrom, block.data);
-    
-    //check inode validity
-    if(!block.inode[inodeIndex].isvalid) {
-        printf("you messed up fam, that inode isn't valid\n");
-        return 0;
+    desc = malloc((size_t)d.ndescriptor * DISK_BLOCK_SIZE);
+    if(!desc) return 0;
+    for(k = 0; k < d.ndescriptor; k += 1) disk_read_r(fs->disk, j->start + pos + k, (char *)desc + (size_t)k * DISK_BLOCK_SIZE);
+    stored = d.checksum;
+    ((struct fs_journal_descriptor *)desc)->checksum = 0;
+    sum = fs_checksum(0xcbf29ce484222325ULL, desc, (size_t)d.ndescriptor * DISK_BLOCK_SIZE);
+    ((struct fs_journal_descriptor *)desc)->checksum = stored;
+    for(i = 0; i < d.nlogged; i += 1) {
+        blocknum = desc[FS_JOURNAL_HEADER_INTS + i];
+        if(blocknum <= 0 || blocknum >= fs->numBlocks) break;
+        disk_read_r(fs->disk, j->start + pos + d.ndescriptor + i, block.data);
+        sum = fs_checksum(sum, block.data, DISK_BLOCK_SIZE);
     }
+    if(i < d.nlogged || fs_checksum_fold(sum) != stored) {
+        free(desc);
+        return 0; //torn: the transaction never committed
+    }
+    return desc;
+}
 
-    inodeSize = block.inode[inodeIndex].size;
-    numDirectPointers = ceil((double)inodeSize / (double)DISK_BLOCK_SIZE);
-    if (numDirectPointers > POINTERS_PER_INODE) numDirectPointers = POINTERS_PER_INODE; //cap off the numDirectPointers
-
-    if(!(offset > POINTERS_PER_INODE*DISK_BLOCK_SIZE)) { //if the offset is greating than the bytes in the direct blocks, skip
-        for (i = 0; i < POINTERS_PER_INODE; i += 1) {
-            if ((i + 1) > numDirectPointers){ //need to allocate a direct pointer
-                for (j = 0; j < free_size; j += 1) { //looping through the free list
-                    if(free_list[j] == 0) { //is it free or nah?
-                        //mark and write
-                        free_list[j] = 1;
-                        block.inode[inodeIndex].direct[i] = j;
-                        disk_write(inodeBlockToReadFrom,block.data);
-                        disk_read(inodeBlockToReadFrom,block.data);
+//bring the filesystem up to date with every transaction committed to the log since it last started over
+//a block is not replayed from a transaction when it was freed by that one or a later one, since it may be file data now
+//returns the number of transactions replayed
+static int fs_journal_replay( struct fs *fs ) {
+    struct fs_journal *j = &fs->journal;
+    union fs_block block;
+    const struct fs_journal_descriptor *d;
+    int *desc, *revokedBy = 0, pos, sequence, i, ntransactions = 0, blocknum;
+
+    //first pass: find where the log ends and which blocks were freed by which transaction
+    for(pos = 1, sequence = j->sequence; (desc = fs_journal_read_transaction(fs, pos, sequence)); sequence += 1) {
+        d = (const struct fs_journal_descriptor *)desc;
+        if(d->nrevoked && !revokedBy) revokedBy = calloc(fs->numBlocks, sizeof(int));
+        for(i = 0; i < d->nrevoked && revokedBy; i += 1) {
+            blocknum = desc[FS_JOURNAL_HEADER_INTS + d->nlogged + i];
+            if(blocknum > 0 && blocknum < fs->numBlocks) revokedBy[blocknum] = sequence;
+        }
+        pos += d->ndescriptor + d->nlogged;
+        ntransactions += 1;
+        free(desc);
+    }
+
+    //second pass: copy the logged blocks home, oldest transaction first
+    for(pos = 1, sequence = j->sequence; sequence < j->sequence + ntransactions; sequence += 1) {
+        desc = fs_journal_read_transaction(fs, pos, sequence);
+        if(!desc) break; //out of memory since the first pass
+        d = (const struct fs_journal_descriptor *)desc;
+        for(i = 0; i < d->nlogged; i += 1) {
+            blocknum = desc[FS_JOURNAL_HEADER_INTS + i];
+            if(revokedBy && revokedBy[blocknum] >= sequence) continue;
+            disk_read_r(fs->disk, j->start + pos + d->ndescriptor + i, block.data);
+            disk_write_r(fs->disk, blocknum, block.data);
+        }
+        pos += d->ndescriptor + d->nlogged;
+        free(desc);
+    }
+    free(revokedBy);
+
+    j->sequence += ntransactions;
+    if(ntransactions) fs_journal_checkpoint(fs);
+    return ntransactions;
+}
+
+//write zeros over n blocks starting at start, in batches of adjacent blocks
+//the batches are queued FS_ZERO_DEPTH at a time, falling back to one after another if no queue can be opened
+static void fs_zero_blocks( struct fs *fs, int start, int n ) {
+    int blocknums[DISK_MAX_RUN];
+    const char *buffers[DISK_MAX_RUN];
+    struct disk_queue *queue = disk_queue_open(fs->disk, FS_ZERO_DEPTH, DISK_ENGINE_AUTO);
+    struct disk_request *requests = queue ? malloc(sizeof(*requests) * ((n + DISK_MAX_RUN - 1) / DISK_MAX_RUN)) : 0;
+    int i, count, k = 0;
+
+    for(i = 0; i < DISK_MAX_RUN; i += 1) buffers[i] = fs_zero_block.data;
+
+    if(requests) {
+        for(; n > 0; start += count, n -= count, k += 1) {
+            count = n < DISK_MAX_RUN ? n : DISK_MAX_RUN;
+            memset(&requests[k], 0, sizeof(requests[k]));
+            requests[k].write = 1;
+            requests[k].blocknum = start;
+            requests[k].count = count;
+            requests[k].data = (char * const *)buffers;
+            disk_submit(queue, &requests[k]);
+        }
+        disk_queue_close(queue); //waits for the writes still in flight
+        free(requests);
+        return;
+    }
+    disk_queue_close(queue);
+
+    while(n > 0) {
+        count = n < DISK_MAX_RUN ? n : DISK_MAX_RUN;
+        for(i = 0; i < count; i += 1) blocknums[i] = start + i;
+        disk_writev_r(fs->disk, blocknums, buffers, count);
+        start += count;
+        n -= count;
+    }
+}
+
+//the entries of one level of an extent tree: level zero is in the inode, deeper levels are in path
+static struct fs_extent *fs_extent_node( struct fs_inode *inode, union fs_block *path, int level ) {
+    return level ? path[level].extents : ((struct fs_extent_inode *)inode)->extent;
+}
+
+//number of entries in use in a node of max entries
+static int fs_extent_count( const struct fs_extent *node, int max ) {
+    int n = 0;
+    while(n < max && node[n].length) n += 1;
+    return n;
+}
+
+//find the run holding file block 'logical' of an extent-mapped inode
+//sets *start to the physical block holding it, or zero in a hole, and returns the number of blocks left in the run or hole from there, zero past the end
+static int fs_extent_find( struct fs *fs, struct fs_inode *inode, int logical, int *start ) {
+    union fs_block block;
+    const struct fs_extent *node = ((struct fs_extent_inode *)inode)->extent;
+    int level, i, count = EXTENTS_PER_INODE;
+
+    for(level = 0; ; level += 1) {
+        for(i = 0; i < count && node[i].length && logical >= node[i].length; i += 1) {
+            logical -= node[i].length;
+        }
+        if(i == count || !node[i].length) return 0;
+        if(level == FS_EXTENT_DEPTH(inode)) {
+            *start = node[i].start ? node[i].start + logical : 0;
+            return node[i].length - logical;
+        }
+        node = fs_get_block(fs, node[i].start, &block)->extents;
+        count = EXTENTS_PER_BLOCK;
+    }
+}
+
+//add the run [start, start+length) to the end of an extent-mapped file, or a hole of length blocks when start is zero
+//the last extent grows instead when the run continues it or both are holes
+//extent blocks come straight from the free map rather than the write's reservation, so they do not split its data run
+//the changed extent blocks are written back; the caller writes back the inode
+//returns one, or zero if an extent block could not be allocated
+static int fs_extent_append( struct fs *fs, struct fs_inode *inode, int start, int length ) {
+    union fs_block path[FS_EXTENT_MAX_DEPTH + 1]; //rightmost block at each level below the inode
+    int pathNum[FS_EXTENT_MAX_DEPTH + 1];
+    int used[FS_EXTENT_MAX_DEPTH + 1];
+    int fresh[FS_EXTENT_MAX_DEPTH + 1];
+    struct fs_extent *node, *last, *root = ((struct fs_extent_inode *)inode)->extent;
+    struct fs_reservation none = {0, 0};
+    int depth = FS_EXTENT_DEPTH(inode), level, k, total;
+
+    //read the rightmost path from the inode down to the leaf
+    for(level = 0; level <= depth; level += 1) {
+        node = fs_extent_node(inode, path, level);
+        used[level] = fs_extent_count(node, level ? EXTENTS_PER_BLOCK : EXTENTS_PER_INODE);
+        if(level < depth) {
+            pathNum[level + 1] = node[used[level] - 1].start;
+            fs_meta_read(fs, pathNum[level + 1], path[level + 1].data);
+        }
+    }
+
+    node = fs_extent_node(inode, path, depth);
+    last = used[depth] ? &node[used[depth] - 1] : 0;
+    if(last && (start ? last->start && last->start + last->length == start : !last->start)) {
+        //the run carries on from the last extent, so only the counts along the path grow
+        level = depth + 1;
+    } else {
+        //a new extent goes in the deepest node on the path that has room
+        while(1) {
+            for(level = depth; level >= 0 && used[level] == (level ? EXTENTS_PER_BLOCK : EXTENTS_PER_INODE); level -= 1);
+            if(level >= 0) break;
+            //every node on the path is full: move the inode's extents into a new block one level down
+            if(depth == FS_EXTENT_MAX_DEPTH) return 0;
+            k = fs_alloc_block(fs, &none);
+            if(!k) return 0;
+            memmove(&path[2], &path[1], sizeof(path[0]) * depth);
+            memmove(&pathNum[2], &pathNum[1], sizeof(pathNum[0]) * depth);
+            memmove(&used[2], &used[1], sizeof(used[0]) * depth);
+            memset(path[1].data, 0, sizeof(path[1].data));
+            memcpy(path[1].extents, root, sizeof(struct fs_extent) * EXTENTS_PER_INODE);
+            pathNum[1] = k;
+            used[1] = EXTENTS_PER_INODE;
+            for(total = 0, k = 0; k < EXTENTS_PER_INODE; k += 1) total += root[k].length;
+            memset(root, 0, sizeof(struct fs_extent) * EXTENTS_PER_INODE);
+            root[0].start = pathNum[1];
+            root[0].length = total;
+            used[0] = 1;
+            depth += 1;
+            inode->isvalid = FS_INODE_EXTENTS + depth;
+        }
+        //below that node the path is replaced by new blocks holding one entry each
+        for(k = level + 1; k <= depth; k += 1) {
+            fresh[k] = fs_alloc_block(fs, &none);
+            if(!fresh[k]) {
+                while(--k > level) fs_free_block(fs, fresh[k]);
+                for(k = 1; k <= depth; k += 1) fs_meta_write(fs, pathNum[k], path[k].data); //in case the tree was just deepened
+                return 0;
+            }
+        }
+        for(k = level; k <= depth; k += 1) {
+            if(k > level) {
+                memset(path[k].data, 0, sizeof(path[k].data));
+                pathNum[k] = fresh[k];
+                used[k] = 0;
+            }
+            node = fs_extent_node(inode, path, k);
+            node[used[k]].start = k < depth ? fresh[k + 1] : start;
+            node[used[k]].length = length;
+            used[k] += 1;
+        }
+    }
+
+    //the levels above count the new blocks in their last entry
+    for(k = 0; k < level; k += 1) {
+        fs_extent_node(inode, path, k)[used[k] - 1].length += length;
+    }
+    for(k = 1; k <= depth; k += 1) {
+        fs_meta_write(fs, pathNum[k], path[k].data);
+    }
+    return 1;
+}
+
+//map the count blocks from file block 'logical', all in one hole of an extent-mapped file, to the new run at start
+//the hole's entry is replaced by the run and whatever is left of the hole on either side, so no length higher up changes;
+//a node that overflows is split in two, which can carry up to the inode and deepen the tree
+//the changed extent blocks are written back; the caller writes back the inode
+//returns one, or zero if an extent block could not be allocated
+static int fs_extent_fill( struct fs *fs, struct fs_inode *inode, int logical, int start, int count ) {
+    union fs_block path[FS_EXTENT_MAX_DEPTH + 1]; //the blocks from the inode down to the leaf holding the hole
+    union fs_block block;
+    int pathNum[FS_EXTENT_MAX_DEPTH + 1];
+    int index[FS_EXTENT_MAX_DEPTH + 1]; //entry followed at each level
+    int spare[FS_EXTENT_MAX_DEPTH + 1];
+    struct fs_extent pieces[EXTENTS_PER_BLOCK + 2], insert[3], *node, hole;
+    struct fs_reservation none = {0, 0};
+    int depth = FS_EXTENT_DEPTH(inode), level, i, n, ninsert, nspare, used, max, half, extra, merge = 0, k;
+
+    for(level = 0; ; level += 1) {
+        node = fs_extent_node(inode, path, level);
+        for(i = 0; logical >= node[i].length; i += 1) logical -= node[i].length;
+        index[level] = i;
+        if(level == depth) break;
+        pathNum[level + 1] = node[i].start;
+        fs_meta_read(fs, node[i].start, path[level + 1].data);
+    }
+
+    //what replaces the hole, with the run joined to a neighbour it continues
+    hole = node[i];
+    used = fs_extent_count(node, depth ? EXTENTS_PER_BLOCK : EXTENTS_PER_INODE);
+    ninsert = 0;
+    if(logical) insert[ninsert++] = (struct fs_extent){0, logical};
+    if(!logical && i > 0 && node[i - 1].start && node[i - 1].start + node[i - 1].length == start) {
+        merge = -1;
+    } else if(logical + count == hole.length && i + 1 < used && node[i + 1].start == start + count) {
+        merge = 1;
+    } else {
+        insert[ninsert++] = (struct fs_extent){start, count};
+    }
+    if(hole.length - logical - count) insert[ninsert++] = (struct fs_extent){0, hole.length - logical - count};
+
+    //every node that will overflow needs a new block, set aside before anything changes
+    for(extra = ninsert - 1, nspare = 0, level = depth; extra > 0 && level >= 0; level -= 1) {
+        max = level ? EXTENTS_PER_BLOCK : EXTENTS_PER_INODE;
+        if(fs_extent_count(fs_extent_node(inode, path, level), max) + extra <= max) break;
+        spare[nspare] = !level && depth == FS_EXTENT_MAX_DEPTH ? 0 : fs_alloc_block(fs, &none);
+        if(!spare[nspare]) {
+            while(nspare > 0) fs_free_block(fs, spare[--nspare]);
+            return 0;
+        }
+        nspare += 1;
+        extra = 1;
+    }
+
+    if(merge < 0) node[i - 1].length += count;
+    if(merge > 0) {
+        node[i + 1].start = start;
+        node[i + 1].length += count;
+    }
+
+    for(level = depth; ; level -= 1) {
+        node = fs_extent_node(inode, path, level);
+        max = level ? EXTENTS_PER_BLOCK : EXTENTS_PER_INODE;
+        used = fs_extent_count(node, max);
+        i = index[level];
+
+        //the node's entries with entry i replaced by the ones to insert
+        memcpy(pieces, node, sizeof(struct fs_extent) * i);
+        memcpy(pieces + i, insert, sizeof(struct fs_extent) * ninsert);
+        memcpy(pieces + i + ninsert, node + i + 1, sizeof(struct fs_extent) * (used - i - 1));
+        n = used - 1 + ninsert;
+
+        memset(node, 0, sizeof(struct fs_extent) * max);
+        if(n <= max) {
+            memcpy(node, pieces, sizeof(struct fs_extent) * n);
+            if(level) fs_meta_write(fs, pathNum[level], path[level].data);
+            break;
+        }
+
+        memset(block.data, 0, sizeof(block.data));
+        k = spare[--nspare];
+        if(!level) {
+            //the inode is full: its entries move into a new block one level down
+            memcpy(block.extents, pieces, sizeof(struct fs_extent) * n);
+            fs_meta_write(fs, k, block.data);
+            node[0].start = k;
+            for(i = 0; i < n; i += 1) node[0].length += pieces[i].length;
+            inode->isvalid = FS_INODE_EXTENTS + depth + 1;
+            break;
+        }
+
+        //split the node: the first half stays in its block, the rest goes to a new one, and the parent gets an entry for each
+        half = n / 2;
+        memcpy(node, pieces, sizeof(struct fs_extent) * half);
+        memcpy(block.extents, pieces + half, sizeof(struct fs_extent) * (n - half));
+        fs_meta_write(fs, pathNum[level], path[level].data);
+        fs_meta_write(fs, k, block.data);
+        insert[0] = (struct fs_extent){pathNum[level], 0};
+        insert[1] = (struct fs_extent){k, 0};
+        for(i = 0; i < n; i += 1) insert[i >= half].length += pieces[i].length;
+        ninsert = 2;
+    }
+    return 1;
+}
+
+//call visit on every run of data blocks of an extent tree (leaf set) and on every extent block (leaf clear)
+//an extent block is visited after everything under it, so visit may free it
+static void fs_extent_walk( struct fs *fs, const struct fs_extent *node, int count, int depth, void (*visit)( struct fs *fs, int start, int length, int leaf ) ) {
+    union fs_block block;
+    int i;
+
+    for(i = 0; i < count && node[i].length; i += 1) {
+        if(!depth) {
+            visit(fs, node[i].start, node[i].length, 1);
+            continue;
+        }
+        fs_extent_walk(fs, fs_get_block(fs, node[i].start, &block)->extents, EXTENTS_PER_BLOCK, depth - 1, visit);
+        visit(fs, node[i].start, 1, 0);
+    }
+}
+
+//fs_extent_walk visitors for deleting a file and fs_debug
+static void fs_free_extent( struct fs *fs, int start, int length, int leaf ) {
+    fs_release_run(fs, start, length, !leaf);
+}
+
+//cut the tree under a node of count entries down to its first keep file blocks, releasing the rest
+//entries past the cut are cleared and a child the cut goes through is written back; the caller writes back the node
+static void fs_extent_trim( struct fs *fs, struct fs_extent *node, int count, int depth, int keep ) {
+    union fs_block block;
+    int i, n = fs_extent_count(node, count);
+
+    for(i = 0; i < n; i += 1) {
+        if(keep >= node[i].length) {
+            keep -= node[i].length;
+        } else if(!keep) {
+            fs_extent_walk(fs, &node[i], 1, depth, fs_free_extent);
+            node[i].start = node[i].length = 0;
+        } else if(!depth) {
+            if(node[i].start) fs_release_run(fs, node[i].start + keep, node[i].length - keep, 0);
+            node[i].length = keep;
+            keep = 0;
+        } else {
+            fs_meta_read(fs, node[i].start, block.data);
+            fs_extent_trim(fs, block.extents, EXTENTS_PER_BLOCK, depth - 1, keep);
+            fs_meta_write(fs, node[i].start, block.data);
+            node[i].length = keep;
+            keep = 0;
+        }
+    }
+}
+
+static void fs_print_run( struct fs *fs, int start, int length, int leaf ) {
+    if(leaf && start) printf("%d-%d ", start, start + length - 1);
+    if(leaf && !start) printf("(hole of %d) ", length);
+}
+
+static void fs_print_extent_block( struct fs *fs, int start, int length, int leaf ) {
+    if(!leaf) printf("%d ", start);
+}
+
+static int fs_format_op( struct fs *fs, int mode ) {
+    //create a new filesystem, destroying any data already present
+    //set aside ten percent of the blocks for inodes, clears the inode table, writes the free block bitmap and the super block
+    //a sixteenth of the blocks, up to FS_JOURNAL_MAX, go to an empty journal after the bitmap
+    //data blocks are zeroed (FS_FORMAT_ZERO), deallocated in the image file (FS_FORMAT_DISCARD) or left alone (FS_FORMAT_FAST)
+    //with FS_FORMAT_EXTENTS added to the mode, files created later are extent-mapped
+    //returns one on success, zero otherwise
+    if(fs->mountedOrNah == 1){
+        printf("File system cannot format an already-mounted disk. Format failed!\n");
+        return 0;
+    }
+    union fs_block block;
+    int k;
+
+    //lay out the new filesystem: superblock, inode table, free block bitmap, journal, data
+    struct fs_superblock newSuper;
+    memset(&newSuper, 0, sizeof(newSuper));
+    newSuper.magic = FS_MAGIC;
+    if(mode & FS_FORMAT_EXTENTS) newSuper.flags = FS_FLAG_EXTENTS;
+    mode &= ~FS_FORMAT_EXTENTS;
+    newSuper.nblocks = disk_size_r(fs->disk);
+    int newInodeNum = newSuper.nblocks / 10 + 1;
+    if(newInodeNum < 1){
+        printf("ERROR: ninodeblocks cannot be less than 1!\n");
+        return 0;
+    }
+    newSuper.ninodeblocks = newInodeNum;
+    newSuper.ninodes = newInodeNum * INODES_PER_BLOCK;
+    newSuper.version = FS_VERSION;
+    newSuper.bitmapstart = newInodeNum + 1;
+    newSuper.nbitmapblocks = (newSuper.nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    newSuper.clean = 1;
+    newSuper.journalstart = newSuper.bitmapstart + newSuper.nbitmapblocks;
+    newSuper.njournalblocks = newSuper.nblocks / 16 < FS_JOURNAL_MAX ? newSuper.nblocks / 16 : FS_JOURNAL_MAX;
+    if(newSuper.njournalblocks < FS_JOURNAL_MIN) newSuper.njournalblocks = 0;
+    if(newSuper.journalstart + newSuper.njournalblocks >= newSuper.nblocks){
+        printf("ERROR: disk is too small to hold a filesystem!\n");
+        return 0;
+    }
+
+    fs->numBlocks = newSuper.nblocks;
+    fs->iBlocks = newSuper.ninodeblocks;
+    fs->numNodes = newSuper.ninodes;
+
+    //clear inode table, by deallocating it from the image when a zeroing write is not required
+    if(mode == FS_FORMAT_ZERO || !disk_discard_r(fs->disk, 1, fs->iBlocks)) {
+        fs_zero_blocks(fs, 1, fs->iBlocks);
+    }
+    //empty the journal, so nothing left in it from an earlier filesystem can be replayed
+    if(mode == FS_FORMAT_ZERO || !disk_discard_r(fs->disk, newSuper.journalstart, newSuper.njournalblocks)) {
+        fs_zero_blocks(fs, newSuper.journalstart, newSuper.njournalblocks);
+    }
+    //free the rest of the data blocks
+    //stale data is never visible through a file: new blocks are zeroed or fully written before they are read
+    k = newSuper.journalstart + newSuper.njournalblocks;
+    if(mode == FS_FORMAT_ZERO || (mode == FS_FORMAT_DISCARD && !disk_discard_r(fs->disk, k, fs->numBlocks - k))) {
+        fs_zero_blocks(fs, k, fs->numBlocks - k);
+    }
+    //write a bitmap with only the metadata blocks in use
+    fs->free_map = bitmap_create(fs->numBlocks);
+    if(!fs->free_map) {
+        printf("Unable to allocate the free block map\n");
+        return 0;
+    }
+    for(k = 0; k < newSuper.journalstart + newSuper.njournalblocks; k += 1){
+        bitmap_set(fs->free_map, k);
+    }
+    fs->super = newSuper;
+    fs_write_bitmap(fs, 0, fs->numBlocks - 1);
+    bitmap_delete(fs->free_map);
+    fs->free_map = 0;
+    if(newSuper.njournalblocks) {
+        fs->journal.start = newSuper.journalstart;
+        fs->journal.sequence = 1;
+        fs->journal.scan = 0;
+        fs_journal_write_header(fs);
+    }
+
+    //update block with new info
+    memset(block.data, 0, sizeof(block.data));
+    block.super = newSuper;
+    disk_write_r(fs->disk, 0, block.data);
+    fs->mountedOrNah = 0;
+
+    return 1;
+}
+
+void fs_debug_r( struct fs *fs ) {
+    union fs_block block, pointerBlock, outerBlock;
+    const union fs_block *iblock, *indirect, *outer;
+    const struct fs_extent *extents;
+    iblock = fs_get_block(fs, 0, &block);
+
+    if(iblock->super.magic != FS_MAGIC) {
+        printf("magic number is invalid\n");
+        exit(1);
+    }
+    
+    if(disk_size_r(fs->disk) != iblock->super.nblocks) {
+        printf("NOTE: your disk size is not the same as your input.  Your requested disk size will be updated if you run the 'format' command.\n");
+    }
+    
+    //display super block info
+    printf("magic number is valid \n");
+    printf("superblock:\n");
+    printf("    %d blocks on disk\n",iblock->super.nblocks);
+    printf("    %d blocks for inodes\n",iblock->super.ninodeblocks);
+    printf("    %d inodes total\n",iblock->super.ninodes);
+    if(iblock->super.version >= FS_VERSION_BITMAP) {
+        printf("    %d blocks for the free block bitmap, starting at block %d\n",iblock->super.nbitmapblocks,iblock->super.bitmapstart);
+        printf("    %s\n",iblock->super.clean ? "clean" : "not cleanly unmounted");
+    }
+    if(iblock->super.version >= FS_VERSION_EXTENTS && iblock->super.flags & FS_FLAG_EXTENTS) {
+        printf("    new files are extent-mapped\n");
+    }
+    if(iblock->super.version >= FS_VERSION_JOURNAL && iblock->super.njournalblocks) {
+        printf("    %d blocks for the journal, starting at block %d\n",iblock->super.njournalblocks,iblock->super.journalstart);
+    }
+    
+    fs->numBlocks = iblock->super.nblocks;
+    fs->iBlocks = iblock->super.ninodeblocks;
+    fs->numNodes = iblock->super.ninodes;
+    int ndirect = fs_direct_pointers(iblock->super.version);
+    
+    
+    int blockCount = 1;
+    int k,i,j,l,nblocks,entries,remaining;
+    for (k = 1; k <= fs->iBlocks; k += 1) { //for each inode block
+        iblock = fs_get_block(fs, k, &block);
+        for (i = 0; i < INODES_PER_BLOCK; i += 1, blockCount += 1) { //for each inode in block
+            if(iblock->inode[i].isvalid) { //if it is valid print its contents
+                printf("inode %d:\n",blockCount - 1);
+                printf("    size: %d bytes\n", iblock->inode[i].size);
+                if(FS_IS_EXTENTS(&iblock->inode[i])) {
+                    extents = ((const struct fs_extent_inode *)&iblock->inode[i])->extent;
+                    printf("    extents: ");
+                    fs_extent_walk(fs, extents, EXTENTS_PER_INODE, FS_EXTENT_DEPTH(&iblock->inode[i]), fs_print_run);
+                    printf("\n");
+                    if(FS_EXTENT_DEPTH(&iblock->inode[i])) {
+                        printf("    extent blocks: ");
+                        fs_extent_walk(fs, extents, EXTENTS_PER_INODE, FS_EXTENT_DEPTH(&iblock->inode[i]), fs_print_extent_block);
+                        printf("\n");
+                    }
+                    continue;
+                }
+                printf("    direct blocks: ");
+                for (j = 0; j < ndirect; j += 1) {
+                    if (iblock->inode[i].direct[j]) { //if there is a direct block, print it
+                        printf("%d ", iblock->inode[i].direct[j]);
+                    }
+                }
+                printf("\n");
+                //for indirect pointers
+                if(iblock->inode[i].size > ndirect*DISK_BLOCK_SIZE && iblock->inode[i].indirect){
+                    remaining = (iblock->inode[i].size - ndirect*DISK_BLOCK_SIZE + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+                    printf("    indirect block: %d\n",iblock->inode[i].indirect);
+
+                    indirect = fs_get_block(fs, iblock->inode[i].indirect, &pointerBlock); //read in indirect data block
+                    printf("    indirect data blocks: ");
+                    //print all indirect blocks used
+                    for (j = 0; j < remaining && j < POINTERS_PER_BLOCK; j += 1){
+                        if(indirect->pointers[j]) printf("%d ", indirect->pointers[j]);
+                    }
+                    printf("\n");
+                }
+                //for double-indirect pointers: one block of pointers to indirect blocks
+                nblocks = (iblock->inode[i].size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE - ndirect - POINTERS_PER_BLOCK;
+                if(ndirect < POINTERS_PER_INODE && nblocks > 0 && iblock->inode[i].direct[FS_DINDIRECT]){
+                    printf("    double indirect block: %d\n",iblock->inode[i].direct[FS_DINDIRECT]);
+                    outer = fs_get_block(fs, iblock->inode[i].direct[FS_DINDIRECT], &outerBlock);
+                    printf("    double indirect pointer blocks: ");
+                    for (j = 0; j * POINTERS_PER_BLOCK < nblocks; j += 1){
+                        if(outer->pointers[j]) printf("%d ", outer->pointers[j]);
+                    }
+                    printf("\n");
+                    printf("    double indirect data blocks: ");
+                    for (j = 0; j * POINTERS_PER_BLOCK < nblocks; j += 1){
+                        if(!outer->pointers[j]) continue;
+                        indirect = fs_get_block(fs, outer->pointers[j], &pointerBlock);
+                        entries = nblocks - j * POINTERS_PER_BLOCK < POINTERS_PER_BLOCK ? nblocks - j * POINTERS_PER_BLOCK : POINTERS_PER_BLOCK;
+                        for (l = 0; l < entries; l += 1){
+                            if(indirect->pointers[l]) printf("%d ", indirect->pointers[l]);
+                        }
+                    }
+                    printf("\n");
+                }
+            }
+        }
+
+    }
+
+}
+
+/*
+fs_dump writes out what fs_debug prints, with the block counts, fragmentation
+and free space summed up, as JSON or CSV for a script to read.  It works from
+the mounted filesystem as it is: the superblock, the cached inode table and
+the free block map are used in place, so besides the pointer and extent
+blocks of the files it only reads the inode blocks no call has needed yet,
+and those are not added to the table.  Numbers are formatted by hand into a
+buffer of its own, which goes out to the descriptor in large writes.
+
+A file's runs are its data blocks in file order with physically consecutive
+ones joined; its fragments are how many runs it has.  The histograms count
+fragments per file and the lengths of the runs of free blocks in power-of-two
+buckets, each given as the smallest and largest value it holds.
+*/
+
+#define FS_DUMP_BUFFER  65536
+#define FS_DUMP_BUCKETS 32 //power-of-two buckets, enough for any count that fits an int
+
+struct fs_dump {
+    struct fs *fs;
+    int fd;
+    int mode;
+    int failed;   //a write to fd failed, so the rest of the output is dropped
+    int used;
+    char buffer[FS_DUMP_BUFFER];
+
+    //the file being dumped
+    int *runs;    //start and length of each run in turn
+    int nruns;
+    int maxruns;
+    int *meta;    //its pointer or extent blocks
+    int nmeta;
+    int maxmeta;
+    long long blocks; //data blocks it maps
+};
+
+static void fs_dump_flush( struct fs_dump *d ) {
+    int done = 0, n;
+    while(!d->failed && done < d->used) {
+        n = write(d->fd, d->buffer + done, d->used - done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) {
+            printf("Unable to write the dump: %s\n", strerror(errno));
+            d->failed = 1;
+        }
+        done += n;
+    }
+    d->used = 0;
+}
+
+static void fs_dump_str( struct fs_dump *d, const char *s ) {
+    while(*s) {
+        if(d->used == FS_DUMP_BUFFER) fs_dump_flush(d);
+        d->buffer[d->used++] = *s++;
+    }
+}
+
+static void fs_dump_int( struct fs_dump *d, long long value ) {
+    char digits[24];
+    int n = sizeof(digits) - 1;
+    unsigned long long v = value < 0 ? -(unsigned long long)value : value;
+
+    digits[n] = 0;
+    do {
+        digits[--n] = '0' + v % 10;
+        v /= 10;
+    } while(v);
+    if(value < 0) digits[--n] = '-';
+    fs_dump_str(d, &digits[n]);
+}
+
+//a JSON member or CSV field: the separator before it, then the name for JSON
+static void fs_dump_field( struct fs_dump *d, const char *name, int first ) {
+    if(!first) fs_dump_str(d, ",");
+    if(d->mode & FS_DUMP_CSV) return;
+    fs_dump_str(d, "\"");
+    fs_dump_str(d, name);
+    fs_dump_str(d, "\":");
+}
+
+static void fs_dump_number( struct fs_dump *d, const char *name, long long value, int first ) {
+    fs_dump_field(d, name, first);
+    fs_dump_int(d, value);
+}
+
+//append to one of the growing lists of the file being dumped; returns zero if it could not grow
+static int fs_dump_push( int **list, int *n, int *max, int value ) {
+    int *grown;
+    if(*n == *max) {
+        grown = realloc(*list, sizeof(int) * (*max ? *max * 2 : 256));
+        if(!grown) return 0;
+        *list = grown;
+        *max = *max ? *max * 2 : 256;
+    }
+    (*list)[(*n)++] = value;
+    return 1;
+}
+
+//note length data blocks of the file from physical block start on, joining them to the last run if they follow it
+static void fs_dump_run( struct fs_dump *d, int start, int length ) {
+    if(!start || length <= 0) return; //a hole
+    d->blocks += length;
+    if(d->nruns && d->runs[d->nruns - 2] + d->runs[d->nruns - 1] == start) {
+        d->runs[d->nruns - 1] += length;
+    } else if(!fs_dump_push(&d->runs, &d->nruns, &d->maxruns, start) || !fs_dump_push(&d->runs, &d->nruns, &d->maxruns, length)) {
+        d->nruns &= ~1;
+    }
+}
+
+//note a pointer or extent block of the file; returns zero if it lies outside the disk and must not be followed
+static int fs_dump_meta( struct fs_dump *d, int blocknum ) {
+    if(blocknum <= 0 || blocknum >= d->fs->numBlocks) return 0;
+    fs_dump_push(&d->meta, &d->nmeta, &d->maxmeta, blocknum);
+    return 1;
+}
+
+//collect the runs of a pointer-mapped file, as far as its size goes
+static void fs_dump_pointers( struct fs_dump *d, const struct fs_inode *inode ) {
+    struct fs *fs = d->fs;
+    union fs_block outerBlock, pointerBlock;
+    const union fs_block *outer, *indirect;
+    long long want = ((long long)inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE, index;
+    int j, l;
+
+    for(j = 0; j < fs->ndirect && j < want; j += 1) fs_dump_run(d, inode->direct[j], 1);
+    if(want > fs->ndirect && fs_dump_meta(d, inode->indirect)) {
+        indirect = fs_get_block(fs, inode->indirect, &pointerBlock);
+        for(j = 0; j < POINTERS_PER_BLOCK && fs->ndirect + j < want; j += 1) fs_dump_run(d, indirect->pointers[j], 1);
+    }
+    index = fs->ndirect + POINTERS_PER_BLOCK;
+    if(fs->ndirect < POINTERS_PER_INODE && want > index && fs_dump_meta(d, inode->direct[FS_DINDIRECT])) {
+        outer = fs_get_block(fs, inode->direct[FS_DINDIRECT], &outerBlock);
+        for(j = 0; j < POINTERS_PER_BLOCK && index + (long long)j * POINTERS_PER_BLOCK < want; j += 1) {
+            if(!outer->pointers[j] || !fs_dump_meta(d, outer->pointers[j])) continue;
+            indirect = fs_get_block(fs, outer->pointers[j], &pointerBlock);
+            for(l = 0; l < POINTERS_PER_BLOCK && index + (long long)j * POINTERS_PER_BLOCK + l < want; l += 1) {
+                fs_dump_run(d, indirect->pointers[l], 1);
+            }
+        }
+    }
+}
+
+//collect the runs of an extent-mapped file under a node of count entries
+static void fs_dump_extents( struct fs_dump *d, const struct fs_extent *node, int count, int depth ) {
+    union fs_block block;
+    int i;
+
+    for(i = 0; i < count && node[i].length > 0; i += 1) {
+        if(!depth) {
+            fs_dump_run(d, node[i].start, node[i].length);
+        } else if(fs_dump_meta(d, node[i].start)) {
+            fs_dump_extents(d, fs_get_block(d->fs, node[i].start, &block)->extents, EXTENTS_PER_BLOCK, depth - 1);
+        }
+    }
+}
+
+static void fs_dump_bucket( long long *histogram, long long value ) {
+    if(value > 0) histogram[63 - __builtin_clzll(value)] += 1;
+}
+
+//write the non-empty buckets of a histogram, named name in CSV
+static void fs_dump_histogram( struct fs_dump *d, const char *name, const long long *histogram ) {
+    int b, first = 1;
+
+    if(!(d->mode & FS_DUMP_CSV)) {
+        fs_dump_str(d, ",\"");
+        fs_dump_str(d, name);
+        fs_dump_str(d, "\":[");
+    }
+    for(b = 0; b < FS_DUMP_BUCKETS; b += 1) {
+        if(!histogram[b]) continue;
+        if(d->mode & FS_DUMP_CSV) {
+            fs_dump_str(d, "histogram,");
+            fs_dump_str(d, name);
+        } else {
+            fs_dump_str(d, first ? "{" : ",{");
+        }
+        fs_dump_number(d, "min", 1LL << b, !(d->mode & FS_DUMP_CSV));
+        fs_dump_number(d, "max", (2LL << b) - 1, 0);
+        fs_dump_number(d, "count", histogram[b], 0);
+        fs_dump_str(d, d->mode & FS_DUMP_CSV ? "\n" : "}");
+        first = 0;
+    }
+    if(!(d->mode & FS_DUMP_CSV)) fs_dump_str(d, "]");
+}
+
+static void fs_dump_super( struct fs_dump *d ) {
+    struct fs_superblock *super = &d->fs->super;
+    int csv = d->mode & FS_DUMP_CSV;
+
+    fs_dump_str(d, csv ? "record,blocks,inode_blocks,inodes,version,bitmap_start,bitmap_blocks,journal_start,journal_blocks,extents\nsuperblock," : "{\"superblock\":{");
+    fs_dump_number(d, "blocks", super->nblocks, 1);
+    fs_dump_number(d, "inode_blocks", super->ninodeblocks, 0);
+    fs_dump_number(d, "inodes", super->ninodes, 0);
+    fs_dump_number(d, "version", super->version, 0);
+    fs_dump_number(d, "bitmap_start", super->bitmapstart, 0);
+    fs_dump_number(d, "bitmap_blocks", super->nbitmapblocks, 0);
+    fs_dump_number(d, "journal_start", super->journalstart, 0);
+    fs_dump_number(d, "journal_blocks", super->njournalblocks, 0);
+    fs_dump_number(d, "extents", (super->flags & FS_FLAG_EXTENTS) != 0, 0);
+    fs_dump_str(d, csv ? "\n" : "}");
+}
+
+//write the record of one file from what was collected for it
+static void fs_dump_file( struct fs_dump *d, int inumber, const struct fs_inode *inode, int first ) {
+    int csv = d->mode & FS_DUMP_CSV, full = !(d->mode & FS_DUMP_SUMMARY), i;
+
+    if(csv) {
+        fs_dump_str(d, "file,");
+    } else {
+        fs_dump_str(d, first ? "{" : ",{");
+    }
+    fs_dump_number(d, "inode", inumber, 1);
+    fs_dump_number(d, "size", inode->size, 0);
+    fs_dump_field(d, "kind", 0);
+    fs_dump_str(d, FS_IS_EXTENTS(inode) ? (csv ? "extents" : "\"extents\"") : (csv ? "pointers" : "\"pointers\""));
+    fs_dump_number(d, "depth", FS_IS_EXTENTS(inode) ? FS_EXTENT_DEPTH(inode) : 0, 0);
+    fs_dump_number(d, "blocks", d->blocks, 0);
+    fs_dump_number(d, "meta_blocks", d->nmeta, 0);
+    fs_dump_number(d, "fragments", d->nruns / 2, 0);
+    if(full) {
+        //runs as [start,length] pairs in JSON and start:length words in CSV
+        fs_dump_field(d, "runs", 0);
+        fs_dump_str(d, csv ? "" : "[");
+        for(i = 0; i < d->nruns; i += 2) {
+            if(i) fs_dump_str(d, csv ? " " : ",");
+            fs_dump_str(d, csv ? "" : "[");
+            fs_dump_int(d, d->runs[i]);
+            fs_dump_str(d, csv ? ":" : ",");
+            fs_dump_int(d, d->runs[i + 1]);
+            fs_dump_str(d, csv ? "" : "]");
+        }
+        fs_dump_str(d, csv ? "" : "]");
+        fs_dump_field(d, "meta", 0);
+        fs_dump_str(d, csv ? "" : "[");
+        for(i = 0; i < d->nmeta; i += 1) {
+            if(i) fs_dump_str(d, csv ? " " : ",");
+            fs_dump_int(d, d->meta[i]);
+        }
+        fs_dump_str(d, csv ? "" : "]");
+    }
+    fs_dump_str(d, csv ? "\n" : "}");
+}
+
+int fs_dump_r( struct fs *fs, int fd, int mode ) {
+    //write the superblock, a record of every file and a summary with histograms of fragmentation and free space
+    //to fd, as JSON or with FS_DUMP_CSV as CSV; FS_DUMP_SUMMARY leaves out the runs and pointer blocks of each file
+    //return one on success, zero otherwise
+    struct fs_dump *d;
+    struct fs_inode inode;
+    union fs_block block;
+    long long fragments[FS_DUMP_BUCKETS], freeruns[FS_DUMP_BUCKETS];
+    long long files = 0, datablocks = 0, metablocks = 0, nfragments = 0, fragmented = 0, freeblocks = 0, nfree = 0, largest = 0, run = 0;
+    uint64_t word;
+    int i, b, ok, csv = mode & FS_DUMP_CSV;
+
+    if(!fs->mountedOrNah) {
+        printf("You must mount your file system first\n");
+        return 0;
+    }
+    d = calloc(1, sizeof(*d));
+    if(!d) {
+        printf("Unable to allocate the dump buffer\n");
+        return 0;
+    }
+    d->fs = fs;
+    d->fd = fd;
+    d->mode = mode;
+    memset(fragments, 0, sizeof(fragments));
+    memset(freeruns, 0, sizeof(freeruns));
+
+    fs_dump_super(d);
+    if(csv) {
+        fs_dump_str(d, mode & FS_DUMP_SUMMARY ? "record,inode,size,kind,depth,blocks,meta_blocks,fragments\n" : "record,inode,size,kind,depth,blocks,meta_blocks,fragments,runs,meta\n");
+    } else {
+        fs_dump_str(d, ",\"files\":[");
+    }
+    for(i = 1; i < INODES_PER_BLOCK * fs->iBlocks && !d->failed; i += 1) {
+        pthread_rwlock_rdlock(fs_inode_lock(fs, i));
+        if(fs_inode_loaded(fs, i / INODES_PER_BLOCK)) {
+            inode = *fs_inode_get(fs, i);
+        } else {
+            //an inode block no call has needed yet is read without adding it to the inode table
+            inode = fs_get_block(fs, i / INODES_PER_BLOCK + 1, &block)->inode[i % INODES_PER_BLOCK];
+        }
+        d->nruns = d->nmeta = 0;
+        d->blocks = 0;
+        if(FS_IS_EXTENTS(&inode) && FS_EXTENT_DEPTH(&inode) <= FS_EXTENT_MAX_DEPTH) {
+            fs_dump_extents(d, ((struct fs_extent_inode *)&inode)->extent, EXTENTS_PER_INODE, FS_EXTENT_DEPTH(&inode));
+        } else if(inode.isvalid) {
+            fs_dump_pointers(d, &inode);
+        }
+        pthread_rwlock_unlock(fs_inode_lock(fs, i));
+        if(!inode.isvalid) continue;
+
+        fs_dump_file(d, i, &inode, !files);
+        files += 1;
+        datablocks += d->blocks;
+        metablocks += d->nmeta;
+        nfragments += d->nruns / 2;
+        if(d->nruns > 2) fragmented += 1;
+        fs_dump_bucket(fragments, d->nruns / 2);
+    }
+    if(!csv) fs_dump_str(d, "]");
+
+    //runs of clear bits in the free map; the bits past the last block are always set
+    for(i = 0; i < fs->free_map->nwords; i += 1) {
+        word = __atomic_load_n(&fs->free_map->words[i], __ATOMIC_RELAXED);
+        if(word == ~0ULL && !run) continue;
+        for(b = 0; b < 64; b += 1) {
+            if(!word) {
+                run += 64 - b;
+                break;
+            }
+            if(!(word & 1)) {
+                run += 1;
+            } else if(run) {
+                fs_dump_bucket(freeruns, run);
+                freeblocks += run;
+                nfree += 1;
+                if(run > largest) largest = run;
+                run = 0;
+            }
+            word >>= 1;
+        }
+    }
+    if(run) {
+        fs_dump_bucket(freeruns, run);
+        freeblocks += run;
+        nfree += 1;
+        if(run > largest) largest = run;
+    }
+
+    fs_dump_str(d, csv ? "record,files,data_blocks,meta_blocks,fragments,fragmented_files,free_blocks,free_runs,largest_free_run\nsummary," : ",\"summary\":{");
+    fs_dump_number(d, "files", files, 1);
+    fs_dump_number(d, "data_blocks", datablocks, 0);
+    fs_dump_number(d, "meta_blocks", metablocks, 0);
+    fs_dump_number(d, "fragments", nfragments, 0);
+    fs_dump_number(d, "fragmented_files", fragmented, 0);
+    fs_dump_number(d, "free_blocks", freeblocks, 0);
+    fs_dump_number(d, "free_runs", nfree, 0);
+    fs_dump_number(d, "largest_free_run", largest, 0);
+    if(csv) fs_dump_str(d, "\nrecord,histogram,min,max,count\n");
+    fs_dump_histogram(d, "fragments_per_file", fragments);
+    fs_dump_histogram(d, "free_run_lengths", freeruns);
+    fs_dump_str(d, csv ? "" : "}}\n");
+    fs_dump_flush(d);
+
+    ok = !d->failed;
+    free(d->runs);
+    free(d->meta);
+    free(d);
+    return ok;
+}
+
+//release the inode locks of the last mount
+static void fs_free_locks( struct fs *fs ) {
+    int k;
+    for(k = 0; k < fs->lockCount; k += 1) {
+        pthread_rwlock_destroy(&fs->inode_locks[k]);
+    }
+    free(fs->inode_locks);
+    fs->inode_locks = 0;
+    fs->lockCount = 0;
+}
+
+/*
+fs_check and the rebuild of the free map on an unclean mount share one walk
+over every inode, split between threads a few inode blocks at a time.  Every
+block an inode refers to is claimed in a bitmap with an atomic test-and-set,
+so a block claimed twice is caught by whichever claim comes second.  The
+walk follows a file the way fs_map does, but checks each pointer before it
+is followed: one outside the data area is never read, and with the sizes
+trusted nothing past the end of a file is claimed.  Repairs are made by a
+second walk, done serially in inode order over just the inodes the first one
+found fault with, so the first claim of a shared block is the one that keeps
+it whichever thread happened to see it first.
+*/
+
+#define FS_CHECK_CHUNK 8        //inode blocks a thread takes at a time
+#define FS_CHECK_MAX_THREADS 16
+
+#define FS_CHECK_MOUNT 0 //claim everything an inode reaches, whatever its size says
+#define FS_CHECK_SCAN  1 //claim what each size allows, and count what is wrong
+#define FS_CHECK_FIND  2 //flag the inodes that refer to blocks claimed more than once
+#define FS_CHECK_FIX   3 //serially, drop bad references and every claim of a shared block after the first
+
+struct fs_check {
+    struct fs *fs;
+    int pass;
+    int datastart;          //first block a file may refer to
+    struct bitmap *claimed; //blocks referred to so far
+    struct bitmap *shared;  //blocks referred to more than once, or null not to look for them
+    struct bitmap *kept;    //shared blocks whose first claim FS_CHECK_FIX has passed
+    unsigned char *flagged; //one per inode, set when it has anything wrong with it
+    int nextblock;          //next inode block for a thread to take
+    struct fs_check_report report; //totals of the threads of a pass
+};
+
+//what the walk has found in one inode
+struct fs_check_inode {
+    struct fs_check_report *report; //the counts of the thread walking it
+    long long want; //file blocks its size covers
+    int stale;      //its size does not match what it maps
+    int bad;        //anything at all is wrong with it
+    int changed;    //FS_CHECK_FIX changed the inode itself
+};
+
+//first block past the superblock, inode table, bitmap and journal
+static int fs_data_start( struct fs *fs ) {
+    int start = 1 + fs->iBlocks;
+    if(fs->super.version >= FS_VERSION_BITMAP && fs->super.bitmapstart + fs->super.nbitmapblocks > start) {
+        start = fs->super.bitmapstart + fs->super.nbitmapblocks;
+    }
+    if(fs->super.journalstart + fs->super.njournalblocks > start) start = fs->super.journalstart + fs->super.njournalblocks;
+    return start;
+}
+
+//account for one reference of an inode to the blocks [start, start+n); returns zero if the reference has to go
+static int fs_check_claim( struct fs_check *c, struct fs_check_inode *ci, int start, int n ) {
+    int k;
+
+    if(start < c->datastart || start >= c->fs->numBlocks || n <= 0 || n > c->fs->numBlocks - start) {
+        ci->report->out_of_range += 1;
+        ci->bad = 1;
+        return 0;
+    }
+    if(c->pass == FS_CHECK_FIND) {
+        for(k = start; k < start + n; k += 1) {
+            if(bitmap_test(c->shared, k)) ci->bad = 1;
+        }
+        return 1;
+    }
+    if(c->pass == FS_CHECK_FIX) {
+        for(k = start; k < start + n; k += 1) {
+            if(bitmap_test(c->shared, k) && bitmap_test(c->kept, k)) return 0;
+        }
+        for(k = start; k < start + n; k += 1) {
+            if(bitmap_test(c->shared, k)) bitmap_set(c->kept, k);
+        }
+        return 1;
+    }
+    for(k = start; k < start + n; k += 1) {
+        if(bitmap_claim(c->claimed, k) || !c->shared) continue;
+        if(bitmap_claim(c->shared, k)) ci->report->duplicates += 1;
+        ci->bad = 1;
+    }
+    return 1;
+}
+
+//whether a reference starting at file block index lies past the size; only the mount rebuild keeps those
+static int fs_check_stale( struct fs_check *c, struct fs_check_inode *ci, long long index ) {
+    if(c->pass == FS_CHECK_MOUNT || index < ci->want) return 0;
+    ci->stale = ci->bad = 1;
+    return 1;
+}
+
+//check the pointer of a pointer-mapped inode to file block index, or with level set to the indirect (1) or
+//double-indirect (2) block mapping the file blocks from index on
+//returns one if FS_CHECK_FIX cleared the pointer; a pointer block it changed below that is written back
+static int fs_check_pointer( struct fs_check *c, struct fs_check_inode *ci, int *pointer, long long index, int level ) {
+    union fs_block block;
+    int j, changed = 0, span = level == 2 ? POINTERS_PER_BLOCK : 1;
+
+    if(!*pointer) return 0; //a hole
+    if(fs_check_stale(c, ci, index) || !fs_check_claim(c, ci, *pointer, 1)) {
+        if(c->pass != FS_CHECK_FIX) return 0;
+        *pointer = 0;
+        return 1;
+    }
+    if(!level) return 0;
+
+    fs_meta_read(c->fs, *pointer, block.data);
+    for(j = 0; j < POINTERS_PER_BLOCK; j += 1) {
+        changed |= fs_check_pointer(c, ci, &block.pointers[j], index + (long long)j * span, level - 1);
+    }
+    if(changed) fs_meta_write(c->fs, *pointer, block.data);
+    return 0;
+}
+
+//check a node of count entries of an extent tree, the first of them mapping file block index; returns the file blocks the node maps
+//FS_CHECK_FIX makes a bad run a hole, ends the node at a bad index entry or the end of the file, sets *changed
+//if it changed the node and writes back the blocks under it that it changed
+static long long fs_check_extents( struct fs_check *c, struct fs_check_inode *ci, struct fs_extent *node, int count, int depth, long long index, int *changed ) {
+    union fs_block block;
+    long long total = 0, covered;
+    int i, n = fs_extent_count(node, count), fix = c->pass == FS_CHECK_FIX, childChanged;
+
+    for(i = 0; i < n; i += 1) {
+        if(node[i].length < 0) {
+            ci->report->out_of_range += 1;
+            break;
+        }
+        if(fs_check_stale(c, ci, index + total)) break;
+        if(!depth) {
+            covered = node[i].length;
+            if(c->pass != FS_CHECK_MOUNT && index + total + covered > ci->want) {
+                //the run goes on past the end of the file
+                ci->stale = ci->bad = 1;
+                covered = ci->want - index - total;
+                if(fix) {
+                    node[i].length = covered;
+                    *changed = 1;
+                }
+            }
+            if(node[i].start && !fs_check_claim(c, ci, node[i].start, covered) && fix) {
+                node[i].start = 0;
+                *changed = 1;
+            }
+            total += node[i].length;
+            continue;
+        }
+
+        if(!fs_check_claim(c, ci, node[i].start, 1)) break;
+        fs_meta_read(c->fs, node[i].start, block.data);
+        childChanged = 0;
+        covered = fs_check_extents(c, ci, block.extents, EXTENTS_PER_BLOCK, depth - 1, index + total, &childChanged);
+        if(childChanged) fs_meta_write(c->fs, node[i].start, block.data);
+        if(covered != node[i].length) {
+            //the entry disagrees with the block it names about how much of the file is under it
+            ci->stale = ci->bad = 1;
+            if(fix && !covered) break;
+            if(fix) {
+                node[i].length = covered;
+                *changed = 1;
+            }
+        }
+        total += node[i].length;
+    }
+
+    if(i < n) {
+        ci->bad = 1;
+        if(fix) {
+            memset(&node[i], 0, sizeof(*node) * (n - i));
+            *changed = 1;
+        }
+    }
+    return total;
+}
+
+//check one inode: a copy of it in the threaded passes, the cached one in FS_CHECK_FIX
+static void fs_check_inode( struct fs_check *c, struct fs_check_inode *ci, struct fs_inode *inode ) {
+    struct fs *fs = c->fs;
+    struct fs_extent *root = ((struct fs_extent_inode *)inode)->extent;
+    long long covered, limit = (long long)fs->maxBlocks * DISK_BLOCK_SIZE;
+    int j, fix = c->pass == FS_CHECK_FIX;
+
+    if(inode->isvalid < 0 || inode->isvalid > FS_INODE_EXTENTS + FS_EXTENT_MAX_DEPTH || (FS_IS_EXTENTS(inode) && fs->super.version < FS_VERSION_EXTENTS)) {
+        ci->report->bad_inodes += 1;
+        ci->bad = 1;
+        if(fix) {
+            memset(inode, 0, sizeof(*inode));
+            ci->changed = 1;
+        }
+        return;
+    }
+    ci->report->inodes += 1;
+
+    if(inode->size < 0 || inode->size > limit) {
+        ci->stale = ci->bad = 1;
+        if(fix) {
+            inode->size = inode->size < 0 ? 0 : limit;
+            ci->changed = 1;
+        }
+    }
+    covered = inode->size < 0 ? 0 : inode->size > limit ? limit : inode->size;
+    ci->want = (covered + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+
+    if(!FS_IS_EXTENTS(inode)) {
+        for(j = 0; j < fs->ndirect; j += 1) {
+            ci->changed |= fs_check_pointer(c, ci, &inode->direct[j], j, 0);
+        }
+        ci->changed |= fs_check_pointer(c, ci, &inode->indirect, fs->ndirect, 1);
+        if(fs->ndirect < POINTERS_PER_INODE) {
+            ci->changed |= fs_check_pointer(c, ci, &inode->direct[FS_DINDIRECT], fs->ndirect + POINTERS_PER_BLOCK, 2);
+        }
+        return;
+    }
+
+    //an extent-mapped file records even its holes, so its tree has to cover exactly its size
+    covered = fs_check_extents(c, ci, root, EXTENTS_PER_INODE, FS_EXTENT_DEPTH(inode), 0, &ci->changed);
+    if(c->pass != FS_CHECK_MOUNT && covered < ci->want) {
+        ci->stale = ci->bad = 1;
+        if(fix) {
+            inode->size = covered * DISK_BLOCK_SIZE;
+            ci->changed = 1;
+        }
+    }
+    if(fix && !fs_extent_count(root, EXTENTS_PER_INODE) && FS_EXTENT_DEPTH(inode)) {
+        inode->isvalid = FS_INODE_EXTENTS; //an empty tree starts over at depth zero
+        ci->changed = 1;
+    }
+}
+
+//add the counts of one report to another that other threads may be adding to as well
+static void fs_check_add( struct fs_check_report *to, const struct fs_check_report *from ) {
+    __atomic_fetch_add(&to->inodes, from->inodes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&to->bad_inodes, from->bad_inodes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&to->out_of_range, from->out_of_range, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&to->duplicates, from->duplicates, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&to->bad_sizes, from->bad_sizes, __ATOMIC_RELAXED);
+}
+
+//one thread of a pass: take inode blocks until there are none left
+static void *fs_check_worker( void *arg ) {
+    struct fs_check *c = arg;
+    struct fs *fs = c->fs;
+    struct fs_check_report report;
+    struct fs_check_inode ci;
+    struct fs_inode inode;
+    union fs_block block;
+    const union fs_block *iblock;
+    int first, k, i;
+
+    memset(&report, 0, sizeof(report));
+    while((first = __atomic_fetch_add(&c->nextblock, FS_CHECK_CHUNK, __ATOMIC_RELAXED)) < fs->iBlocks) {
+        for(k = first; k < first + FS_CHECK_CHUNK && k < fs->iBlocks; k += 1) {
+            iblock = fs_get_block(fs, k + 1, &block);
+            for(i = 0; i < INODES_PER_BLOCK; i += 1) {
+                if(!iblock->inode[i].isvalid) continue;
+                inode = iblock->inode[i];
+                memset(&ci, 0, sizeof(ci));
+                ci.report = &report;
+                fs_check_inode(c, &ci, &inode);
+                if(ci.stale) report.bad_sizes += 1;
+                if(ci.bad && c->flagged) c->flagged[k * INODES_PER_BLOCK + i] = 1;
+            }
+        }
+    }
+    fs_check_add(&c->report, &report);
+    return 0;
+}
+
+//walk every inode on nthreads threads (zero for one per processor), adding what the pass finds to *report
+static void fs_check_pass( struct fs_check *c, int pass, int nthreads, struct fs_check_report *report ) {
+    pthread_t threads[FS_CHECK_MAX_THREADS];
+    int started;
+
+    if(nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads > FS_CHECK_MAX_THREADS) nthreads = FS_CHECK_MAX_THREADS;
+    if(nthreads > (c->fs->iBlocks + FS_CHECK_CHUNK - 1) / FS_CHECK_CHUNK) nthreads = (c->fs->iBlocks + FS_CHECK_CHUNK - 1) / FS_CHECK_CHUNK;
+
+    c->pass = pass;
+    c->nextblock = 0;
+    memset(&c->report, 0, sizeof(c->report));
+    //this thread is one of them
+    for(started = 0; started < nthreads - 1 && !pthread_create(&threads[started], 0, fs_check_worker, c); started += 1);
+    fs_check_worker(c);
+    while(started > 0) pthread_join(threads[--started], 0);
+    fs_check_add(report, &c->report);
+}
+
+//set the bits of the blocks before the data area, which no file refers to but are always in use
+static void fs_check_reserve( struct fs_check *c ) {
+    int k;
+    for(k = 0; k < c->datastart && k < c->fs->numBlocks; k += 1) bitmap_set(c->claimed, k);
+}
+
+//rebuild the free block map by walking every inode and the blocks they refer to
+//used for images without a bitmap and for ones that were not unmounted cleanly
+static void fs_scan_blocks( struct fs *fs ) {
+    struct fs_check c;
+    struct fs_check_report report;
+
+    memset(&c, 0, sizeof(c));
+    memset(&report, 0, sizeof(report));
+    c.fs = fs;
+    c.datastart = fs_data_start(fs);
+    c.claimed = fs->free_map;
+    fs_check_reserve(&c);
+    fs_check_pass(&c, FS_CHECK_MOUNT, 0, &report);
+}
+
+int fs_check_r( struct fs *fs, int flags, int nthreads, struct fs_check_report *report ) {
+    //check that every inode refers only to blocks in the data area, that no block is claimed twice, that sizes
+    //match what the inodes map and that the free block map agrees with all of it
+    //with FS_CHECK_REPAIR set, fix what is found and rebuild the free block map
+    //return one if nothing was wrong, zero otherwise
+    struct fs_check c;
+    struct fs_check_report scratch;
+    struct fs_check_inode ci;
+    struct fs_inode *inode;
+    uint64_t mask, *words;
+    int i, found;
+
+    memset(report, 0, sizeof(*report));
+    if(!fs->mountedOrNah) {
+        printf("You must mount your file system first\n");
+        return 0;
+    }
+    //commit the running transaction first, so what it frees is free in the map
+    fs_sync_r(fs);
+
+    memset(&c, 0, sizeof(c));
+    memset(&scratch, 0, sizeof(scratch));
+    c.fs = fs;
+    c.datastart = fs_data_start(fs);
+    c.claimed = bitmap_create(fs->numBlocks);
+    c.shared = bitmap_create(fs->numBlocks);
+    c.kept = bitmap_create(fs->numBlocks);
+    c.flagged = calloc(INODES_PER_BLOCK * fs->iBlocks, 1);
+    if(!c.claimed || !c.shared || !c.kept || !c.flagged) {
+        printf("Unable to allocate the maps for checking\n");
+        bitmap_delete(c.claimed);
+        bitmap_delete(c.shared);
+        bitmap_delete(c.kept);
+        free(c.flagged);
+        return 0;
+    }
+    fs_check_reserve(&c);
+    fs_check_pass(&c, FS_CHECK_SCAN, nthreads, report);
+    found = report->bad_inodes || report->out_of_range || report->duplicates || report->bad_sizes;
+
+    if(found && flags & FS_CHECK_REPAIR) {
+        //find every inode sharing a block, not just the ones that lost the race to claim it
+        if(report->duplicates) fs_check_pass(&c, FS_CHECK_FIND, nthreads, &scratch);
+        c.pass = FS_CHECK_FIX;
+        for(i = 0; i < INODES_PER_BLOCK * fs->iBlocks; i += 1) {
+            if(!c.flagged[i]) continue;
+            memset(&ci, 0, sizeof(ci));
+            ci.report = &scratch;
+            fs_journal_begin(fs);
+            inode = fs_inode_get(fs, i);
+            fs_check_inode(&c, &ci, inode);
+            if(ci.changed) fs_inode_put(fs, i);
+            if(!inode->isvalid) bitmap_clear(fs->inode_map, i);
+            fs_journal_end(fs);
+        }
+        report->repaired = 1;
+
+        //claim again what the repaired inodes refer to
+        memset(c.claimed->words, 0, sizeof(uint64_t) * c.claimed->nwords);
+        fs_check_reserve(&c);
+        fs_check_pass(&c, FS_CHECK_SCAN, nthreads, &scratch);
+    }
+
+    //compare the blocks claimed with the free map a word at a time, leaving out the bits past the last block
+    for(i = 0; i < c.claimed->nwords; i += 1) {
+        mask = ~0ULL;
+        if(i == c.claimed->nwords - 1 && fs->numBlocks % 64) mask = ~(~0ULL << (fs->numBlocks % 64));
+        report->leaked += __builtin_popcountll(fs->free_map->words[i] & ~c.claimed->words[i] & mask);
+        report->missing += __builtin_popcountll(c.claimed->words[i] & ~fs->free_map->words[i] & mask);
+        report->blocks += __builtin_popcountll(c.claimed->words[i] & mask);
+    }
+    if((report->leaked || report->missing) && flags & FS_CHECK_REPAIR) {
+        //the blocks claimed become the free map
+        words = fs->free_map->words;
+        fs->free_map->words = c.claimed->words;
+        c.claimed->words = words;
+        bitmap_recount(fs->free_map);
+        fs_bitmap_dirty(fs, 0, fs->numBlocks);
+        report->repaired = 1;
+    }
+    if(report->repaired) fs_sync_r(fs);
+
+    bitmap_delete(c.claimed);
+    bitmap_delete(c.shared);
+    bitmap_delete(c.kept);
+    free(c.flagged);
+    return !found && !report->leaked && !report->missing;
+}
+
+//load the free block map from the on-disk bitmap with a few sequential reads
+static void fs_load_bitmap( struct fs *fs ) {
+    union fs_block block;
+    const union fs_block *bblock;
+    int k, words;
+
+    for(k = 0; k < fs->super.nbitmapblocks; k += 1) {
+        bblock = fs_get_block(fs, fs->super.bitmapstart + k, &block);
+        words = fs->free_map->nwords - k * WORDS_PER_BLOCK;
+        if(words > WORDS_PER_BLOCK) words = WORDS_PER_BLOCK;
+        memcpy(&fs->free_map->words[k * WORDS_PER_BLOCK], bblock->data, words * sizeof(uint64_t));
+    }
+    bitmap_recount(fs->free_map);
+}
+
+//read the journal header and replay whatever the log holds; a header that cannot be read asks for a rescan
+//returns the number of transactions replayed
+static int fs_journal_open( struct fs *fs ) {
+    struct fs_journal *j = &fs->journal;
+    union fs_block block;
+    int i;
+
+    j->start = fs->super.journalstart;
+    j->head = 1;
+    j->nentries = j->nrevoked = j->nfreeing = 0;
+    for(i = 0; i < FS_JOURNAL_BUCKETS; i += 1) j->buckets[i] = -1;
+    bitmap_delete(j->freeing);
+    j->freeing = bitmap_create(fs->numBlocks);
+
+    disk_read_r(fs->disk, j->start, block.data);
+    if(block.journal.magic != FS_JOURNAL_MAGIC) {
+        printf("journal header is invalid\n");
+        j->sequence = 1;
+        j->scan = 1;
+        return 0;
+    }
+    j->sequence = block.journal.sequence;
+    j->scan = block.journal.scan;
+    return fs_journal_replay(fs);
+}
+
+static int fs_mount_op( struct fs *fs ) {
+    //Examine the disk for a filesystem. If one is present, read the superblock, load or build a free block bitmap, and prepare the filesystem for use
+    //return one on success, zero otherwise
+    union fs_block block;
+    int k, replayed = 0;
+    disk_read_r(fs->disk, 0, block.data);
+    if(block.super.magic != FS_MAGIC){
+        printf("magic number is invalid\n");
+        return 0;
+    }
+    if(fs->journal.nblocks) {
+        //mounted already: keep what the running transaction holds
+        fs_journal_commit(fs);
+        fs->journal.nblocks = 0;
+    }
+    fs_free_inode_table(fs); //sized by the inode blocks of the last mount
+    bitmap_delete(fs->free_map);
+    fs->free_map = bitmap_create(block.super.nblocks); //create free map
+    if(!fs->free_map) {
+        printf("Unable to allocate the free block map\n");
+        return 0;
+    }
+    
+    fs->super = block.super;
+    if(fs->super.version < FS_VERSION_EXTENTS) fs->super.flags = 0;
+    if(fs->super.version < FS_VERSION_JOURNAL) fs->super.journalstart = fs->super.njournalblocks = 0;
+    fs->ndirect = fs_direct_pointers(fs->super.version);
+    fs->maxBlocks = fs_max_blocks(fs->super.version);
+    fs->numBlocks = fs->super.nblocks;
+    fs->iBlocks = fs->super.ninodeblocks;
+    fs->numNodes = fs->super.ninodes;
+
+    bitmap_delete(fs->inode_map);
+    fs_free_locks(fs);
+    fs->inode_table = calloc(fs->iBlocks, sizeof(struct fs_inode *));
+    fs->inode_map = bitmap_create(INODES_PER_BLOCK * fs->iBlocks);
+    fs->inode_locks = malloc(sizeof(pthread_rwlock_t) * FS_INODE_LOCKS);
+    if(!fs->inode_table || !fs->inode_map || !fs->inode_locks) {
+        printf("Unable to allocate the inode table\n");
+        return 0;
+    }
+    //nothing is known to be free until its inode block is loaded
+    memset(fs->inode_map->words, 0xff, sizeof(uint64_t) * fs->inode_map->nwords);
+    bitmap_recount(fs->inode_map);
+    fs->inode_scan = 0;
+    memset(fs->streams, 0, sizeof(fs->streams));
+    for(k = 0; k < FS_INODE_LOCKS; k += 1) {
+        pthread_rwlock_init(&fs->inode_locks[k], 0);
+    }
+    fs->lockCount = FS_INODE_LOCKS;
+
+    //with a journal the metadata, the bitmap included, is whole again once the log has been replayed
+    if(fs->super.njournalblocks) {
+        replayed = fs_journal_open(fs);
+        if(!fs->journal.freeing) {
+            printf("Unable to allocate the free block map\n");
+            return 0;
+        }
+    }
+    if(fs->super.version >= FS_VERSION_BITMAP && (fs->super.clean || (fs->super.njournalblocks && !fs->journal.scan))) {
+        if(!fs->super.clean) {
+            printf("filesystem was not unmounted cleanly, replayed %d transactions from the journal\n", replayed);
+        }
+        fs_load_bitmap(fs);
+    } else {
+        if(fs->super.version >= FS_VERSION_BITMAP) {
+            printf("filesystem was not unmounted cleanly, rebuilding the free block bitmap\n");
+        }
+        fs_scan_blocks(fs);
+        if(fs->super.version >= FS_VERSION_BITMAP) fs_write_bitmap(fs, 0, fs->numBlocks - 1);
+        if(fs->super.njournalblocks) {
+            fs->journal.scan = 0;
+            fs_journal_checkpoint(fs);
+        }
+    }
+    fs->dirty_lo = 0;
+    fs->dirty_hi = -1;
+
+    //mark the filesystem in use until fs_unmount, so a crash forces a rescan
+    //the mark has to be on the image before anything else is, or a write-back from the cache could land
+    //there while block 0 still says clean and the next mount would trust a stale bitmap
+    if(fs->super.version >= FS_VERSION_BITMAP) {
+        fs->super.clean = 0;
+        block.super = fs->super;
+        disk_write_r(fs->disk, 0, block.data);
+        disk_sync_r(fs->disk);
+        disk_barrier_r(fs->disk);
+    }
+
+    fs->journal.nblocks = fs->super.njournalblocks; //metadata goes through the journal from here on
+    fs->mountedOrNah = 1; //we are now mounted! update that 
+    return 1;
+}
+
+int fs_unmount_r( struct fs *fs ) {
+    //write back the free block bitmap, mark the filesystem clean and release the mount state
+    //return one on success, zero otherwise
+    union fs_block block;
+
+    if(!fs->mountedOrNah) {
+        printf("You must mount your file system first\n");
+        return 0;
+    }
+
+    fs_flush_bitmap(fs);
+    if(fs->journal.nblocks) {
+        //commit what is left and write it all in place, so the next mount has nothing to replay
+        fs_journal_commit(fs);
+        fs_journal_checkpoint(fs);
+        fs->journal.nblocks = 0;
+        bitmap_delete(fs->journal.freeing);
+        fs->journal.freeing = 0;
+    }
+    if(fs->super.version >= FS_VERSION_BITMAP) {
+        disk_read_r(fs->disk, 0, block.data);
+        fs->super.clean = 1;
+        block.super = fs->super;
+        disk_write_r(fs->disk, 0, block.data);
+    }
+
+    bitmap_delete(fs->free_map);
+    fs->free_map = 0;
+    fs_free_inode_table(fs);
+    bitmap_delete(fs->inode_map);
+    fs_free_locks(fs);
+    fs->inode_map = 0;
+    fs->mountedOrNah = 0;
+    return 1;
+}
+
+int fs_sync_r( struct fs *fs ) {
+    //commit the running transaction and make everything written so far durable on the image
+    //return one on success, zero otherwise
+    if(!fs->mountedOrNah) {
+        printf("You must mount your file system first\n");
+        return 0;
+    }
+    fs_flush_bitmap(fs);
+    fs_journal_commit(fs);
+    disk_sync_r(fs->disk);
+    disk_barrier_r(fs->disk);
+    return 1;
+}
+
+//take the lowest free inode, loading inode blocks in order until one turns up
+//the caller holds create_lock; returns zero if every inode is in use
+static int fs_inode_alloc( struct fs *fs ) {
+    int inumber;
+
+    while(1) {
+        inumber = bitmap_alloc_first(fs->inode_map);
+        while(fs->inode_scan < fs->iBlocks && fs_inode_loaded(fs, fs->inode_scan)) fs->inode_scan += 1;
+        //a free inode past a block not yet loaded may have a lower one ahead of it
+        if(inumber >= 0 && inumber / INODES_PER_BLOCK <= fs->inode_scan) return inumber;
+        if(fs->inode_scan == fs->iBlocks) return inumber >= 0 ? inumber : 0;
+        if(inumber >= 0) bitmap_clear(fs->inode_map, inumber);
+        fs_inode_get(fs, fs->inode_scan * INODES_PER_BLOCK);
+    }
+}
+
+//create up to n inodes of zero length, writing each inode block they share once
+//return the number created, their inumbers in inumbers
+static int fs_create_inodes( struct fs *fs, int *inumbers, int n ) {
+    struct fs_inode *inode;
+    int created = 0, inumber, k;
+
+    while(created < n) {
+        //a bounded number of inode blocks per transaction
+        fs_journal_begin(fs);
+        pthread_mutex_lock(&fs->create_lock);
+        for(k = 0; created < n && k < FS_INODE_BATCH; created += 1, k += 1) {
+            inumber = fs_inode_alloc(fs);
+            if(!inumber) break;
+            inode = fs_inode_get(fs, inumber);
+            pthread_rwlock_wrlock(fs_inode_lock(fs, inumber));
+            memset(inode, 0, sizeof(*inode));
+            fs_stream_forget(fs, inumber);
+            inode->isvalid = fs->super.flags & FS_FLAG_EXTENTS ? FS_INODE_EXTENTS : FS_INODE_POINTERS;
+            pthread_rwlock_unlock(fs_inode_lock(fs, inumber));
+            if(created && inumber / INODES_PER_BLOCK != inumbers[created - 1] / INODES_PER_BLOCK) fs_inode_put(fs, inumbers[created - 1]);
+            inumbers[created] = inumber;
+        }
+        if(created) fs_inode_put(fs, inumbers[created - 1]);
+        pthread_mutex_unlock(&fs->create_lock);
+        fs_journal_end(fs);
+        if(k < FS_INODE_BATCH && created < n) break;
+    }
+
+    if(created < n) printf("Unable to create new inode, there are no spaces available.\n");
+    return created;
+}
+
+static int fs_create_op( struct fs *fs ) {
+    //Create a new inode of zero length
+    //return the (positive) inumber on success, on failure return 0
+    int inumber;
+
+    if(!fs->mountedOrNah) {
+        printf("You must mount your file system first\n");
+        return 0;
+    }
+    return fs_create_inodes(fs, &inumber, 1) ? inumber : 0;
+}
+
+static int fs_create_batch_op( struct fs *fs, int *inumbers, int n ) {
+    //create up to n inodes of zero length in one pass, storing their inumbers in inumbers
+    //return the number created, which is less than n only if the inode table filled up
+    if(!fs->mountedOrNah) {
+        printf("You must mount your file system first\n");
+        return 0;
+    }
+    return n > 0 ? fs_create_inodes(fs, inumbers, n) : 0;
+}
+
+//release the blocks of a file past its first keep blocks, and the pointer or extent blocks only they needed
+//entries of pointer blocks that are kept are cleared past the cut, since growing the file again turns them into a hole
+//the caller sets the size and writes back the inode
+static void fs_free_tail( struct fs *fs, struct fs_inode *inode, int keep ) {
+    union fs_block pointerBlock, outerBlock;
+    const union fs_block *indirect;
+    int have = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE; //blocks holding file data so far
+    int dstart = fs->ndirect + POINTERS_PER_BLOCK; //first logical block mapped through the double-indirect block
+    int j, first, entries, kept, nblocks, outerChanged = 0;
+
+    if(keep >= have) return;
+
+    //an extent-mapped file frees whole runs at a time, and the extent blocks left empty
+    if(FS_IS_EXTENTS(inode)) {
+        fs_extent_trim(fs, ((struct fs_extent_inode *)inode)->extent, EXTENTS_PER_INODE, FS_EXTENT_DEPTH(inode), keep);
+        if(!keep) inode->isvalid = FS_INODE_EXTENTS; //an empty tree starts over at depth zero
+        return;
+    }
+
+    //the direct blocks are cleared as well, since a rescan marks every one that is set
+    if(keep < fs->ndirect) {
+        fs_release_pointers(fs, &inode->direct[keep], fs->ndirect - keep, 0);
+        memset(&inode->direct[keep], 0, sizeof(int) * (fs->ndirect - keep));
+    }
+
+    //the indirect block: its data blocks past the cut, then the block itself if nothing before the cut needs it
+    if(have > fs->ndirect && inode->indirect) {
+        first = keep > fs->ndirect ? keep - fs->ndirect : 0;
+        entries = have - fs->ndirect < POINTERS_PER_BLOCK ? have - fs->ndirect : POINTERS_PER_BLOCK;
+        if(!first) {
+            indirect = fs_get_block(fs, inode->indirect, &pointerBlock);
+            fs_release_pointers(fs, indirect->pointers, entries, 0);
+            fs_release_run(fs, inode->indirect, 1, 1);
+            inode->indirect = 0;
+        } else if(first < entries) {
+            fs_meta_read(fs, inode->indirect, pointerBlock.data);
+            fs_release_pointers(fs, &pointerBlock.pointers[first], entries - first, 0);
+            memset(&pointerBlock.pointers[first], 0, sizeof(int) * (entries - first));
+            fs_meta_write(fs, inode->indirect, pointerBlock.data);
+        }
+    }
+
+    //the double-indirect tree: each indirect block under it past the cut, its data blocks, then the top block
+    nblocks = have - dstart;
+    if(fs->ndirect < POINTERS_PER_INODE && nblocks > 0 && inode->direct[FS_DINDIRECT]) {
+        kept = keep > dstart ? keep - dstart : 0;
+        fs_meta_read(fs, inode->direct[FS_DINDIRECT], outerBlock.data);
+        for(j = kept / POINTERS_PER_BLOCK; j * POINTERS_PER_BLOCK < nblocks; j += 1) {
+            if(!outerBlock.pointers[j]) continue;
+            first = kept > j * POINTERS_PER_BLOCK ? kept - j * POINTERS_PER_BLOCK : 0;
+            entries = nblocks - j * POINTERS_PER_BLOCK < POINTERS_PER_BLOCK ? nblocks - j * POINTERS_PER_BLOCK : POINTERS_PER_BLOCK;
+            if(!first) {
+                indirect = fs_get_block(fs, outerBlock.pointers[j], &pointerBlock);
+                fs_release_pointers(fs, indirect->pointers, entries, 0);
+                fs_release_run(fs, outerBlock.pointers[j], 1, 1);
+                outerBlock.pointers[j] = 0;
+                outerChanged = 1;
+            } else if(first < entries) {
+                fs_meta_read(fs, outerBlock.pointers[j], pointerBlock.data);
+                fs_release_pointers(fs, &pointerBlock.pointers[first], entries - first, 0);
+                memset(&pointerBlock.pointers[first], 0, sizeof(int) * (entries - first));
+                fs_meta_write(fs, outerBlock.pointers[j], pointerBlock.data);
+            }
+        }
+        if(!kept) {
+            fs_release_run(fs, inode->direct[FS_DINDIRECT], 1, 1);
+            inode->direct[FS_DINDIRECT] = 0;
+        } else if(outerChanged) {
+            fs_meta_write(fs, inode->direct[FS_DINDIRECT], outerBlock.data);
+        }
+    }
+}
+
+//the caller holds the inode's lock exclusively and writes back the inode and the bitmap
+static int fs_delete_inode( struct fs *fs, int inumber, struct fs_inode *inode ) {
+    if(!inode->isvalid) {
+        printf("That inode isn't valid\n");
+        return 0;
+    }
+    fs_free_tail(fs, inode, 0);
+
+    //make the inode invalid and clear its pointers
+    memset(inode, 0, sizeof(*inode));
+    bitmap_clear(fs->inode_map, inumber);
+    return 1;
+}
+
+static int fs_delete_op( struct fs *fs, int inumber ) {
+    //Delete the inode indicated by the inumber. Release all data and indirect blocks assigned to this inode, returning them to the free block map
+    //on success return 1, on failure return 0
+    int result;
+
+    if(!fs_check_inumber(fs, inumber)) return 0;
+
+    fs_journal_begin(fs);
+    pthread_rwlock_wrlock(fs_inode_lock(fs, inumber));
+    result = fs_delete_inode(fs, inumber, fs_inode_get(fs, inumber));
+    if(result) {
+        fs_inode_put(fs, inumber);
+        fs_flush_bitmap(fs);
+    }
+    pthread_rwlock_unlock(fs_inode_lock(fs, inumber));
+    fs_journal_end(fs);
+    return result;
+}
+
+static int fs_delete_batch_op( struct fs *fs, const int *inumbers, int n ) {
+    //delete each of n inodes, writing each inode block they share and the bitmap once per transaction rather than once per inode
+    //return the number deleted
+    int blocks[FS_INODE_BATCH]; //inode blocks changed in this transaction
+    int deleted = 0, i, k, b, nblocks;
+
+    if(!fs->mountedOrNah) {
+        printf("You must mount your file system first\n");
+        return 0;
+    }
+
+    for(i = 0; i < n; ) {
+        fs_journal_begin(fs);
+        for(nblocks = 0, k = 0; i < n && k < FS_INODE_BATCH; i += 1, k += 1) {
+            if(!fs_check_inumber(fs, inumbers[i])) continue;
+            pthread_rwlock_wrlock(fs_inode_lock(fs, inumbers[i]));
+            if(fs_delete_inode(fs, inumbers[i], fs_inode_get(fs, inumbers[i]))) {
+                deleted += 1;
+                for(b = 0; b < nblocks && blocks[b] != inumbers[i] / INODES_PER_BLOCK; b += 1);
+                if(b == nblocks) blocks[nblocks++] = inumbers[i] / INODES_PER_BLOCK;
+            }
+            pthread_rwlock_unlock(fs_inode_lock(fs, inumbers[i]));
+        }
+        //the inode table is the latest copy of every inode in these blocks, whoever changed them since
+        for(b = 0; b < nblocks; b += 1) fs_inode_put(fs, blocks[b] * INODES_PER_BLOCK);
+        fs_flush_bitmap(fs);
+        fs_journal_end(fs);
+    }
+    return deleted;
+}
+
+static int fs_getsize_op( struct fs *fs, int inumber ) {
+    //return the logical size of the given inode in bytes. Note that zero is a valid logical size for an inode
+    //on failure, return -1
+    int size;
+
+    if(!fs_check_inumber(fs, inumber)) return -1;
+
+    pthread_rwlock_rdlock(fs_inode_lock(fs, inumber));
+    size = fs_inode_get(fs, inumber)->size;
+    pthread_rwlock_unlock(fs_inode_lock(fs, inumber));
+    return size;
+}
+
+//fs_map for an extent-mapped inode: blocks inside the file are looked up a whole run at a time
+//blocks added at the end are gathered into runs of consecutive blocks and appended to the extent tree one run at a time,
+//and blocks written into a hole are gathered the same way and mapped into the hole
+static int fs_map_extents( struct fs *fs, int inumber, struct fs_inode *inode, int offset, int length, struct fs_reservation *reserve, int allocate, struct fs_mapping *map, int max ) {
+    int have = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE; //blocks holding file data so far
+    int logical = offset / DISK_BLOCK_SIZE;
+    int position = offset % DISK_BLOCK_SIZE;
+    int n = 0, blocknum, fresh, failed = 0, inodeChanged = 0;
+    int run = 0, next = 0; //blocks left in the run or hole looked up last, and the physical block of the next one (zero in a hole)
+    int added = 0, addStart = 0; //blocks allocated and not yet appended, all one physical run
+    int filled = 0, fillStart = 0, fillLogical = 0; //blocks allocated and not yet mapped into the current hole, all one physical run
+
+    while(length > 0 && n < max && logical < fs->maxBlocks) {
+        fresh = 0;
+        if(filled && !run) {
+            //the hole has ended, so the blocks written into it are mapped before looking further
+            inodeChanged = 1;
+            if(!fs_extent_fill(fs, inode, fillLogical, fillStart, filled)) {
+                failed = 1;
+                break;
+            }
+            filled = 0;
+        }
+        if(logical < have) {
+            if(!run) run = fs_extent_find(fs, inode, logical, &next);
+            blocknum = run ? next : 0;
+            if(run && !next && allocate) {
+                blocknum = fs_alloc_block(fs, reserve);
+                if(!blocknum) break; //disk is full
+                if(filled && fillStart + filled != blocknum) {
+                    inodeChanged = 1;
+                    if(!fs_extent_fill(fs, inode, fillLogical, fillStart, filled)) {
+                        fs_free_block(fs, blocknum);
+                        failed = 1;
                         break;
                     }
+                    filled = 0;
                 }
-                if(j == free_size){
-                    //all data blocks full
-                    if((offset + amountWritten) > inodeSize) { //checks whether size needs update
-                        block.inode[inodeIndex].size = offset + amountWritten;
-                        disk_write(inodeBlockToReadFrom, block.data);
-                    }
-                    return amountWritten;
+                if(!filled) {
+                    fillStart = blocknum;
+                    fillLogical = logical;
                 }
+                filled += 1;
+                fresh = 1;
             }
-            if (position > DISK_BLOCK_SIZE) { //if the offset calls for skipping this block
-                position -= DISK_BLOCK_SIZE;
-                continue;
+            if(run) {
+                run -= 1;
+                if(next) next += 1;
             }
-            dindex = block.inode[inodeIndex].direct[i]; //saving the index of the direct pointer
-            disk_read(dindex, block.data);
-            for (k = position; k < DISK_BLOCK_SIZE; k += 1) {
-                block.data[k] = data[amountWritten]; //writes the data
-                amountWritten++; position--; //increment/decrement tracking info
-                if (amountWritten >= length ) { //if the amountWritten is greater than or equal to the amount asked for, you're done!
-                    disk_write(dindex,block.data);  //write the datat
-                    disk_read(inodeBlockToReadFrom,block.data); //read from original inode
-                    if((offset + amountWritten) > inodeSize) { //do you need to update size?
-                        block.inode[inodeIndex].size = offset + amountWritten;
-                        disk_write(inodeBlockToReadFrom, block.data);
-                    }
-                    return amountWritten;                    
+        } else if(allocate) {
+            blocknum = fs_alloc_block(fs, reserve);
+            if(!blocknum) break; //disk is full
+            if(added && addStart + added != blocknum) {
+                inodeChanged = 1;
+                if(!fs_extent_append(fs, inode, addStart, added)) {
+                    fs_free_block(fs, blocknum);
+                    failed = 1;
+                    break;
                 }
+                added = 0;
             }
-            position = 0;
-            disk_write(dindex,block.data);
-            disk_read(inodeBlockToReadFrom,block.data);
-        }
-    } else { //decrement the position the size of the direct pointers
-        position -= (POINTERS_PER_INODE*DISK_BLOCK_SIZE);
-    }
-
-    int numIndirectPointersAllocated = ceil((double)inodeSize / (double)DISK_BLOCK_SIZE) - numDirectPointers; //finding the amount of indirect pointers
-    disk_read(inodeBlockToReadFrom, block.data);
-    int indirectBlockLocation; //location of indirect block
-    if(numIndirectPointersAllocated > 0){ //if there's one allocated
-        indirectBlockLocation = block.inode[inodeIndex].indirect;
-    }
-    else {
-        for(j = 0; j < free_size; j += 1){
-            if(free_list[j] == 0){ //this block is free!
-                //allocating an indirect block
-                free_list[j] = 1;
-                indirectBlockLocation = j;
-                block.inode[inodeIndex].indirect = j;
-                disk_write(inodeBlockToReadFrom, block.data);
-                break;
-            }
+            if(!added) addStart = blocknum;
+            added += 1;
+            fresh = 1;
+        } else {
+            blocknum = 0;
         }
-        if (j == free_size) {
-            //all data blocks full
-            if((offset + amountWritten) > inodeSize) { //checks whether size needs update
-                block.inode[inodeIndex].size = offset + amountWritten;
-                disk_write(inodeBlockToReadFrom, block.data);
-             }
-             return amountWritten;           
-        }
-
-    }
-    for (i = 0; i < POINTERS_PER_BLOCK; i += 1){
-        //allocation check
-        if ((i+1) > numIndirectPointersAllocated){ //need to allocate
-            for(j = 0; j < free_size; j += 1){
-                if(free_list[j] == 0){ //this block is free!
-                    free_list[j] = 1;
-                    disk_read(indirectBlockLocation, block.data);
-                    block.pointers[i] = j;
-                    disk_write(indirectBlockLocation, block.data);
-                    disk_read(inodeBlockToReadFrom, block.data);
-                    break;
+
+        map[n].blocknum = blocknum;
+        map[n].offset = position;
+        map[n].length = DISK_BLOCK_SIZE - position < length ? DISK_BLOCK_SIZE - position : length;
+        map[n].fresh = fresh;
+        length -= map[n].length;
+        position = 0;
+        logical += 1;
+        n += 1;
+    }
+
+    if(added) {
+        inodeChanged = 1;
+        if(!failed && fs_extent_append(fs, inode, addStart, added)) added = 0;
+    }
+    if(filled) {
+        inodeChanged = 1;
+        if(!failed && fs_extent_fill(fs, inode, fillLogical, fillStart, filled)) filled = 0;
+    }
+    if(added || filled) {
+        //no room for another extent block: the last run is given back and left out of the mapping
+        printf("Unable to allocate an extent block\n");
+        if(filled) addStart = fillStart;
+        bitmap_free_run(fs->free_map, addStart, added + filled);
+        fs_bitmap_dirty(fs, addStart, added + filled);
+        n -= added + filled;
+    }
+    if(inodeChanged) fs_inode_put(fs, inumber);
+    return n;
+}
+
+//resolve the byte range [offset, offset+length) of an inode to a list of block pieces, filling at most max entries
+//pointer blocks are resolved one level at a time and each is read once per call instead of once per data block
+//with allocate set, blocks the range needs are allocated and the changed pointer blocks and inode written back once each
+//returns the number of entries filled in, which only falls short of the range when max is reached or the disk is full
+static int fs_map( struct fs *fs, int inumber, struct fs_inode *inode, int offset, int length, struct fs_reservation *reserve, int allocate, struct fs_mapping *map, int max ) {
+    union fs_block pointerBlock, outerBlock, innerBlock;
+    const int *pointers = 0, *outer = 0, *inner = 0, *slot;
+    int have = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE; //blocks holding file data so far
+    int dstart = fs->ndirect + POINTERS_PER_BLOCK; //first logical block mapped through the double-indirect block
+    int logical = offset / DISK_BLOCK_SIZE;
+    int position = offset % DISK_BLOCK_SIZE;
+    int n = 0, blocknum, fresh, index = 0;
+    int innerIndex = -1, innerNum = 0; //which indirect block under the double-indirect one is in innerBlock
+    int inodeChanged = 0, indirectChanged = 0, outerChanged = 0, innerChanged = 0;
+
+    if(FS_IS_EXTENTS(inode)) return fs_map_extents(fs, inumber, inode, offset, length, reserve, allocate, map, max);
+
+    while(length > 0 && n < max && logical < fs->maxBlocks) {
+        if(logical < fs->ndirect) {
+            slot = &inode->direct[logical];
+        } else if(logical < dstart) {
+            if(!pointers && have > fs->ndirect && inode->indirect) {
+                //only the first have-ndirect entries of an existing indirect block are meaningful, and a zero one is a hole
+                if(allocate) {
+                    fs_meta_read(fs, inode->indirect, pointerBlock.data);
+                    pointers = pointerBlock.pointers;
+                } else {
+                    pointers = fs_get_block(fs, inode->indirect, &pointerBlock)->pointers;
+                }
+            } else if(!pointers && allocate) {
+                blocknum = fs_alloc_block(fs, reserve);
+                if(!blocknum) break; //disk is full
+                inode->indirect = blocknum;
+                inodeChanged = 1;
+                memset(pointerBlock.data, 0, sizeof(pointerBlock.data));
+                pointers = pointerBlock.pointers;
+                indirectChanged = 1;
+            }
+            slot = pointers ? &pointers[logical - fs->ndirect] : 0;
+        } else {
+            index = logical - dstart;
+            //top level: the double-indirect block, a block of pointers to indirect blocks
+            if(!outer && have > dstart && inode->direct[FS_DINDIRECT]) {
+                if(allocate) {
+                    fs_meta_read(fs, inode->direct[FS_DINDIRECT], outerBlock.data);
+                    outer = outerBlock.pointers;
+                } else {
+                    outer = fs_get_block(fs, inode->direct[FS_DINDIRECT], &outerBlock)->pointers;
                 }
+            } else if(!outer && allocate) {
+                blocknum = fs_alloc_block(fs, reserve);
+                if(!blocknum) break; //disk is full
+                inode->direct[FS_DINDIRECT] = blocknum;
+                inodeChanged = 1;
+                memset(outerBlock.data, 0, sizeof(outerBlock.data));
+                outer = outerBlock.pointers;
+                outerChanged = 1;
             }
-            if(j == free_size){
-                //all data blocks are full!
-                printf("All data blocks are full! The entire file was not able to be written\n");
-                if(offset + amountWritten > inodeSize){
-                    block.inode[inodeIndex].size = offset + amountWritten;
-                    disk_write(inodeBlockToReadFrom, block.data);
+            //second level: the indirect block covering this logical block, kept until the range moves past it
+            if(outer && innerIndex != index / POINTERS_PER_BLOCK) {
+                if(innerChanged) fs_meta_write(fs, innerNum, innerBlock.data);
+                innerChanged = 0;
+                innerIndex = index / POINTERS_PER_BLOCK;
+                innerNum = have > dstart + innerIndex * POINTERS_PER_BLOCK ? outer[innerIndex] : 0;
+                inner = 0;
+                if(innerNum && allocate) {
+                    fs_meta_read(fs, innerNum, innerBlock.data);
+                    inner = innerBlock.pointers;
+                } else if(innerNum) {
+                    inner = fs_get_block(fs, innerNum, &innerBlock)->pointers;
+                } else if(allocate) {
+                    innerNum = fs_alloc_block(fs, reserve);
+                    if(!innerNum) break; //disk is full
+                    outerBlock.pointers[innerIndex] = innerNum;
+                    outerChanged = 1;
+                    memset(innerBlock.data, 0, sizeof(innerBlock.data));
+                    inner = innerBlock.pointers;
+                    innerChanged = 1;
                 }
-                return amountWritten;
             }
+            slot = inner ? &inner[index % POINTERS_PER_BLOCK] : 0;
         }
-        //offset check
-        if(position > DISK_BLOCK_SIZE) {
-            position -= DISK_BLOCK_SIZE;
-            continue;
+
+        fresh = 0;
+        blocknum = slot && logical < have ? *slot : 0;
+        if(!blocknum && allocate) {
+            blocknum = fs_alloc_block(fs, reserve);
+            if(!blocknum) break; //disk is full
+            fresh = 1;
+            if(logical < fs->ndirect) {
+                inode->direct[logical] = blocknum;
+                inodeChanged = 1;
+            } else if(logical < dstart) {
+                pointerBlock.pointers[logical - fs->ndirect] = blocknum;
+                indirectChanged = 1;
+            } else {
+                innerBlock.pointers[index % POINTERS_PER_BLOCK] = blocknum;
+                innerChanged = 1;
+            }
+        }
+
+        map[n].blocknum = blocknum;
+        map[n].offset = position;
+        map[n].length = DISK_BLOCK_SIZE - position < length ? DISK_BLOCK_SIZE - position : length;
+        map[n].fresh = fresh;
+        length -= map[n].length;
+        position = 0;
+        logical += 1;
+        n += 1;
+    }
+
+    if(innerChanged) fs_meta_write(fs, innerNum, innerBlock.data);
+    if(outerChanged) fs_meta_write(fs, inode->direct[FS_DINDIRECT], outerBlock.data);
+    if(indirectChanged) fs_meta_write(fs, inode->indirect, pointerBlock.data);
+    if(inodeChanged) fs_inode_put(fs, inumber);
+    return n;
+}
+
+//the caller holds the inode's lock, shared or exclusive
+static int fs_read_blocks( struct fs *fs, int inumber, struct fs_inode *inode, char *data, int length, int offset ) {
+    union fs_block block;
+    const union fs_block *source;
+    struct fs_mapping map[FS_MAP_BATCH];
+    int blocknums[FS_MAP_BATCH];
+    char *buffers[FS_MAP_BATCH];
+    int i, n, nwhole, amountRead = 0;
+
+    if(!inode->isvalid) {
+        printf("You messed up fam, that inode isn't valid\n");
+        return 0;
+    }
+
+    if(offset < 0 || offset >= inode->size) {
+        printf("The offset is greater than the inode size, there is nothing to read\n");
+        return 0;
+    }
+    if(length > inode->size - offset) length = inode->size - offset;
+
+    while(amountRead < length) {
+        n = fs_map(fs, inumber, inode, offset + amountRead, length - amountRead, 0, 0, map, FS_MAP_BATCH);
+        if(n == 0) break;
+        nwhole = 0;
+        for(i = 0; i < n; i += 1) {
+            if(!map[i].blocknum) {
+                memset(data + amountRead, 0, map[i].length); //nothing allocated here, reads as zeros
+            } else if(map[i].length == DISK_BLOCK_SIZE) {
+                //whole blocks are read together below, straight into the caller's buffer
+                blocknums[nwhole] = map[i].blocknum;
+                buffers[nwhole] = data + amountRead;
+                nwhole++;
+            } else {
+                source = fs_get_block(fs, map[i].blocknum, &block);
+                memcpy(data + amountRead, source->data + map[i].offset, map[i].length);
+            }
+            amountRead += map[i].length;
+        }
+        disk_readv_r(fs->disk, blocknums, buffers, nwhole);
+    }
+
+    return amountRead;
+}
+
+//after a read of [offset, offset+length), prefetch the blocks the next sequential reads will want
+//the window starts at FS_READAHEAD_MIN blocks and doubles with each sequential read; a read anywhere else closes it
+//it is topped up once less than half of it is left, so the disk is asked for a few large ranges
+//it never grows past what the disk can hold on to, which with O_DIRECT is half of the block cache
+//the caller holds the inode's lock, shared or exclusive
+static void fs_readahead( struct fs *fs, int inumber, struct fs_inode *inode, int offset, int length ) {
+    struct fs_stream *stream = fs_stream_take(fs, inumber);
+    struct fs_mapping map[FS_MAP_BATCH];
+    int blocknums[FS_READAHEAD_MAX];
+    int window = __atomic_load_n(&stream->window, __ATOMIC_RELAXED);
+    int ahead = __atomic_load_n(&stream->ahead, __ATOMIC_RELAXED);
+    int end = (offset + length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE; //first block after this read
+    int stop, i, n, count = 0;
+
+    if(__atomic_exchange_n(&stream->next, offset + length, __ATOMIC_RELAXED) != offset) {
+        __atomic_store_n(&stream->window, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stream->ahead, 0, __ATOMIC_RELAXED);
+        return;
+    }
+
+    window = window ? window * 2 : FS_READAHEAD_MIN;
+    if(window > FS_READAHEAD_MAX) window = FS_READAHEAD_MAX;
+    if(window > disk_prefetch_max_r(fs->disk)) window = disk_prefetch_max_r(fs->disk);
+    __atomic_store_n(&stream->window, window, __ATOMIC_RELAXED);
+
+    if(ahead < end) ahead = end;
+    stop = end + window;
+    if(stop > (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE) stop = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    if(ahead - end >= window / 2 || ahead >= stop) return;
+
+    while(ahead < stop) {
+        n = fs_map(fs, inumber, inode, ahead * DISK_BLOCK_SIZE, (stop - ahead) * DISK_BLOCK_SIZE, 0, 0, map, FS_MAP_BATCH);
+        if(n == 0) break;
+        for(i = 0; i < n; i += 1) {
+            if(map[i].blocknum) blocknums[count++] = map[i].blocknum;
         }
-        //get back to the correct block
-        disk_read(indirectBlockLocation, block.data);
-        dindex = block.pointers[i]; 
-        disk_read(dindex, block.data);
-        //write the data
-        for(k = position; k < DISK_BLOCK_SIZE; k += 1){
-            block.data[k] = data[amountWritten];
-            amountWritten++; position--;
-            if(amountWritten >= length){ //we are done writing
-                disk_write(dindex, block.data);
-                disk_read(inodeBlockToReadFrom, block.data);
-                if(offset + amountWritten > inodeSize){ //update size
-                    block.inode[inodeIndex].size = offset + amountWritten;
-                    disk_write(inodeBlockToReadFrom, block.data);
+        ahead += n;
+    }
+    disk_prefetch_r(fs->disk, blocknums, count);
+    __atomic_store_n(&stream->ahead, ahead, __ATOMIC_RELAXED);
+}
+
+static int fs_read_op( struct fs *fs, int inumber, char *data, int length, int offset ) {
+    //Read data from a valid inode. Copy "length" bytes from the inode into the "data" pointer starting at "offset" bytes
+    //Whole blocks are read straight into "data"; only the partial blocks at either end go through a block buffer
+    //Return the number of bytes actually read, which is smaller than "length" when the read runs past the end of the inode
+    //If the given number is invalid return -1, on any other error return 0
+    int result;
+
+    if(!fs_check_inumber(fs, inumber)) return -1;
+
+    pthread_rwlock_rdlock(fs_inode_lock(fs, inumber));
+    result = fs_read_blocks(fs, inumber, fs_inode_get(fs, inumber), data, length, offset);
+    if(result > 0) fs_readahead(fs, inumber, fs_inode_get(fs, inumber), offset, result);
+    pthread_rwlock_unlock(fs_inode_lock(fs, inumber));
+    return result;
+}
+
+static int fs_read_fd_op( struct fs *fs, int inumber, int fd, int length, int offset ) {
+    //Copy "length" bytes of a valid inode from "offset" to the host file fd at the same offset, leaving fd's position alone
+    //Runs of whole blocks are copied by the disk layer, inside the kernel where it can; holes are not written at all,
+    //so they stay holes in fd provided it was empty there (a new or truncated file)
+    //Return the number of bytes copied, -1 for an invalid inumber and 0 on any other error
+    union fs_block block;
+    const union fs_block *source;
+    struct fs_mapping map[FS_MAP_BATCH];
+    struct fs_inode *inode;
+    int i, n, runStart = 0, runCount = 0, runOffset = 0, amountRead = 0, failed = 0;
+
+    if(!fs_check_inumber(fs, inumber)) return -1;
+
+    pthread_rwlock_rdlock(fs_inode_lock(fs, inumber));
+    inode = fs_inode_get(fs, inumber);
+    if(!inode->isvalid) {
+        printf("You messed up fam, that inode isn't valid\n");
+        length = 0;
+    } else if(offset < 0 || offset >= inode->size) {
+        printf("The offset is greater than the inode size, there is nothing to read\n");
+        length = 0;
+    } else if(length > inode->size - offset) {
+        length = inode->size - offset;
+    }
+
+    while(amountRead < length && !failed) {
+        n = fs_map(fs, inumber, inode, offset + amountRead, length - amountRead, 0, 0, map, FS_MAP_BATCH);
+        if(n == 0) break;
+        for(i = 0; i < n && !failed; i += 1) {
+            //whole blocks are gathered into runs of consecutive blocks, each copied once it ends
+            if(runCount && (map[i].length != DISK_BLOCK_SIZE || map[i].blocknum != runStart + runCount)) {
+                failed = disk_copy_out_r(fs->disk, runStart, runCount, fd, runOffset) < runCount;
+                runCount = 0;
+            }
+            if(!map[i].blocknum || failed) {
+                //a hole: nothing to copy
+            } else if(map[i].length == DISK_BLOCK_SIZE) {
+                if(!runCount) {
+                    runStart = map[i].blocknum;
+                    runOffset = offset + amountRead;
                 }
-                return amountWritten;
+                runCount += 1;
+            } else {
+                source = fs_get_block(fs, map[i].blocknum, &block);
+                failed = pwrite(fd, source->data + map[i].offset, map[i].length, offset + amountRead) != map[i].length;
             }
+            if(!failed) amountRead += map[i].length;
         }
-        position = 0;
-        disk_write(dindex, block.data);
-        disk_read(inodeBlockToReadFrom, block.data);
     }
+    if(runCount && !failed && disk_copy_out_r(fs->disk, runStart, runCount, fd, runOffset) < runCount) failed = 1;
+    if(failed) {
+        printf("Unable to write to the host file: %s\n", strerror(errno));
+        amountRead = 0;
+    }
+    pthread_rwlock_unlock(fs_inode_lock(fs, inumber));
+    return amountRead;
+}
+
+//write "length" bytes of "data" (or zeros when data is null) to an inode at "offset", allocating blocks as needed
+//when fd is not negative the bytes come from that host file instead, read at the same offsets, and runs of whole
+//blocks are copied from it to the image by the disk layer without passing through a buffer here
+//with behind set, whole blocks are left in the block cache to go out with later ones instead of written through
+//returns the number of bytes written, which is short only when the disk fills up or fd ends early;
+//in the second case the blocks of the batch fd could not fill are zeroed and still counted in the size
+static int fs_write_range( struct fs *fs, int inumber, struct fs_inode *inode, struct fs_reservation *reserve, const char *data, int fd, int length, int offset, int behind ) {
+    union fs_block block;
+    struct fs_mapping map[FS_MAP_BATCH];
+    int blocknums[FS_MAP_BATCH];
+    const char *buffers[FS_MAP_BATCH];
+    int positions[FS_MAP_BATCH]; //where each whole block starts, relative to offset
+    int i, j, k, n, run, nwhole, amountWritten = 0, wanted, copied = length;
+
+    while(amountWritten < length) {
+        wanted = (length - amountWritten + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+        n = fs_map(fs, inumber, inode, offset + amountWritten, length - amountWritten, reserve, 1, map, FS_MAP_BATCH);
+        nwhole = 0;
+        for(i = 0; i < n; i += 1) {
+            if(map[i].length == DISK_BLOCK_SIZE) {
+                //whole blocks are written together below, straight from the caller's buffer
+                blocknums[nwhole] = map[i].blocknum;
+                buffers[nwhole] = data ? data + amountWritten : fs_zero_block.data;
+                positions[nwhole] = amountWritten;
+                nwhole++;
+            } else {
+                //partial block: keep the bytes around the piece, unless the block is new
+                if(map[i].fresh) {
+                    memset(block.data, 0, sizeof(block.data));
+                } else {
+                    disk_read_r(fs->disk, map[i].blocknum, block.data);
+                }
+                if(fd >= 0) {
+                    j = pread(fd, block.data + map[i].offset, map[i].length, offset + amountWritten);
+                    if(j < 0) j = 0;
+                    if(j < map[i].length) {
+                        memset(block.data + map[i].offset + j, 0, map[i].length - j);
+                        if(copied > amountWritten + j) copied = amountWritten + j;
+                    }
+                } else if(data) {
+                    memcpy(block.data + map[i].offset, data + amountWritten, map[i].length);
+                } else {
+                    memset(block.data + map[i].offset, 0, map[i].length);
+                }
+                disk_write_r(fs->disk, map[i].blocknum, block.data);
+            }
+            amountWritten += map[i].length;
+        }
+        if(fd >= 0) {
+            //one copy per run of physically consecutive blocks
+            for(i = 0; i < nwhole; i += run) {
+                for(run = 1; i + run < nwhole && blocknums[i + run] == blocknums[i] + run; run += 1);
+                for(j = disk_copy_in_r(fs->disk, blocknums[i], run, fd, offset + positions[i]); j < run; j += 1) {
+                    //fd ended in this block or before it: keep what it still has and zero the rest
+                    k = copied > positions[i + j] ? pread(fd, block.data, DISK_BLOCK_SIZE, offset + positions[i + j]) : 0;
+                    if(k < 0) k = 0;
+                    memset(block.data + k, 0, DISK_BLOCK_SIZE - k);
+                    disk_write_r(fs->disk, blocknums[i + j], block.data);
+                    if(copied > positions[i + j] + k) copied = positions[i + j] + k;
+                }
+            }
+        } else if(behind) {
+            disk_write_behind_r(fs->disk, blocknums, buffers, nwhole);
+        } else {
+            disk_writev_r(fs->disk, blocknums, buffers, nwhole);
+        }
+        //grow the size as each batch lands, so the next fs_map call sees the blocks this one mapped
+        if(offset + amountWritten > inode->size) inode->size = offset + amountWritten;
+        if(copied < length) return copied;
+        if(n < FS_MAP_BATCH && n < wanted) break; //out of blocks or past the largest file size
+    }
+
+    return amountWritten;
+}
+
+//grow a file to size bytes without allocating anything: the blocks past the old end are a hole, read back as zeros
+//the rest of the old last block is zeroed if it is allocated, since a shrinking truncate leaves its old bytes there
+//the caller holds the inode's lock exclusively and writes back the inode; returns one, or zero if the file cannot be that large
+static int fs_extend( struct fs *fs, int inumber, struct fs_inode *inode, struct fs_reservation *reserve, int size ) {
+    struct fs_mapping map;
+    int have = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE; //blocks holding file data so far
+    int want = (size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int tail = DISK_BLOCK_SIZE - inode->size % DISK_BLOCK_SIZE;
+
+    if(size <= inode->size) return 1;
+    if(want > fs->maxBlocks) return 0;
+    if(tail < DISK_BLOCK_SIZE && fs_map(fs, inumber, inode, inode->size, 1, reserve, 0, &map, 1) && map.blocknum) {
+        if(tail > size - inode->size) tail = size - inode->size;
+        if(fs_write_range(fs, inumber, inode, reserve, 0, -1, tail, inode->size, 0) < tail) return 0;
+    }
+    //an extent-mapped file records the hole as an extent of its own
+    if(FS_IS_EXTENTS(inode) && want > have && !fs_extent_append(fs, inode, 0, want - have)) {
+        printf("Unable to allocate an extent block\n");
+        return 0;
+    }
+    inode->size = size;
+    return 1;
+}
+
+//the caller holds the inode's lock exclusively
+static int fs_write_blocks( struct fs *fs, int inumber, struct fs_inode *inode, struct fs_reservation *reserve, const char *data, int fd, int length, int offset ) {
+    //changes to the cached inode are written through with fs_inode_put
+    //fs_write_range grows the cached size as it goes, so the inode is put once if the size changed
+    //a write that carries on where the last one ended is part of a stream and is written behind
+    int amountWritten, size = inode->size;
+    struct fs_stream *stream = fs_stream_find(fs, inumber);
+    int behind = stream ? __atomic_load_n(&stream->next, __ATOMIC_RELAXED) == offset : offset == 0;
+
+    //check inode validity
+    if(!inode->isvalid) {
+        printf("you messed up fam, that inode isn't valid\n");
+        return 0;
+    }
+    if(offset < 0 || length < 0) return 0;
+
+    //a write past the end of the file leaves a hole in between
+    if(offset > inode->size && !fs_extend(fs, inumber, inode, reserve, offset)) {
+        printf("All data blocks are full! The entire file was not able to be written\n");
+        if(inode->size != size) fs_inode_put(fs, inumber);
+        return 0;
+    }
+
+    amountWritten = fs_write_range(fs, inumber, inode, reserve, data, fd, length, offset, behind);
+    if(amountWritten < length && fd >= 0 && offset + amountWritten < inode->size) {
+        printf("The host file ended before %d bytes could be copied from it\n", length);
+    } else if(amountWritten < length) {
+        printf("All data blocks are full! The entire file was not able to be written\n");
+    }
+    __atomic_store_n(&fs_stream_take(fs, inumber)->next, offset + amountWritten, __ATOMIC_RELAXED);
 
-    disk_read(inodeBlockToReadFrom, block.data);
-    block.inode[inodeIndex].size = offset + amountWritten;
-    disk_write(inodeBlockToReadFrom, block.data);
+    if(inode->size != size) { //update size
+        fs_inode_put(fs, inumber);
+    }
     return amountWritten; //all done, return
 }
+
+static int fs_write_op( struct fs *fs, int inumber, const char *data, int fd, int length, int offset ) {
+    //reserve the blocks this write will add to the file up front, then hand back any left over
+    //the data comes from "data", or from the host file fd at the same offsets when fd is not negative
+    struct fs_reservation reserve = {0, 0};
+    struct fs_inode *inode;
+    int result, need = 0, retried = 0;
+
+    if(!fs_check_inumber(fs, inumber)) return -1;
+
+    while(1) {
+        fs_journal_begin(fs);
+        pthread_rwlock_wrlock(fs_inode_lock(fs, inumber));
+        inode = fs_inode_get(fs, inumber);
+        if(inode->isvalid && length > 0) need = fs_blocks_needed(fs, inode, offset, offset + length);
+        //blocks freed by the running transaction are only handed out once it commits
+        if(retried || need <= __atomic_load_n(&fs->free_map->nfree, __ATOMIC_RELAXED) || !__atomic_load_n(&fs->journal.nfreeing, __ATOMIC_RELAXED)) break;
+        pthread_rwlock_unlock(fs_inode_lock(fs, inumber));
+        fs_journal_end(fs);
+        fs_journal_commit(fs);
+        retried = 1;
+    }
+    fs_reserve(fs, &reserve, need);
+
+    result = fs_write_blocks(fs, inumber, inode, &reserve, data, fd, length, offset);
+    fs_unreserve(fs, &reserve);
+    fs_flush_bitmap(fs);
+    pthread_rwlock_unlock(fs_inode_lock(fs, inumber));
+    fs_journal_end(fs);
+    return result;
+}
+
+static int fs_truncate_op( struct fs *fs, int inumber, int size ) {
+    //set the size of the given inode: blocks past a smaller size are released, and a larger size leaves a hole that reads as zeros
+    //return 1 on success, 0 on failure
+    struct fs_reservation reserve = {0, 0};
+    struct fs_inode *inode;
+    int result = 1, old;
+
+    if(!fs_check_inumber(fs, inumber)) return 0;
+    if(size < 0) {
+        printf("The size cannot be negative\n");
+        return 0;
+    }
+
+    fs_journal_begin(fs);
+    pthread_rwlock_wrlock(fs_inode_lock(fs, inumber));
+    inode = fs_inode_get(fs, inumber);
+    old = inode->size;
+    if(!inode->isvalid) {
+        printf("That inode isn't valid\n");
+        result = 0;
+    } else if(size < old) {
+        fs_free_tail(fs, inode, (size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE);
+        inode->size = size;
+    } else if(size > old && !fs_extend(fs, inumber, inode, &reserve, size)) {
+        printf("All data blocks are full! The file was not able to be extended\n");
+        result = 0;
+    }
+    if(inode->size != old) {
+        fs_stream_forget(fs, inumber);
+        fs_inode_put(fs, inumber);
+        fs_flush_bitmap(fs);
+    }
+    pthread_rwlock_unlock(fs_inode_lock(fs, inumber));
+    fs_journal_end(fs);
+    return result;
+}
+
+static int fs_seek_op( struct fs *fs, int inumber, int offset, int whence ) {
+    //return the first offset at or after the given one that holds data (FS_SEEK_DATA) or is in a hole (FS_SEEK_HOLE)
+    //holes are found a block at a time from the block map, without reading any data; the end of the file counts as a hole
+    //on failure, or when there is no data past offset, return -1
+    struct fs_mapping map[FS_MAP_BATCH];
+    struct fs_inode *inode;
+    int result = -1, position, size, i, n;
+
+    if(!fs_check_inumber(fs, inumber)) return -1;
+    if(whence != FS_SEEK_DATA && whence != FS_SEEK_HOLE) {
+        printf("Seek for data or a hole\n");
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(fs_inode_lock(fs, inumber));
+    inode = fs_inode_get(fs, inumber);
+    size = inode->size;
+    if(!inode->isvalid) {
+        printf("That inode isn't valid\n");
+    } else if(offset >= 0 && offset < size) {
+        position = offset;
+        if(whence == FS_SEEK_HOLE) result = size;
+        while(position < size) {
+            n = fs_map(fs, inumber, inode, position, size - position, 0, 0, map, FS_MAP_BATCH);
+            for(i = 0; i < n && !map[i].blocknum == (whence == FS_SEEK_DATA); i += 1) position += map[i].length;
+            if(i < n) {
+                result = position;
+                break;
+            }
+            if(!n) break;
+        }
+    }
+    pthread_rwlock_unlock(fs_inode_lock(fs, inumber));
+    return result;
+}
+
+//start of one timed call, for attributing time and the calling thread's block I/O to an operation
+struct fs_timer {
+    struct timespec start;
+    struct disk_stats io;
+};
+
+static const char *fs_op_names[FS_OP_COUNT] = { "format", "mount", "create", "delete", "getsize", "read", "write", "truncate", "seek" };
+
+const char *fs_op_name( int op ) {
+    return op >= 0 && op < FS_OP_COUNT ? fs_op_names[op] : "unknown";
+}
+
+static void fs_timer_start( struct fs_timer *timer ) {
+    disk_thread_stats(&timer->io);
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
+}
+
+#define FS_STAT_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+
+//charge the call begun by fs_timer_start to operation op
+static void fs_timer_stop( struct fs *fs, int op, struct fs_timer *timer, int bytes ) {
+    struct fs_op_stats *stats = &fs->stats.op[op];
+    struct timespec end;
+    struct disk_stats io;
+    long long nanoseconds, micros;
+    int bucket = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    disk_thread_stats(&io);
+    nanoseconds = (end.tv_sec - timer->start.tv_sec) * 1000000000LL + end.tv_nsec - timer->start.tv_nsec;
+
+    //log2 buckets of microseconds: bucket k holds calls of [2^k, 2^(k+1)) us, bucket 0 everything under 2 us
+    for(micros = nanoseconds / 1000; micros > 1 && bucket < FS_LATENCY_BUCKETS - 1; micros >>= 1) bucket++;
+
+    FS_STAT_ADD(stats->calls, 1);
+    FS_STAT_ADD(stats->bytes, bytes);
+    FS_STAT_ADD(stats->reads, io.reads - timer->io.reads);
+    FS_STAT_ADD(stats->writes, io.writes - timer->io.writes);
+    FS_STAT_ADD(stats->hits, io.hits - timer->io.hits);
+    FS_STAT_ADD(stats->misses, io.misses - timer->io.misses);
+    FS_STAT_ADD(stats->nanoseconds, nanoseconds);
+    FS_STAT_ADD(stats->latency[bucket], 1);
+}
+
+void fs_stats_r( struct fs *fs, struct fs_stats *stats ) {
+    //copy out the per-operation counters collected since the handle was opened or last reset
+    long long *from = (long long *)&fs->stats, *to = (long long *)stats;
+    size_t i;
+    for(i = 0; i < sizeof(*stats) / sizeof(long long); i += 1) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+void fs_stats_reset_r( struct fs *fs ) {
+    //zero the per-operation counters; the filesystem stays mounted
+    long long *counters = (long long *)&fs->stats;
+    size_t i;
+    for(i = 0; i < sizeof(fs->stats) / sizeof(long long); i += 1) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+int fs_format_mode_r( struct fs *fs, int mode ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_format_op(fs, mode);
+    fs_timer_stop(fs, FS_OP_FORMAT, &timer, 0);
+    return result;
+}
+
+int fs_mount_r( struct fs *fs ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_mount_op(fs);
+    fs_timer_stop(fs, FS_OP_MOUNT, &timer, 0);
+    return result;
+}
+
+int fs_create_r( struct fs *fs ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_create_op(fs);
+    fs_timer_stop(fs, FS_OP_CREATE, &timer, 0);
+    return result;
+}
+
+int fs_create_batch_r( struct fs *fs, int *inumbers, int n ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_create_batch_op(fs, inumbers, n);
+    fs_timer_stop(fs, FS_OP_CREATE, &timer, 0);
+    return result;
+}
+
+int fs_delete_r( struct fs *fs, int inumber ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_delete_op(fs, inumber);
+    fs_timer_stop(fs, FS_OP_DELETE, &timer, 0);
+    return result;
+}
+
+int fs_delete_batch_r( struct fs *fs, const int *inumbers, int n ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_delete_batch_op(fs, inumbers, n);
+    fs_timer_stop(fs, FS_OP_DELETE, &timer, 0);
+    return result;
+}
+
+int fs_truncate_r( struct fs *fs, int inumber, int size ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_truncate_op(fs, inumber, size);
+    fs_timer_stop(fs, FS_OP_TRUNCATE, &timer, 0);
+    return result;
+}
+
+int fs_getsize_r( struct fs *fs, int inumber ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_getsize_op(fs, inumber);
+    fs_timer_stop(fs, FS_OP_GETSIZE, &timer, 0);
+    return result;
+}
+
+int fs_seek_r( struct fs *fs, int inumber, int offset, int whence ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_seek_op(fs, inumber, offset, whence);
+    fs_timer_stop(fs, FS_OP_SEEK, &timer, 0);
+    return result;
+}
+
+int fs_read_r( struct fs *fs, int inumber, char *data, int length, int offset ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_read_op(fs, inumber, data, length, offset);
+    fs_timer_stop(fs, FS_OP_READ, &timer, result > 0 ? result : 0);
+    return result;
+}
+
+int fs_read_fd_r( struct fs *fs, int inumber, int fd, int length, int offset ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_read_fd_op(fs, inumber, fd, length, offset);
+    fs_timer_stop(fs, FS_OP_READ, &timer, result > 0 ? result : 0);
+    return result;
+}
+
+int fs_write_r( struct fs *fs, int inumber, const char *data, int length, int offset ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_write_op(fs, inumber, data, -1, length, offset);
+    fs_timer_stop(fs, FS_OP_WRITE, &timer, result > 0 ? result : 0);
+    return result;
+}
+
+int fs_write_fd_r( struct fs *fs, int inumber, int fd, int length, int offset ) {
+    struct fs_timer timer;
+    int result;
+    fs_timer_start(&timer);
+    result = fs_write_op(fs, inumber, 0, fd, length, offset);
+    fs_timer_stop(fs, FS_OP_WRITE, &timer, result > 0 ? result : 0);
+    return result;
+}
+
+struct fs *fs_open( struct disk *disk ) {
+    //make a handle for the filesystem on an open disk; it starts out unmounted
+    //return the handle, or zero if it could not be allocated
+    struct fs *fs = calloc(1, sizeof(*fs));
+    if(!fs) return 0;
+
+    fs->disk = disk;
+    fs->dirty_hi = -1;
+    pthread_mutex_init(&fs->inode_table_lock, 0);
+    pthread_mutex_init(&fs->bitmap_lock, 0);
+    pthread_mutex_init(&fs->create_lock, 0);
+    pthread_mutex_init(&fs->journal.lock, 0);
+    pthread_cond_init(&fs->journal.changed, 0);
+    pthread_rwlock_init(&fs->journal.entries_lock, 0);
+    return fs;
+}
+
+void fs_close( struct fs *fs ) {
+    //unmount the filesystem if it is mounted and release the handle; the disk stays open
+    if(!fs) return;
+    if(fs->mountedOrNah) fs_unmount_r(fs);
+    pthread_mutex_destroy(&fs->inode_table_lock);
+    pthread_mutex_destroy(&fs->bitmap_lock);
+    pthread_mutex_destroy(&fs->create_lock);
+    pthread_mutex_destroy(&fs->journal.lock);
+    pthread_cond_destroy(&fs->journal.changed);
+    pthread_rwlock_destroy(&fs->journal.entries_lock);
+    free(fs->journal.entries);
+    free(fs->journal.revoked);
+    free(fs);
+}
+
+//the filesystem behind the calls that take no handle, on the default disk
+static struct fs default_fs = {
+    .dirty_hi = -1,
+    .inode_table_lock = PTHREAD_MUTEX_INITIALIZER,
+    .bitmap_lock = PTHREAD_MUTEX_INITIALIZER,
+    .create_lock = PTHREAD_MUTEX_INITIALIZER,
+    .journal.lock = PTHREAD_MUTEX_INITIALIZER,
+    .journal.changed = PTHREAD_COND_INITIALIZER,
+    .journal.entries_lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+//follow the default disk to whatever disk_init opened last; a mounted filesystem keeps the disk it was mounted from
+static struct fs *fs_default() {
+    if(!default_fs.mountedOrNah) default_fs.disk = disk_default();
+    return &default_fs;
+}
+
+void fs_debug() {
+    fs_debug_r(fs_default());
+}
+
+int fs_check( int flags, int nthreads, struct fs_check_report *report ) {
+    return fs_check_r(fs_default(), flags, nthreads, report);
+}
+
+int fs_dump( int fd, int mode ) {
+    return fs_dump_r(fs_default(), fd, mode);
+}
+
+int fs_format() {
+    return fs_format_mode_r(fs_default(), FS_FORMAT_ZERO);
+}
+
+int fs_format_mode( int mode ) {
+    return fs_format_mode_r(fs_default(), mode);
+}
+
+int fs_mount() {
+    return fs_mount_r(fs_default());
+}
+
+int fs_unmount() {
+    return fs_unmount_r(fs_default());
+}
+
+int fs_sync() {
+    return fs_sync_r(fs_default());
+}
+
+int fs_create() {
+    return fs_create_r(fs_default());
+}
+
+int fs_create_batch( int *inumbers, int n ) {
+    return fs_create_batch_r(fs_default(), inumbers, n);
+}
+
+int fs_delete( int inumber ) {
+    return fs_delete_r(fs_default(), inumber);
+}
+
+int fs_delete_batch( const int *inumbers, int n ) {
+    return fs_delete_batch_r(fs_default(), inumbers, n);
+}
+
+int fs_truncate( int inumber, int size ) {
+    return fs_truncate_r(fs_default(), inumber, size);
+}
+
+int fs_getsize( int inumber ) {
+    return fs_getsize_r(fs_default(), inumber);
+}
+
+int fs_seek( int inumber, int offset, int whence ) {
+    return fs_seek_r(fs_default(), inumber, offset, whence);
+}
+
+int fs_read( int inumber, char *data, int length, int offset ) {
+    return fs_read_r(fs_default(), inumber, data, length, offset);
+}
+
+int fs_write( int inumber, const char *data, int length, int offset ) {
+    return fs_write_r(fs_default(), inumber, data, length, offset);
+}
+
+int fs_read_fd( int inumber, int fd, int length, int offset ) {
+    return fs_read_fd_r(fs_default(), inumber, fd, length, offset);
+}
+
+int fs_write_fd( int inumber, int fd, int length, int offset ) {
+    return fs_write_fd_r(fs_default(), inumber, fd, length, offset);
+}
+
+void fs_stats( struct fs_stats *stats ) {
+    fs_stats_r(fs_default(), stats);
+}
+
+void fs_stats_reset() {
+    fs_stats_reset_r(fs_default());
+}
@@ -1,15 +1,121 @@
 #ifndef FS_H
 #define FS_H
 
+#define FS_FORMAT_ZERO    0 //write zeros over every data block
+#define FS_FORMAT_DISCARD 1 //punch the data area out of the image file, zeroing only if that is not supported
+#define FS_FORMAT_FAST    2 //rewrite only the superblock, inode table and bitmap
+#define FS_FORMAT_EXTENTS 4 //or'd into one of the above: files created on the new filesystem map their blocks with extents
+
+#define FS_DUMP_JSON    0 //fs_dump writes one JSON object
+#define FS_DUMP_CSV     1 //fs_dump writes CSV, a header row before each kind of record
+#define FS_DUMP_SUMMARY 2 //or'd into one of the above: per-file counts and the histograms, without each file's block lists
+
+/*
+A struct fs is one filesystem on an open struct disk, with its own inode
+table, allocator and locks, so a process can mount several images at once.
+The calls without a handle work on the filesystem of the default disk
+opened by disk_init.
+*/
+
+struct disk;
+struct fs;
+
+//operations counted by fs_stats
+#define FS_OP_FORMAT  0
+#define FS_OP_MOUNT   1
+#define FS_OP_CREATE  2
+#define FS_OP_DELETE  3
+#define FS_OP_GETSIZE 4
+#define FS_OP_READ    5
+#define FS_OP_WRITE   6
+#define FS_OP_TRUNCATE 7
+#define FS_OP_SEEK    8
+#define FS_OP_COUNT   9
+
+//what fs_seek looks for
+#define FS_SEEK_DATA 0 //the next byte that has been written
+#define FS_SEEK_HOLE 1 //the next byte of a hole, a part of the file never written, or the end of the file
+
+#define FS_LATENCY_BUCKETS 24 //bucket k counts calls of [2^k, 2^(k+1)) microseconds; 0 is under 2us, the last is everything slower
+
+struct fs_op_stats {
+    long long calls;
+    long long bytes;       //bytes read or written
+    long long reads;       //block reads from the image made during the call
+    long long writes;      //block writes to the image made during the call
+    long long hits;        //block cache hits during the call
+    long long misses;      //block cache misses during the call
+    long long nanoseconds; //total time spent in the call
+    long long latency[FS_LATENCY_BUCKETS];
+};
+
+struct fs_stats {
+    struct fs_op_stats op[FS_OP_COUNT];
+};
+
+#define FS_CHECK_REPAIR 1 //fs_check fixes what it finds instead of only reporting it
+
+//what fs_check found; the counts are from before any repair
+struct fs_check_report {
+    int inodes;       //valid inodes checked
+    int blocks;       //blocks in use, the superblock, inode table, bitmap and journal included
+    int bad_inodes;   //inodes of no known kind, cleared by a repair
+    int out_of_range; //pointers and extents naming blocks outside the data area, made holes by a repair
+    int duplicates;   //blocks claimed more than once; a repair leaves each to its first claim in inode order
+    int bad_sizes;    //inodes whose size does not match what they map, trimmed to agree by a repair
+    int leaked;       //blocks in use in the free map that nothing refers to
+    int missing;      //blocks referred to that the free map has free
+    int repaired;     //set if a repair changed anything
+};
+
+struct fs *fs_open( struct disk *disk );
+void fs_close( struct fs *fs );
+
+void fs_debug_r( struct fs *fs );
+int  fs_check_r( struct fs *fs, int flags, int nthreads, struct fs_check_report *report );
+int  fs_dump_r( struct fs *fs, int fd, int mode );
+int  fs_format_mode_r( struct fs *fs, int mode );
+int  fs_mount_r( struct fs *fs );
+int  fs_unmount_r( struct fs *fs );
+int  fs_sync_r( struct fs *fs );
+int  fs_create_r( struct fs *fs );
+int  fs_create_batch_r( struct fs *fs, int *inumbers, int n );
+int  fs_delete_r( struct fs *fs, int inumber );
+int  fs_delete_batch_r( struct fs *fs, const int *inumbers, int n );
+int  fs_truncate_r( struct fs *fs, int inumber, int size );
+int  fs_getsize_r( struct fs *fs, int inumber );
+int  fs_seek_r( struct fs *fs, int inumber, int offset, int whence );
+int  fs_read_r( struct fs *fs, int inumber, char *data, int length, int offset );
+int  fs_write_r( struct fs *fs, int inumber, const char *data, int length, int offset );
+int  fs_read_fd_r( struct fs *fs, int inumber, int fd, int length, int offset );
+int  fs_write_fd_r( struct fs *fs, int inumber, int fd, int length, int offset );
+void fs_stats_r( struct fs *fs, struct fs_stats *stats );
+void fs_stats_reset_r( struct fs *fs );
+const char *fs_op_name( int op );
+
 void fs_debug();
+int  fs_check( int flags, int nthreads, struct fs_check_report *report );
+int  fs_dump( int fd, int mode );
 int  fs_format();
+int  fs_format_mode( int mode );
 int  fs_mount();
+int  fs_unmount();
+int  fs_sync();
 
 int  fs_create();
+int  fs_create_batch( int *inumbers, int n );
 int  fs_delete( int inumber );
-int  fs_getsize();
+int  fs_delete_batch( const int *inumbers, int n );
+int  fs_truncate( int inumber, int size );
+int  fs_getsize( int inumber );
+int  fs_seek( int inumber, int offset, int whence );
 
 int  fs_read( int inumber, char *data, int length, int offset );
 int  fs_write( int inumber, const char *data, int length, int offset );
+int  fs_read_fd( int inumber, int fd, int length, int offset );
+int  fs_write_fd( int inumber, int fd, int length, int offset );
+
+void fs_stats( struct fs_stats *stats );
+void fs_stats_reset();
 
 #endif
@@ -0,0 +1,131 @@
+
+/*
+Consistency checker for simplefs images.
+
+Mounts an image, which replays its journal, and runs fs_check over it: every
+inode is walked on a pool of threads and the blocks it refers to are checked
+against the data area, each other and the free block map.  One line is
+printed for each kind of problem found, with a count.  With -r the problems
+are repaired as well: broken references become holes, a block claimed twice
+stays with the first inode to claim it, sizes are trimmed to what the inodes
+map and the free block map is rebuilt from what is left.
+
+Exits with 0 if the image was clean, 1 if it was repaired, and 4 if problems
+were left on it.
+*/
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define FSCK_CLEAN     0
+#define FSCK_REPAIRED  1
+#define FSCK_PROBLEMS  4
+#define FSCK_FAILED    8
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void problem( FILE *out, int count, const char *what )
+{
+    if(count) fprintf(out,"%d %s\n",count,what);
+}
+
+int main( int argc, char *argv[] )
+{
+    struct fs_check_report report;
+    struct stat info;
+    struct disk *disk;
+    struct fs *fs;
+    int opt, backend = DISK_BACKEND_FILE, flags = 0, nthreads = 0, verbose = 0, clean, stdoutfd;
+    double start, elapsed;
+    const char *image;
+    FILE *out;
+
+    while((opt = getopt(argc,argv,"mdrt:v"))!=-1) {
+        if(opt=='m') {
+            backend = DISK_BACKEND_MMAP;
+        } else if(opt=='d') {
+            backend = DISK_BACKEND_DIRECT;
+        } else if(opt=='r') {
+            flags |= FS_CHECK_REPAIR;
+        } else if(opt=='t') {
+            nthreads = atoi(optarg);
+        } else if(opt=='v') {
+            verbose = 1;
+        } else {
+            fprintf(stderr,"use: %s [-m|-d] [-r] [-t threads] [-v] <diskfile>\n",argv[0]);
+            return FSCK_FAILED;
+        }
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr,"use: %s [-m|-d] [-r] [-t threads] [-v] <diskfile>\n",argv[0]);
+        return FSCK_FAILED;
+    }
+    image = argv[optind];
+
+    if(stat(image,&info) < 0) {
+        fprintf(stderr,"couldn't open %s: %s\n",image,strerror(errno));
+        return FSCK_FAILED;
+    }
+    if(info.st_size < DISK_BLOCK_SIZE) {
+        fprintf(stderr,"%s is too small to hold a filesystem\n",image);
+        return FSCK_FAILED;
+    }
+
+    //results go to the real stdout; what the library prints goes to stderr while mounting, so the reason a mount
+    //fails is not lost, and is dropped after that unless -v is given
+    stdoutfd = dup(1);
+    out = fdopen(stdoutfd,"w");
+    if(!verbose) dup2(2,1);
+
+    disk = disk_open(image,info.st_size / DISK_BLOCK_SIZE,backend);
+    if(!disk) {
+        fprintf(stderr,"couldn't open %s: %s\n",image,strerror(errno));
+        return FSCK_FAILED;
+    }
+    fs = fs_open(disk);
+    if(!fs || !fs_mount_r(fs)) {
+        fflush(stdout);
+        fprintf(stderr,"couldn't mount the filesystem on %s\n",image);
+        return FSCK_FAILED;
+    }
+    fflush(stdout);
+    if(!verbose) freopen("/dev/null","w",stdout);
+
+    start = now();
+    clean = fs_check_r(fs,flags,nthreads,&report);
+    elapsed = now() - start;
+
+    fprintf(out,"%s: %d inodes, %d blocks in use, checked in %.3f seconds\n",image,report.inodes,report.blocks,elapsed);
+    problem(out,report.bad_inodes,"inodes of no known kind");
+    problem(out,report.out_of_range,"references to blocks outside the data area");
+    problem(out,report.duplicates,"blocks claimed by more than one reference");
+    problem(out,report.bad_sizes,"inodes whose size does not match their blocks");
+    problem(out,report.leaked,"blocks marked in use that nothing refers to");
+    problem(out,report.missing,"blocks referred to that are marked free");
+    if(clean) {
+        fprintf(out,"clean\n");
+    } else if(report.repaired) {
+        fprintf(out,"repaired\n");
+    } else {
+        fprintf(out,"problems found, run with -r to repair\n");
+    }
+    fclose(out);
+
+    fs_unmount_r(fs);
+    fs_close(fs);
+    disk_close_r(disk);
+    return clean ? FSCK_CLEAN : report.repaired ? FSCK_REPAIRED : FSCK_PROBLEMS;
+}
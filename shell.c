@@ -4,173 +4,404 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
+static int run_command( const char *line );
+static void report( const char *fmt, ... );
+static int do_repeat( int count, const char *command );
 static int do_copyin( const char *filename, int inumber );
+static int do_copyin_dir( const char *dirname );
 static int do_copyout( int inumber, const char *filename );
+static int do_copyout_stream( int inumber, FILE *file, const char *filename );
+static int format_mode( const char *name );
+static int dump_mode( const char *name );
+static void show_stats();
+static int do_create_batch( int count );
+static int do_delete_range( int first, int last );
+
+static int mounted = 0;
+
+//batch mode runs a script or a pipe: no prompts, fully buffered output, and only results and errors are printed
+static int batch = 0;
 
 int main( int argc, char *argv[] )
 {
     char line[1024];
-    char cmd[1024];
-    char arg1[1024];
-    char arg2[1024];
-    int inumber, result, args;
+    int result, opt, failures = 0;
+    int backend = DISK_BACKEND_FILE;
+    FILE *script = stdin;
+
+    while((opt = getopt(argc,argv,"mdbf:"))!=-1) {
+        if(opt=='m') {
+            backend = DISK_BACKEND_MMAP;
+        } else if(opt=='d') {
+            backend = DISK_BACKEND_DIRECT;
+        } else if(opt=='b') {
+            batch = 1;
+        } else if(opt=='f' && script==stdin) {
+            batch = 1;
+            script = fopen(optarg,"r");
+            if(!script) {
+                printf("couldn't open %s: %s\n",optarg,strerror(errno));
+                return 1;
+            }
+        } else {
+            printf("use: %s [-m|-d] [-b] [-f script] <diskfile> <nblocks>\n",argv[0]);
+            return 1;
+        }
+    }
 
-    if(argc!=3) {
-        printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+    if(argc-optind!=2) {
+        printf("use: %s [-m|-d] [-b] [-f script] <diskfile> <nblocks>\n",argv[0]);
         return 1;
     }
 
-    if(!disk_init(argv[1],atoi(argv[2]))) {
-        printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+    if(batch) setvbuf(stdout,0,_IOFBF,1<<16);
+
+    if(!disk_init_backend(argv[optind],atoi(argv[optind+1]),backend)) {
+        printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
         return 1;
     }
 
-    printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+    report("opened emulated disk image %s with %d blocks\n",argv[optind],disk_size());
 
     while(1) {
-        printf(" simplefs> ");
-        fflush(stdout);
+        if(!batch) {
+            printf(" simplefs> ");
+            fflush(stdout);
+        }
+
+        if(!fgets(line,sizeof(line),script)) break;
+        line[strcspn(line,"\n")] = 0;
+
+        result = run_command(line);
+        if(result<0) break;
+        if(!result) failures += 1;
+    }
 
-        if(!fgets(line,sizeof(line),stdin)) break;
+    if(mounted) fs_unmount();
 
-        if(line[0]=='\n') continue;
-        line[strlen(line)-1] = 0;
+    report("closing emulated disk.\n");
+    disk_close();
+    if(script!=stdin) fclose(script);
+
+    //a script that had a command fail says so in the exit status
+    return batch && failures ? 1 : 0;
+}
+
+//run one command line; returns 1 if it worked, 0 if it failed, and -1 for quit
+static int run_command( const char *line )
+{
+    char cmd[1024];
+    char arg1[1024];
+    char arg2[1024];
+    int inumber, size, result = 1, args, rest = -1;
 
-        args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
-        if(args==0) continue;
+    args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+    if(args<1) return 1;
 
-        if(!strcmp(cmd,"format")) {
-            if(args==1) {
-                if(fs_format()) {
-                    printf("disk formatted.\n");
-                } else {
-                    printf("format failed!\n");
-                }
+    if(!strcmp(cmd,"format")) {
+        if(args==1 || (args==2 && format_mode(arg1)>=0) || (args==3 && format_mode(arg1)>=0 && !strcmp(arg2,"extents"))) {
+            if(fs_format_mode((args>=2 ? format_mode(arg1) : FS_FORMAT_ZERO) | (args==3 ? FS_FORMAT_EXTENTS : 0))) {
+                report("disk formatted.\n");
             } else {
-                printf("use: format\n");
-            }
-        } else if(!strcmp(cmd,"mount")) {
-            if(args==1) {
-                if(fs_mount()) {
-                    printf("disk mounted.\n");
-                } else {
-                    printf("mount failed!\n");
-                }
+                printf("format failed!\n");
+                result = 0;
+            }
+        } else {
+            printf("use: format [zero|discard|fast] [extents]\n");
+            result = 0;
+        }
+    } else if(!strcmp(cmd,"mount")) {
+        if(args==1) {
+            if(fs_mount()) {
+                mounted = 1;
+                report("disk mounted.\n");
             } else {
-                printf("use: mount\n");
+                printf("mount failed!\n");
+                result = 0;
             }
-        } else if(!strcmp(cmd,"debug")) {
-            if(args==1) {
-                fs_debug();
+        } else {
+            printf("use: mount\n");
+            result = 0;
+        }
+    } else if(!strcmp(cmd,"unmount")) {
+        if(args==1) {
+            if(fs_unmount()) {
+                mounted = 0;
+                report("disk unmounted.\n");
             } else {
-                printf("use: debug\n");
-            }
-        } else if(!strcmp(cmd,"getsize")) {
-            if(args==2) {
-                inumber = atoi(arg1);
-                result = fs_getsize(inumber);
-                if(result>=0) {
-                    printf("inode %d has size %d\n",inumber,result);
-                } else {
-                    printf("getsize failed!\n");
-                }
+                printf("unmount failed!\n");
+                result = 0;
+            }
+        } else {
+            printf("use: unmount\n");
+            result = 0;
+        }
+    } else if(!strcmp(cmd,"debug")) {
+        if(args==1) {
+            fs_debug();
+        } else if(dump_mode(arg1)>=0 && (args==2 || (args==3 && !strcmp(arg2,"summary")))) {
+            //the dump is written straight to the descriptor, after anything still in stdout's buffer
+            fflush(stdout);
+            if(!fs_dump(fileno(stdout),dump_mode(arg1) | (args==3 ? FS_DUMP_SUMMARY : 0))) {
+                printf("debug failed!\n");
+                result = 0;
+            }
+        } else {
+            printf("use: debug [json|csv] [summary]\n");
+            result = 0;
+        }
+    } else if(!strcmp(cmd,"getsize")) {
+        if(args==2) {
+            inumber = atoi(arg1);
+            size = fs_getsize(inumber);
+            if(size>=0) {
+                printf("inode %d has size %d\n",inumber,size);
             } else {
-                printf("use: getsize <inumber>\n");
+                printf("getsize failed!\n");
+                result = 0;
             }
+        } else {
+            printf("use: getsize <inumber>\n");
+            result = 0;
+        }
 
-        } else if(!strcmp(cmd,"create")) {
-            if(args==1) {
-                inumber = fs_create();
-                if(inumber>0) {
-                    printf("created inode %d\n",inumber);
-                } else {
-                    printf("create failed!\n");
-                }
+    } else if(!strcmp(cmd,"create")) {
+        if(args==1) {
+            inumber = fs_create();
+            if(inumber>0) {
+                printf("created inode %d\n",inumber);
+            } else {
+                printf("create failed!\n");
+                result = 0;
+            }
+        } else if(args==2 && atoi(arg1)>0) {
+            result = do_create_batch(atoi(arg1));
+        } else {
+            printf("use: create [count]\n");
+            result = 0;
+        }
+    } else if(!strcmp(cmd,"delete")) {
+        if(args==2) {
+            inumber = atoi(arg1);
+            if(fs_delete(inumber)) {
+                report("inode %d deleted.\n",inumber);
             } else {
-                printf("use: create\n");
-            }
-        } else if(!strcmp(cmd,"delete")) {
-            if(args==2) {
-                inumber = atoi(arg1);
-                if(fs_delete(inumber)) {
-                    printf("inode %d deleted.\n",inumber);
-                } else {
-                    printf("delete failed!\n");	
-                }
+                printf("delete failed!\n");
+                result = 0;
+            }
+        } else if(args==3 && atoi(arg2)>=atoi(arg1)) {
+            result = do_delete_range(atoi(arg1),atoi(arg2));
+        } else {
+            printf("use: delete <inumber> [last]\n");
+            result = 0;
+        }
+    } else if(!strcmp(cmd,"truncate")) {
+        if(args==3) {
+            inumber = atoi(arg1);
+            if(fs_truncate(inumber,atoi(arg2))) {
+                report("inode %d truncated to %d bytes\n",inumber,atoi(arg2));
             } else {
-                printf("use: delete <inumber>\n");
-            }
-        } else if(!strcmp(cmd,"cat")) {
-            if(args==2) {
-                inumber = atoi(arg1);
-                if(!do_copyout(inumber,"/dev/stdout")) {
-                    printf("cat failed!\n");
-                }
+                printf("truncate failed!\n");
+                result = 0;
+            }
+        } else {
+            printf("use: truncate <inumber> <size>\n");
+            result = 0;
+        }
+    } else if(!strcmp(cmd,"cat")) {
+        if(args==2) {
+            inumber = atoi(arg1);
+            if(!do_copyout_stream(inumber,stdout,"stdout")) {
+                printf("cat failed!\n");
+                result = 0;
+            }
+        } else {
+            printf("use: cat <inumber>\n");
+            result = 0;
+        }
+
+    } else if(!strcmp(cmd,"copyin")) {
+        if(args==3) {
+            inumber = atoi(arg2);
+            if(do_copyin(arg1,inumber)) {
+                report("copied file %s to inode %d\n",arg1,inumber);
             } else {
-                printf("use: cat <inumber>\n");
+                printf("copy failed!\n");
+                result = 0;
             }
+        } else if(args==2) {
+            result = do_copyin_dir(arg1);
+        } else {
+            printf("use: copyin <filename> <inumber> | copyin <directory>\n");
+            result = 0;
+        }
 
-        } else if(!strcmp(cmd,"copyin")) {
-            if(args==3) {
-                inumber = atoi(arg2);
-                if(do_copyin(arg1,inumber)) {
-                    printf("copied file %s to inode %d\n",arg1,inumber);
-                } else {
-                    printf("copy failed!\n");
-                }
+    } else if(!strcmp(cmd,"copyout")) {
+        if(args==3) {
+            inumber = atoi(arg1);
+            if(do_copyout(inumber,arg2)) {
+                report("copied inode %d to file %s\n",inumber,arg2);
             } else {
-                printf("use: copyin <filename> <inumber>\n");
+                printf("copy failed!\n");
+                result = 0;
             }
+        } else {
+            printf("use: copyout <inumber> <filename>\n");
+            result = 0;
+        }
 
-        } else if(!strcmp(cmd,"copyout")) {
-            if(args==3) {
-                inumber = atoi(arg1);
-                if(do_copyout(inumber,arg2)) {
-                    printf("copied inode %d to file %s\n",inumber,arg2);
-                } else {
-                    printf("copy failed!\n");
-                }
+    } else if(!strcmp(cmd,"sync")) {
+        if(args==1) {
+            if(mounted) fs_sync(); else disk_sync();
+            report("disk synced.\n");
+        } else {
+            printf("use: sync\n");
+            result = 0;
+        }
+    } else if(!strcmp(cmd,"cache")) {
+        if(args==2) {
+            if(disk_cache_resize(atoi(arg1))) {
+                report("block cache set to %d blocks\n",atoi(arg1));
             } else {
-                printf("use: copyout <inumber> <filename>\n");
-            }
-
-        } else if(!strcmp(cmd,"help")) {
-            printf("Commands are:\n");
-            printf("    format\n");
-            printf("    mount\n");
-            printf("    debug\n");
-            printf("    create\n");
-            printf("    delete  <inode>\n");
-            printf("    cat     <inode>\n");
-            printf("    copyin  <file> <inode>\n");
-            printf("    copyout <inode> <file>\n");
-            printf("    help\n");
-            printf("    quit\n");
-            printf("    exit\n");
-        } else if(!strcmp(cmd,"quit")) {
-            break;
-        } else if(!strcmp(cmd,"exit")) {
-            break;
+                printf("cache resize failed!\n");
+                result = 0;
+            }
+        } else {
+            printf("use: cache <nblocks>\n");
+            result = 0;
+        }
+    } else if(!strcmp(cmd,"stats")) {
+        if(args==1) {
+            show_stats();
+        } else if(args==2 && !strcmp(arg1,"reset")) {
+            fs_stats_reset();
+            report("statistics reset.\n");
+        } else {
+            printf("use: stats [reset]\n");
+            result = 0;
+        }
+    } else if(!strcmp(cmd,"repeat")) {
+        sscanf(line," %*s %*s %n",&rest);
+        if(args>=3 && atoi(arg1)>0 && rest>0) {
+            result = do_repeat(atoi(arg1),line+rest);
+        } else {
+            printf("use: repeat <count> <command>\n");
+            result = 0;
+        }
+    } else if(!strcmp(cmd,"time")) {
+        sscanf(line," %*s %n",&rest);
+        if(args>=2 && rest>0) {
+            result = do_repeat(1,line+rest);
         } else {
-            printf("unknown command: %s\n",cmd);
-            printf("type 'help' for a list of commands.\n");
-            result = 1;
+            printf("use: time <command>\n");
+            result = 0;
         }
+    } else if(!strcmp(cmd,"help")) {
+        printf("Commands are:\n");
+        printf("    format  [zero|discard|fast] [extents]\n");
+        printf("    mount\n");
+        printf("    unmount\n");
+        printf("    debug   [json|csv] [summary]\n");
+        printf("    create  [count]\n");
+        printf("    delete  <inode> [last]\n");
+        printf("    truncate <inode> <size>\n");
+        printf("    cat     <inode>\n");
+        printf("    copyin  <file> <inode>\n");
+        printf("    copyin  <directory>\n");
+        printf("    copyout <inode> <file>\n");
+        printf("    sync\n");
+        printf("    cache   <nblocks>\n");
+        printf("    stats   [reset]\n");
+        printf("    repeat  <count> <command>\n");
+        printf("    time    <command>\n");
+        printf("    help\n");
+        printf("    quit\n");
+        printf("    exit\n");
+    } else if(!strcmp(cmd,"quit")) {
+        return -1;
+    } else if(!strcmp(cmd,"exit")) {
+        return -1;
+    } else {
+        printf("unknown command: %s\n",cmd);
+        printf("type 'help' for a list of commands.\n");
+        result = 0;
     }
 
-    printf("closing emulated disk.\n");
-    disk_close();
+    return result;
+}
+
+//print a line that only says a command did what it was asked, which batch mode leaves out
+static void report( const char *fmt, ... )
+{
+    va_list args;
+
+    if(batch) return;
+    va_start(args,fmt);
+    vprintf(fmt,args);
+    va_end(args);
+}
 
-    return 0;
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles( const void *a, const void *b )
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+//run a command count times and print how long the calls took; the latencies include whatever the command prints
+static int do_repeat( int count, const char *command )
+{
+    double *times = malloc(sizeof(double)*count);
+    double start, total = 0;
+    int i, result = 1, failed = 0;
+
+    if(!times) {
+        printf("repeat failed!\n");
+        return 0;
+    }
+    for(i = 0; i < count; i++) {
+        start = now();
+        result = run_command(command);
+        times[i] = (now() - start) * 1e6;
+        total += times[i];
+        if(result<0) {
+            i += 1;
+            break;
+        }
+        if(!result) failed += 1;
+    }
+
+    qsort(times,i,sizeof(double),compare_doubles);
+    if(i==1) {
+        printf("%s: %.1f us\n",command,times[0]);
+    } else {
+        printf("%s: %d runs, %d failed, %.1f us total, avg %.1f min %.1f p50 %.1f p99 %.1f max %.1f us\n",command,i,failed,
+            total,total/i,times[0],times[i/2],times[(int)(i*0.99)],times[i-1]);
+    }
+    free(times);
+    return result<0 ? -1 : !failed;
 }
 
 static int do_copyin( const char *filename, int inumber )
 {
     FILE *file;
-    int offset=0, result, actual;
+    struct stat info;
+    int offset=0, result, actual, failed=0;
     char buffer[16384];
 
     file = fopen(filename,"r");
@@ -179,6 +410,22 @@ static int do_copyin( const char *filename, int inumber )
         return 0;
     }
 
+    //a regular file is handed to the filesystem whole, which copies it straight onto the image
+    if(!fstat(fileno(file),&info) && S_ISREG(info.st_mode) && info.st_size <= INT_MAX) {
+        actual = info.st_size ? fs_write_fd(inumber,fileno(file),info.st_size,0) : 0;
+        fclose(file);
+        if(actual<0) {
+            printf("ERROR: fs_write_fd return invalid result %d\n",actual);
+            return 0;
+        }
+        report("%d bytes copied\n",actual);
+        if(actual!=info.st_size) {
+            printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,(int)info.st_size);
+            return 0;
+        }
+        return 1;
+    }
+
     while(1) {
         result = fread(buffer,1,sizeof(buffer),file);
         if(result<=0) break;
@@ -186,27 +433,74 @@ static int do_copyin( const char *filename, int inumber )
             actual = fs_write(inumber,buffer,result,offset);
             if(actual<0) {
                 printf("ERROR: fs_write return invalid result %d\n",actual);
+                failed = 1;
                 break;
             }
             offset += actual;
             if(actual!=result) {
                 printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+                failed = 1;
                 break;
             }
         }
     }
 
-    printf("%d bytes copied\n",offset);
+    report("%d bytes copied\n",offset);
 
     fclose(file);
-    return 1;
+    return !failed;
+}
+
+//copy every regular file of a directory, in name order, into an inode of its own, made with one batch create
+static int do_copyin_dir( const char *dirname )
+{
+    struct dirent **names;
+    struct stat info;
+    char path[4096];
+    int *inumbers;
+    int n, i, count = 0, created, ok = 1;
+
+    n = scandir(dirname,&names,0,alphasort);
+    if(n<0) {
+        printf("couldn't open %s: %s\n",dirname,strerror(errno));
+        return 0;
+    }
+
+    //keep only the regular files
+    for(i = 0; i < n; i++) {
+        snprintf(path,sizeof(path),"%s/%s",dirname,names[i]->d_name);
+        if(!stat(path,&info) && S_ISREG(info.st_mode)) {
+            names[count++] = names[i];
+        } else {
+            free(names[i]);
+        }
+    }
+
+    inumbers = malloc(sizeof(int)*(count+1));
+    created = inumbers && count ? fs_create_batch(inumbers,count) : 0;
+    if(created<count) {
+        printf("only %d of %d inodes could be created\n",created,count);
+        ok = 0;
+    }
+    for(i = 0; i < count; i++) {
+        snprintf(path,sizeof(path),"%s/%s",dirname,names[i]->d_name);
+        if(i<created && do_copyin(path,inumbers[i])) {
+            printf("copied file %s to inode %d\n",path,inumbers[i]);
+        } else if(i<created) {
+            ok = 0;
+        }
+        free(names[i]);
+    }
+    free(names);
+    free(inumbers);
+    return ok;
 }
 
 static int do_copyout( int inumber, const char *filename )
 {
     FILE *file;
-    int offset=0, result;
-    char buffer[16384];
+    struct stat info;
+    int result, size;
 
     file = fopen(filename,"w");
     if(!file) {
@@ -214,16 +508,167 @@ static int do_copyout( int inumber, const char *filename )
         return 0;
     }
 
-    while(1) {
-        result = fs_read(inumber,buffer,sizeof(buffer),offset);
-        if(result<=0) break;
-        fwrite(buffer,1,result,file);
-        offset += result;
+    //a regular file is filled straight from the image; the holes it skips stay holes since the file starts empty
+    size = fs_getsize(inumber);
+    if(size > 0 && !fstat(fileno(file),&info) && S_ISREG(info.st_mode)) {
+        result = fs_read_fd(inumber,fileno(file),size,0);
+        if(result != size) {
+            printf("ERROR: only copied %d of %d bytes to %s\n",result > 0 ? result : 0,size,filename);
+            fclose(file);
+            return 0;
+        }
+        if(ftruncate(fileno(file),size)) {
+            printf("couldn't extend %s: %s\n",filename,strerror(errno));
+            fclose(file);
+            return 0;
+        }
+        report("%d bytes copied\n",result);
+        fclose(file);
+        return 1;
     }
 
-    printf("%d bytes copied\n",offset);
+    result = do_copyout_stream(inumber,file,filename);
 
     fclose(file);
+    return result;
+}
+
+//write an inode out to a stream from where the stream is now
+static int do_copyout_stream( int inumber, FILE *file, const char *filename )
+{
+    int offset=0, result, size, data, hole, chunk, skipped=0;
+    char buffer[16384];
+
+    size = fs_getsize(inumber);
+    if(size < 0) return 0;
+    while(offset < size) {
+        //a hole is seeked over, leaving a hole in the copy too, and written out as zeros where the file cannot seek
+        data = fs_seek(inumber,offset,FS_SEEK_DATA);
+        if(data < 0) data = size;
+        skipped = data > offset;
+        if(skipped && fseek(file,data-offset,SEEK_CUR)) {
+            memset(buffer,0,sizeof(buffer));
+            while(offset < data) {
+                chunk = data-offset < (int)sizeof(buffer) ? data-offset : (int)sizeof(buffer);
+                if(fwrite(buffer,1,chunk,file) != (size_t)chunk) break;
+                offset += chunk;
+            }
+            skipped = 0;
+            if(offset < data) break;
+        }
+        offset = data;
+        if(offset == size) break;
+
+        //then the data up to the next hole
+        hole = fs_seek(inumber,offset,FS_SEEK_HOLE);
+        if(hole < 0) break;
+        while(offset < hole) {
+            chunk = hole-offset < (int)sizeof(buffer) ? hole-offset : (int)sizeof(buffer);
+            result = fs_read(inumber,buffer,chunk,offset);
+            if(result<=0 || fwrite(buffer,1,result,file) != (size_t)result) break;
+            offset += result;
+        }
+        if(offset < hole) break;
+    }
+
+    //a hole at the end is only a seek so far, which does not make the copy longer
+    fflush(file);
+    if(ferror(file)) {
+        printf("couldn't write %s: %s\n",filename,strerror(errno));
+        return 0;
+    }
+    if(offset < size) {
+        printf("ERROR: only copied %d of %d bytes to %s\n",offset,size,filename);
+        return 0;
+    }
+    if(skipped && ftruncate(fileno(file),ftell(file))) {
+        printf("couldn't extend %s: %s\n",filename,strerror(errno));
+        return 0;
+    }
+
+    report("%d bytes copied\n",offset);
     return 1;
 }
 
+static int format_mode( const char *name )
+{
+    if(!strcmp(name,"zero")) return FS_FORMAT_ZERO;
+    if(!strcmp(name,"discard")) return FS_FORMAT_DISCARD;
+    if(!strcmp(name,"fast")) return FS_FORMAT_FAST;
+    return -1;
+}
+
+static int dump_mode( const char *name )
+{
+    if(!strcmp(name,"json")) return FS_DUMP_JSON;
+    if(!strcmp(name,"csv")) return FS_DUMP_CSV;
+    return -1;
+}
+
+static void show_stats()
+{
+    struct fs_stats stats;
+    struct fs_op_stats *op;
+    int i, k, lo;
+
+    fs_stats(&stats);
+
+    printf("%-8s %8s %12s %8s %8s %8s %8s %10s\n","op","calls","bytes","reads","writes","hits","misses","avg us");
+    for(i = 0; i < FS_OP_COUNT; i += 1) {
+        op = &stats.op[i];
+        printf("%-8s %8lld %12lld %8lld %8lld %8lld %8lld %10.1f\n",fs_op_name(i),op->calls,op->bytes,
+            op->reads,op->writes,op->hits,op->misses,op->calls ? op->nanoseconds/1000.0/op->calls : 0.0);
+    }
+
+    //latency histograms, one line per operation that has been called
+    for(i = 0; i < FS_OP_COUNT; i += 1) {
+        op = &stats.op[i];
+        if(!op->calls) continue;
+        printf("%s latency:",fs_op_name(i));
+        for(k = 0; k < FS_LATENCY_BUCKETS; k += 1) {
+            if(!op->latency[k]) continue;
+            lo = k ? 1<<k : 0;
+            if(k==FS_LATENCY_BUCKETS-1) {
+                printf(" >=%dus:%lld",lo,op->latency[k]);
+            } else {
+                printf(" %d-%dus:%lld",lo,2<<k,op->latency[k]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+static int do_create_batch( int count )
+{
+    int *inumbers = malloc(sizeof(int)*count);
+    int created;
+
+    if(!inumbers) {
+        printf("create failed!\n");
+        return 0;
+    }
+    created = fs_create_batch(inumbers,count);
+    if(created>0) {
+        printf("created %d inodes, %d through %d\n",created,inumbers[0],inumbers[created-1]);
+    } else {
+        printf("create failed!\n");
+    }
+    free(inumbers);
+    return created==count;
+}
+
+static int do_delete_range( int first, int last )
+{
+    int *inumbers = malloc(sizeof(int)*(last-first+1));
+    int i, deleted;
+
+    if(!inumbers) {
+        printf("delete failed!\n");
+        return 0;
+    }
+    for(i = first; i <= last; i++) inumbers[i-first] = i;
+    deleted = fs_delete_batch(inumbers,last-first+1);
+    printf("%d of %d inodes deleted.\n",deleted,last-first+1);
+    free(inumbers);
+    return deleted==last-first+1;
+}
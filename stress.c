@@ -0,0 +1,275 @@
+
+/*
+Multi-threaded stress test for the simplefs core.
+
+Starts several threads on one mounted filesystem.  Each runs a seeded mix of
+creates, writes, reads, truncates and deletes through the fs_*_r calls on
+files of its own, and all of them read one shared file as well.  Every read
+is compared with a copy, kept in memory, of what the file should hold.  Once
+the threads are done every file is read back whole and fs_check_r has to
+find nothing wrong; then the filesystem is unmounted and mounted again and
+both are done once more.  One line is printed for each thread and each check.
+*/
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define STRESS_BLOCKS      40000 //size of the scratch image, enough for every file at its largest
+#define STRESS_THREADS     8
+#define STRESS_MAX_THREADS 64
+#define STRESS_FILES       4     //files each thread has alive at once
+#define STRESS_OPS         2000  //operations per thread
+#define STRESS_MAX_FILE    (1024 * 1024)
+#define STRESS_MAX_WRITE   65536
+#define STRESS_SHARED_SIZE (2 * 1024 * 1024)
+
+//one file of a thread and what it should hold
+struct file {
+    int inumber; //zero while the slot has no file
+    int size;
+    char *data;
+};
+
+struct worker {
+    pthread_t thread;
+    unsigned seed;
+    struct file files[STRESS_FILES];
+    char *buffer;
+    int creates, writes, reads, truncates, deletes;
+    char failure[256]; //empty while everything matched
+};
+
+static struct fs *fs;
+static int backend = DISK_BACKEND_FILE;
+static int formatmode = FS_FORMAT_FAST;
+static int nops = STRESS_OPS;
+static const char *image = "stress.img";
+
+static int shared; //inode of the file every thread reads
+static char *shareddata;
+
+static struct disk *open_scratch()
+{
+    struct disk *disk;
+
+    unlink(image);
+    disk = disk_open(image,STRESS_BLOCKS,backend);
+    if(!disk) {
+        fprintf(stderr,"couldn't open %s: %s\n",image,strerror(errno));
+        exit(1);
+    }
+    return disk;
+}
+
+//compare length bytes of an inode from offset with what they should be; returns one if they match
+static int matches( int inumber, const char *expected, int size, int offset, int length, char *buffer )
+{
+    int want = length < size - offset ? length : size - offset;
+    return fs_read_r(fs,inumber,buffer,length,offset) == want && !memcmp(buffer,expected + offset,want);
+}
+
+static void *run_worker( void *arg )
+{
+    struct worker *w = arg;
+    struct file *f;
+    int op, i, offset, length, size;
+
+    for(op = 0; op < nops && !w->failure[0]; op += 1) {
+        f = &w->files[rand_r(&w->seed) % STRESS_FILES];
+        if(!f->inumber) {
+            f->inumber = fs_create_r(fs);
+            f->size = 0;
+            memset(f->data,0,STRESS_MAX_FILE);
+            w->creates += 1;
+            if(!f->inumber) snprintf(w->failure,sizeof(w->failure),"fs_create failed");
+            continue;
+        }
+
+        switch(rand_r(&w->seed) % 10) {
+        case 0: case 1: case 2:
+            //a write anywhere up to a little past the end, leaving a hole when it starts past it
+            offset = rand_r(&w->seed) % (f->size + STRESS_MAX_WRITE);
+            length = 1 + rand_r(&w->seed) % STRESS_MAX_WRITE;
+            if(offset + length > STRESS_MAX_FILE) offset = STRESS_MAX_FILE - length;
+            for(i = 0; i < length; i += 1) w->buffer[i] = rand_r(&w->seed);
+            if(fs_write_r(fs,f->inumber,w->buffer,length,offset) != length) {
+                snprintf(w->failure,sizeof(w->failure),"short write of %d bytes at %d to inode %d",length,offset,f->inumber);
+                break;
+            }
+            memcpy(f->data + offset,w->buffer,length);
+            if(offset + length > f->size) f->size = offset + length;
+            w->writes += 1;
+            break;
+        case 3: case 4: case 5:
+            if(!f->size) break;
+            offset = rand_r(&w->seed) % f->size;
+            length = 1 + rand_r(&w->seed) % STRESS_MAX_WRITE;
+            if(!matches(f->inumber,f->data,f->size,offset,length,w->buffer)) {
+                snprintf(w->failure,sizeof(w->failure),"read of %d bytes at %d from inode %d does not match",length,offset,f->inumber);
+            }
+            w->reads += 1;
+            break;
+        case 6: case 7:
+            offset = rand_r(&w->seed) % STRESS_SHARED_SIZE;
+            length = 1 + rand_r(&w->seed) % STRESS_MAX_WRITE;
+            if(!matches(shared,shareddata,STRESS_SHARED_SIZE,offset,length,w->buffer)) {
+                snprintf(w->failure,sizeof(w->failure),"read of %d bytes at %d from the shared file does not match",length,offset);
+            }
+            w->reads += 1;
+            break;
+        case 8:
+            //cut the file back or grow it with a hole
+            size = rand_r(&w->seed) % 3 ? rand_r(&w->seed) % (f->size + 1) : f->size + rand_r(&w->seed) % STRESS_MAX_WRITE;
+            if(size > STRESS_MAX_FILE) size = STRESS_MAX_FILE;
+            if(!fs_truncate_r(fs,f->inumber,size) || fs_getsize_r(fs,f->inumber) != size) {
+                snprintf(w->failure,sizeof(w->failure),"truncating inode %d to %d bytes failed",f->inumber,size);
+                break;
+            }
+            if(size < f->size) memset(f->data + size,0,f->size - size);
+            f->size = size;
+            w->truncates += 1;
+            break;
+        default:
+            if(!fs_delete_r(fs,f->inumber)) {
+                snprintf(w->failure,sizeof(w->failure),"deleting inode %d failed",f->inumber);
+                break;
+            }
+            f->inumber = 0;
+            w->deletes += 1;
+            break;
+        }
+    }
+    return 0;
+}
+
+//read every file of a thread back whole; returns one if they all match
+static int verify( struct worker *w )
+{
+    int i;
+    struct file *f;
+
+    for(i = 0; i < STRESS_FILES; i += 1) {
+        f = &w->files[i];
+        if(!f->inumber) continue;
+        if(fs_getsize_r(fs,f->inumber) != f->size || (f->size && !matches(f->inumber,f->data,f->size,0,f->size,w->buffer))) {
+            snprintf(w->failure,sizeof(w->failure),"inode %d does not hold what was written to it",f->inumber);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//run fs_check_r and print what it found; returns one if the filesystem was clean
+static int check( FILE *out, const char *when )
+{
+    struct fs_check_report report;
+    int clean = fs_check_r(fs,0,0,&report);
+
+    fprintf(out,"check %s: %d inodes, %d blocks in use: %s\n",when,report.inodes,report.blocks,clean ? "ok" : "FAILED");
+    if(!clean) {
+        fprintf(out,"    %d bad inodes, %d out of range, %d duplicates, %d bad sizes, %d leaked, %d missing\n",
+            report.bad_inodes,report.out_of_range,report.duplicates,report.bad_sizes,report.leaked,report.missing);
+    }
+    return clean;
+}
+
+int main( int argc, char *argv[] )
+{
+    struct worker *workers;
+    struct disk *disk;
+    unsigned seed = 1;
+    int opt, verbose = 0, nthreads = STRESS_THREADS, i, j, failed = 0, stdoutfd;
+    FILE *out;
+
+    while((opt = getopt(argc,argv,"mdet:n:s:v"))!=-1) {
+        if(opt=='m') {
+            backend = DISK_BACKEND_MMAP;
+        } else if(opt=='d') {
+            backend = DISK_BACKEND_DIRECT;
+        } else if(opt=='e') {
+            formatmode = FS_FORMAT_FAST | FS_FORMAT_EXTENTS;
+        } else if(opt=='t') {
+            nthreads = atoi(optarg);
+        } else if(opt=='n') {
+            nops = atoi(optarg);
+        } else if(opt=='s') {
+            seed = atoi(optarg);
+        } else if(opt=='v') {
+            verbose = 1;
+        } else {
+            fprintf(stderr,"use: %s [-m|-d] [-e] [-t threads] [-n operations] [-s seed] [-v] [scratchimage]\n",argv[0]);
+            return 1;
+        }
+    }
+    if(optind < argc) image = argv[optind];
+    if(nthreads < 1) nthreads = 1;
+    if(nthreads > STRESS_MAX_THREADS) nthreads = STRESS_MAX_THREADS;
+
+    //results go to the real stdout; the messages the library prints are dropped unless -v is given
+    stdoutfd = dup(1);
+    out = fdopen(stdoutfd,"w");
+    if(!verbose) freopen("/dev/null","w",stdout);
+
+    disk = open_scratch();
+    fs = fs_open(disk);
+    if(!fs_format_mode_r(fs,formatmode) || !fs_mount_r(fs)) {
+        fprintf(stderr,"couldn't set up a filesystem on %s\n",image);
+        return 1;
+    }
+
+    shareddata = malloc(STRESS_SHARED_SIZE);
+    for(i = 0; i < STRESS_SHARED_SIZE; i += 1) shareddata[i] = rand_r(&seed);
+    shared = fs_create_r(fs);
+    if(!shared || fs_write_r(fs,shared,shareddata,STRESS_SHARED_SIZE,0) != STRESS_SHARED_SIZE) {
+        fprintf(stderr,"couldn't write the shared file\n");
+        return 1;
+    }
+
+    workers = calloc(nthreads,sizeof(struct worker));
+    for(i = 0; i < nthreads; i += 1) {
+        workers[i].seed = seed * 7919 + i;
+        workers[i].buffer = malloc(STRESS_MAX_FILE);
+        for(j = 0; j < STRESS_FILES; j += 1) workers[i].files[j].data = malloc(STRESS_MAX_FILE);
+    }
+    for(i = 0; i < nthreads; i += 1) {
+        if(pthread_create(&workers[i].thread,0,run_worker,&workers[i])) {
+            fprintf(stderr,"couldn't start thread %d\n",i);
+            return 1;
+        }
+    }
+    for(i = 0; i < nthreads; i += 1) pthread_join(workers[i].thread,0);
+
+    for(i = 0; i < nthreads; i += 1) {
+        if(!workers[i].failure[0]) verify(&workers[i]);
+    }
+    if(!check(out,"after the run")) failed = 1;
+
+    //everything has to come back the same from the image
+    fs_unmount_r(fs);
+    if(!fs_mount_r(fs)) {
+        fprintf(out,"mounting again FAILED\n");
+        return 1;
+    }
+    for(i = 0; i < nthreads; i += 1) {
+        if(!workers[i].failure[0]) verify(&workers[i]);
+        fprintf(out,"thread %d: %d creates, %d writes, %d reads, %d truncates, %d deletes: %s\n",i,
+            workers[i].creates,workers[i].writes,workers[i].reads,workers[i].truncates,workers[i].deletes,
+            workers[i].failure[0] ? workers[i].failure : "ok");
+        if(workers[i].failure[0]) failed = 1;
+    }
+    if(!check(out,"after mounting again")) failed = 1;
+
+    fs_close(fs);
+    disk_close_r(disk);
+    unlink(image);
+    fprintf(out,"%s\n",failed ? "FAILED" : "all threads and checks ok");
+    fclose(out);
+    return failed ? 1 : 0;
+}